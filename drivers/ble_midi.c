@@ -5,13 +5,21 @@
  * Exposes functions for sending MIDI notes and checking connection status.
  * Handles internal ATT read callbacks and BTstack event routing.
  *
+ * Up to BLE_MIDI_MAX_CONNECTIONS centrals can listen at once, e.g. a DAW and
+ * a synth app. Each step packet is encoded once and fanned out to every
+ * connection's own send queue, with flow control per connection.
  *
  * Copyright 2025, Hiroyuki OYAMA
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
+#include <stdio.h>
+
 #include "btstack.h"
 #include "midi_service.h"
+#include "pico/time.h"
+
+#include "drivers/ble_midi.h"
 
 // clang-format off
 static const uint8_t ble_advertising_data[] = {
@@ -28,17 +36,672 @@ typedef enum {
 } attribute_handle_t;
 
 static btstack_packet_callback_registration_t hci_event_callback_registration;
-static hci_con_handle_t con_handle = HCI_CON_HANDLE_INVALID;
+static btstack_packet_callback_registration_t sm_event_callback_registration;
 static btstack_timer_source_t step_timer;
+static void (*step_handler)(btstack_timer_source_t *ts) = NULL;
+static bool step_timer_enabled = false;
+
+/*
+ * Advertising profile. For ADV_FAST_MS after boot or a disconnect the device
+ * advertises every 20 ms so a host finds it at once, then falls back to the
+ * idle interval. When the central that left is bonded (or, at boot, when
+ * there is exactly one bond in the LE device DB), the first ADV_DIRECTED_MS
+ * are low duty cycle directed advertising to it: the bonded host connects
+ * without scanning first.
+ */
+#define ADV_INTERVAL_IDLE 1636  // 1022.5 ms (Apple-recommended), in 0.625 ms units
+#define ADV_INTERVAL_FAST 32    // 20 ms
+#define ADV_FAST_MS 30000
+#define ADV_DIRECTED_MS 2000
+#define ADV_TYPE_IND 0x00
+#define ADV_TYPE_DIRECT_IND_LOW 0x04
+
+typedef enum {
+    ADV_PHASE_DIRECTED,
+    ADV_PHASE_FAST,
+    ADV_PHASE_IDLE,
+} adv_phase_t;
+
+static adv_phase_t adv_phase = ADV_PHASE_IDLE;
+static int adv_peer_index = -1;  // LE device DB entry targeted while directed
+static btstack_timer_source_t adv_timer;
+
+// Wake-to-first-note measurement: connection time and whether a note was sent since.
+static uint64_t wake_time_us = 0;
+static bool wake_note_pending = false;
+static uint32_t wake_latency_us = 0;
+static uint32_t wake_count = 0;  // Measurements so far, so the looper can show each one
+static uint64_t dropout_us = 0;  // When the last central left, for the reconnect time
+static ble_midi_boot_t boot_times = {0};
+
+static bool loopback = false;  // Echo written BLE-MIDI packets back as notifications
+static ble_midi_receive_cb_t receive_handler = NULL;
+
+/*
+ * Sender clock mapping for inbound timestamps: local µs ~ sender ms * 1000 +
+ * rx_offset_us. It follows the fastest delivery seen, so connection-interval
+ * delays drop out; it creeps up by 1/2^RX_OFFSET_CREEP_SHIFT of any excess to
+ * track drift between the two clocks.
+ */
+#define RX_OFFSET_CREEP_SHIFT 8
+#define RX_TIMESTAMP_PERIOD_MS 8192  // 13-bit BLE-MIDI timestamps wrap
+
+/*
+ * Per-step packet builder. Every note of a tick is appended to one BLE-MIDI
+ * packet that shares the header/timestamp bytes and uses running status, so
+ * a busy step costs a single att_server_notify().
+ */
+#define BLE_MIDI_PACKET_MAX 128  // upper bound on payload, further limited by ATT MTU
+
+typedef struct {
+    uint8_t data[BLE_MIDI_PACKET_MAX];
+    uint16_t length;
+    uint8_t running_status;
+    uint32_t first_ms;  // time encoded in the header byte (only 13 bits are sent)
+    uint32_t last_ms;   // time of the most recent message
+    bool echo;          // A loopback echo: sent as written, never merged
+} ble_midi_packet_t;
+
+static ble_midi_packet_t tx_packet;
+static uint16_t tx_capacity = BLE_MIDI_PACKET_MAX;  // Fits the smallest MTU of all connections
+
+/*
+ * Outbound queue of finished packets, drained with ATT can-send-now events so
+ * a full controller buffer delays packets instead of silently losing them.
+ * A new packet is merged into the unsent tail when the timestamps allow it.
+ * On overflow the oldest packet is dropped, and packets that have waited more
+ * than BLE_MIDI_STALE_MS past their time are dropped instead of played late.
+ */
+#define BLE_MIDI_TX_QUEUE_LEN 8
+#define BLE_MIDI_STALE_MS 50
+
+/*
+ * A dropped Note-Off would leave its note hanging on the central, so the
+ * Note-Offs of dropped packets are carried, sent ahead of the next queued
+ * packet and stamped no later than it. Dropped Note-Ons are simply lost. A
+ * channel with more carried Note-Offs than fit gets an All Notes Off instead.
+ */
+#define BLE_MIDI_PENDING_OFFS 16
+#define MIDI_CC_ALL_NOTES_OFF 123
+
+static ble_midi_stats_t stats = {0};
+
+/*
+ * Connection tuning. Shortly after connecting we ask for the shortest
+ * connection interval the host allows and for the 2M PHY; data length
+ * extension is negotiated by BTstack (ENABLE_LE_DATA_LENGTH_EXTENSION).
+ * The resulting parameters are logged so each host/session can be checked.
+ */
+#define CONN_TUNING_DELAY_MS 1000  // Let the host finish discovery first
+#define CONN_INTERVAL_MIN 6        // 7.5 ms, in 1.25 ms units
+#define CONN_INTERVAL_MAX 12       // 15 ms
+#define CONN_LATENCY 0
+#define CONN_SUPERVISION_TIMEOUT 200  // 2 s, in 10 ms units
+#define LE_PHY_2M 0x02
+
+typedef struct {
+    uint16_t interval;  // 1.25 ms units
+    uint16_t latency;
+    uint16_t mtu;
+    uint8_t tx_phy;
+} ble_midi_link_t;
+
+/*
+ * One connected central: its send queue, link tuning and inbound clock
+ * mapping. A slot is free while `handle` is HCI_CON_HANDLE_INVALID.
+ */
+#define BLE_MIDI_MAX_CONNECTIONS MAX_NR_HCI_CONNECTIONS
+_Static_assert(MAX_NR_CONTROLLER_ACL_BUFFERS >= BLE_MIDI_MAX_CONNECTIONS,
+               "every connection needs a controller buffer of its own");
+
+typedef struct {
+    hci_con_handle_t handle;
+    ble_midi_link_t link;
+    ble_midi_packet_t queue[BLE_MIDI_TX_QUEUE_LEN];
+    uint8_t queue_head;
+    uint8_t queue_count;
+    uint8_t in_flight;  // Notifications sent but not yet reported completed
+    uint8_t pending_offs[BLE_MIDI_PENDING_OFFS][2];  // Status and note of carried Note-Offs
+    uint8_t pending_off_count;
+    uint16_t all_off_channels;  // Channels owed an All Notes Off, one bit each
+    btstack_timer_source_t tuning_timer;
+    int64_t rx_offset_us;
+    bool rx_offset_valid;
+    int device_index;  // LE device DB entry of a bonded peer, or -1
+} ble_midi_connection_t;
+
+static ble_midi_connection_t connections[BLE_MIDI_MAX_CONNECTIONS];
+static uint8_t connection_count = 0;
+
+static ble_midi_connection_t *connection_for_handle(hci_con_handle_t handle) {
+    for (uint8_t i = 0; i < BLE_MIDI_MAX_CONNECTIONS; i++) {
+        if (connections[i].handle == handle)
+            return &connections[i];
+    }
+    return NULL;
+}
+
+// Usable payload per notification: ATT MTU minus opcode and handle.
+static uint16_t connection_capacity(const ble_midi_connection_t *connection) {
+    uint16_t mtu = att_server_get_mtu(connection->handle);
+    uint16_t capacity = (mtu > 3) ? mtu - 3 : 0;
+    return (capacity < BLE_MIDI_PACKET_MAX) ? capacity : BLE_MIDI_PACKET_MAX;
+}
+
+// Step packets are built once for all connections, so they fit the smallest MTU.
+static void update_packet_capacity(void) {
+    tx_capacity = BLE_MIDI_PACKET_MAX;
+    for (uint8_t i = 0; i < BLE_MIDI_MAX_CONNECTIONS; i++) {
+        if (connections[i].handle == HCI_CON_HANDLE_INVALID)
+            continue;
+        uint16_t capacity = connection_capacity(&connections[i]);
+        if (capacity < tx_capacity)
+            tx_capacity = capacity;
+    }
+}
+
+static uint16_t packet_capacity(void) { return tx_capacity; }
+
+/*
+ * A packet can only carry timestamps that never go backwards and stay within
+ * one wrap of the 7-bit low part, which receivers resolve against the header.
+ */
+static bool packet_accepts_time(uint32_t ms) {
+    return ms >= tx_packet.last_ms && ms - tx_packet.first_ms < 0x80;
+}
+
+/*
+ * Appends a 3-byte channel message stamped with `ms`. A timestamp byte is
+ * written whenever the time or the status changes; a repeated status at the
+ * same time uses running status and only adds the data bytes.
+ */
+static void packet_append(uint32_t ms, uint8_t status, uint8_t data1, uint8_t data2) {
+    if (tx_packet.length > 0 && !packet_accepts_time(ms))
+        ble_midi_flush();
+
+    bool same_time = (tx_packet.length > 0 && tx_packet.last_ms == ms);
+    bool running = (tx_packet.length > 0 && tx_packet.running_status == status);
+    uint16_t needed = 2 + (same_time && running ? 0 : 1) + (running ? 0 : 1);
+    if (tx_packet.length > 0 && tx_packet.length + needed > packet_capacity()) {
+        ble_midi_flush();
+        same_time = running = false;
+    }
+    if (tx_packet.length == 0) {
+        tx_packet.data[tx_packet.length++] = 0x80 | ((ms >> 7) & 0x3F);  // header
+        tx_packet.first_ms = ms;
+    }
+    if (!(same_time && running))
+        tx_packet.data[tx_packet.length++] = 0x80 | (ms & 0x7F);  // timestamp
+    if (!running) {
+        tx_packet.data[tx_packet.length++] = status;
+        tx_packet.running_status = status;
+    }
+    tx_packet.data[tx_packet.length++] = data1;
+    tx_packet.data[tx_packet.length++] = data2;
+    tx_packet.last_ms = ms;
+}
+
+/*
+ * Appends a single-byte System Real-Time message stamped with `ms`. It always
+ * gets its own timestamp byte, and the next channel message restates its
+ * status, so no receiver can take its data bytes as following the real-time
+ * byte.
+ */
+static void packet_append_realtime(uint32_t ms, uint8_t status) {
+    if (tx_packet.length > 0 &&
+        (!packet_accepts_time(ms) || tx_packet.length + 2 > packet_capacity()))
+        ble_midi_flush();
+    if (tx_packet.length == 0) {
+        tx_packet.data[tx_packet.length++] = 0x80 | ((ms >> 7) & 0x3F);  // header
+        tx_packet.first_ms = ms;
+    }
+    tx_packet.data[tx_packet.length++] = 0x80 | (ms & 0x7F);  // timestamp
+    tx_packet.data[tx_packet.length++] = status;
+    tx_packet.running_status = 0;
+    tx_packet.last_ms = ms;
+}
+
+// Appends the messages of `packet` (without its header) to `tail` if the result is valid.
+static bool tx_queue_merge(const ble_midi_connection_t *connection, ble_midi_packet_t *tail,
+                           const ble_midi_packet_t *packet) {
+    uint16_t length = tail->length + packet->length - 1;
+    if (tail->echo || packet->echo || length > connection_capacity(connection) ||
+        packet->first_ms < tail->last_ms ||
+        packet->last_ms - tail->first_ms >= 0x80)
+        return false;
+    memcpy(&tail->data[tail->length], &packet->data[1], packet->length - 1);
+    tail->length = length;
+    tail->running_status = packet->running_status;
+    tail->last_ms = packet->last_ms;
+    return true;
+}
+
+static bool tx_queue_has_offs(const ble_midi_connection_t *connection) {
+    return connection->pending_off_count > 0 || connection->all_off_channels != 0;
+}
+
+// Keeps a Note-Off of a dropped packet until it can be sent.
+static void tx_queue_carry_off(ble_midi_connection_t *connection, uint8_t status, uint8_t note) {
+    uint8_t channel = status & 0x0F;
+    if (connection->all_off_channels & (1u << channel))
+        return;  // The All Notes Off covers it
+    for (uint8_t i = 0; i < connection->pending_off_count; i++) {
+        if ((connection->pending_offs[i][0] & 0x0F) == channel &&
+            connection->pending_offs[i][1] == note)
+            return;
+    }
+    if (connection->pending_off_count == BLE_MIDI_PENDING_OFFS) {
+        connection->all_off_channels |= 1u << channel;
+        uint8_t kept = 0;
+        for (uint8_t i = 0; i < connection->pending_off_count; i++) {
+            if ((connection->pending_offs[i][0] & 0x0F) != channel) {
+                connection->pending_offs[kept][0] = connection->pending_offs[i][0];
+                connection->pending_offs[kept][1] = connection->pending_offs[i][1];
+                kept++;
+            }
+        }
+        connection->pending_off_count = kept;
+        return;
+    }
+    connection->pending_offs[connection->pending_off_count][0] = status;
+    connection->pending_offs[connection->pending_off_count][1] = note;
+    connection->pending_off_count++;
+}
+
+/*
+ * Drops the oldest queued packet, carrying its Note-Offs unless it is an
+ * echo, whose notes were never played here. Every status byte follows a
+ * timestamp byte, as packet_append writes them, so any other high byte after
+ * data bytes is the next timestamp.
+ */
+static void tx_queue_drop(ble_midi_connection_t *connection) {
+    const ble_midi_packet_t *packet = &connection->queue[connection->queue_head];
+    uint8_t status = 0;
+    uint16_t i = 1;  // data[0] is the header
+    while (!packet->echo && i < packet->length) {
+        if (packet->data[i] & 0x80) {
+            i++;  // Timestamp
+            if (i < packet->length && (packet->data[i] & 0x80))
+                status = packet->data[i++];
+            continue;
+        }
+        if (status < 0x80 || status >= 0xF0)
+            break;  // No channel message to follow
+        uint8_t needed = ((status & 0xE0) == 0xC0) ? 1 : 2;  // Program change, channel pressure
+        if (i + needed > packet->length)
+            break;
+        uint8_t type = status & 0xF0;
+        if (type == 0x80 || (type == 0x90 && packet->data[i + 1] == 0)) {
+            tx_queue_carry_off(connection, status, packet->data[i]);
+            stats.offs_carried++;
+        }
+        i += needed;
+    }
+    connection->queue_head = (connection->queue_head + 1) % BLE_MIDI_TX_QUEUE_LEN;
+    connection->queue_count--;
+}
+
+/*
+ * Encodes what fits one notification into `packet`, stamped with `ms`: an All
+ * Notes Off for each channel owed one, then the carried Note-Offs. Returns how
+ * many Note-Offs it holds and sets `channels` to the All Notes Offs.
+ */
+static uint8_t tx_queue_encode_offs(const ble_midi_connection_t *connection, uint32_t ms,
+                                    ble_midi_packet_t *packet, uint16_t *channels) {
+    uint16_t capacity = connection_capacity(connection);
+    packet->data[0] = 0x80 | ((ms >> 7) & 0x3F);  // header
+    packet->length = 1;
+    packet->first_ms = packet->last_ms = ms;
+    packet->running_status = 0;
+    *channels = 0;
+    for (uint8_t channel = 0; channel < 16; channel++) {
+        if (!(connection->all_off_channels & (1u << channel)))
+            continue;
+        if (packet->length + 4 > capacity)
+            return 0;
+        *channels |= 1u << channel;
+        packet->data[packet->length++] = 0x80 | (ms & 0x7F);  // timestamp
+        packet->data[packet->length++] = 0xB0 | channel;
+        packet->data[packet->length++] = MIDI_CC_ALL_NOTES_OFF;
+        packet->data[packet->length++] = 0;
+    }
+    uint8_t count = 0;
+    while (count < connection->pending_off_count) {
+        uint8_t status = connection->pending_offs[count][0];
+        bool running = (packet->running_status == status);
+        if (packet->length + (running ? 2 : 4) > capacity)
+            break;
+        if (!running) {
+            packet->data[packet->length++] = 0x80 | (ms & 0x7F);  // timestamp
+            packet->data[packet->length++] = status;
+            packet->running_status = status;
+        }
+        packet->data[packet->length++] = connection->pending_offs[count][1];
+        packet->data[packet->length++] = (status & 0xF0) == 0x90 ? 0 : 0x40;  // Release velocity
+        count++;
+    }
+    return count;
+}
+
+// The All Notes Offs of `channels` and the first `count` carried Note-Offs were sent.
+static void tx_queue_offs_sent(ble_midi_connection_t *connection, uint16_t channels,
+                               uint8_t count) {
+    connection->all_off_channels &= ~channels;
+    connection->pending_off_count -= count;
+    memmove(connection->pending_offs, connection->pending_offs[count],
+            connection->pending_off_count * sizeof(connection->pending_offs[0]));
+}
+
+static void tx_queue_push(ble_midi_connection_t *connection, const ble_midi_packet_t *packet) {
+    if (connection->queue_count > 0) {
+        uint8_t tail =
+            (connection->queue_head + connection->queue_count - 1) % BLE_MIDI_TX_QUEUE_LEN;
+        if (tx_queue_merge(connection, &connection->queue[tail], packet)) {
+            stats.packets_merged++;
+            return;
+        }
+    }
+    if (connection->queue_count == BLE_MIDI_TX_QUEUE_LEN) {
+        tx_queue_drop(connection);
+        stats.dropped_full++;
+    }
+    connection->queue[(connection->queue_head + connection->queue_count) % BLE_MIDI_TX_QUEUE_LEN] =
+        *packet;
+    connection->queue_count++;
+    if (connection->queue_count > stats.max_queue_depth)
+        stats.max_queue_depth = connection->queue_count;
+}
+
+static void tx_queue_pop(ble_midi_connection_t *connection) {
+    connection->queue_head = (connection->queue_head + 1) % BLE_MIDI_TX_QUEUE_LEN;
+    connection->queue_count--;
+}
+
+// Deepest send queue over all connections, for the stats.
+static void update_queue_depth(void) {
+    stats.queue_depth = 0;
+    for (uint8_t i = 0; i < BLE_MIDI_MAX_CONNECTIONS; i++) {
+        if (connections[i].queue_count > stats.queue_depth)
+            stats.queue_depth = connections[i].queue_count;
+    }
+}
+
+/*
+ * The controller's ACL buffers are shared by all links. BTstack uses as many
+ * as the controller reported, capped at MAX_NR_CONTROLLER_ACL_BUFFERS: the
+ * free slots plus the notifications still in flight (other traffic in flight
+ * only makes the count smaller). A connection may fill all but one per other
+ * connection, so every link keeps a buffer that a peer with a long connection
+ * interval or a lossy link cannot take.
+ */
+static bool connection_may_send(const ble_midi_connection_t *connection) {
+    int total = hci_number_free_acl_slots_for_handle(connection->handle);
+    if (total < 0)
+        total = 0;
+    for (uint8_t i = 0; i < BLE_MIDI_MAX_CONNECTIONS; i++)
+        total += connections[i].in_flight;
+    int share = total - (connection_count - 1);
+    return connection->in_flight < share;
+}
+
+/*
+ * Sends queued packets of one connection until its queue is empty, its share
+ * of controller buffers is used, or the stack is full. Carried Note-Offs go
+ * first, in a notification of their own that is never stale. A full stack
+ * raises ATT_EVENT_CAN_SEND_NOW for this connection; a used-up share is
+ * retried when the controller reports completed packets.
+ */
+static void tx_queue_send(ble_midi_connection_t *connection) {
+    uint32_t now_ms = (uint32_t)(time_us_64() / 1000);
+    while (connection->queue_count > 0 || tx_queue_has_offs(connection)) {
+        ble_midi_packet_t *packet = &connection->queue[connection->queue_head];
+        if (connection->queue_count > 0 &&
+            (int32_t)(now_ms - packet->last_ms) > BLE_MIDI_STALE_MS) {
+            tx_queue_drop(connection);
+            stats.dropped_stale++;
+            continue;
+        }
+        ble_midi_packet_t offs;
+        uint16_t offs_channels = 0;
+        uint8_t offs_count = 0;
+        bool carrying = tx_queue_has_offs(connection);
+        if (carrying) {
+            uint32_t ms = now_ms;
+            if (connection->queue_count > 0 && (int32_t)(packet->first_ms - now_ms) < 0)
+                ms = packet->first_ms;  // Not after the notes that follow
+            offs_count = tx_queue_encode_offs(connection, ms, &offs, &offs_channels);
+            packet = &offs;
+        }
+        if (!connection_may_send(connection))
+            break;
+        if (!att_server_can_send_packet_now(connection->handle) ||
+            att_server_notify(connection->handle, MIDI_NOTE_HANDLE, packet->data,
+                              packet->length) != ERROR_CODE_SUCCESS) {
+            att_server_request_can_send_now_event(connection->handle);
+            break;
+        }
+        if (carrying)
+            tx_queue_offs_sent(connection, offs_channels, offs_count);
+        else
+            tx_queue_pop(connection);
+        connection->in_flight++;
+        stats.packets_sent++;
+        if (wake_note_pending) {
+            wake_note_pending = false;
+            wake_latency_us = (uint32_t)(time_us_64() - wake_time_us);
+            wake_count++;
+            if (boot_times.first_note_us == 0)
+                boot_times.first_note_us = (uint32_t)time_us_64();
+        }
+    }
+    update_queue_depth();
+}
+
+static void tx_queue_send_all(void) {
+    for (uint8_t i = 0; i < BLE_MIDI_MAX_CONNECTIONS; i++) {
+        if (connections[i].queue_count > 0 || tx_queue_has_offs(&connections[i]))
+            tx_queue_send(&connections[i]);
+    }
+}
+
+// Returns the buffers the controller has finished with to their connections.
+static void handle_completed_packets(const uint8_t *packet) {
+    uint8_t handles = packet[2];
+    for (uint8_t i = 0; i < handles; i++) {
+        hci_con_handle_t handle = little_endian_read_16(packet, 3 + 4 * i) & 0x0fff;
+        uint16_t completed = little_endian_read_16(packet, 5 + 4 * i);
+        ble_midi_connection_t *connection = connection_for_handle(handle);
+        if (connection == NULL)
+            continue;
+        connection->in_flight =
+            completed < connection->in_flight ? connection->in_flight - completed : 0;
+    }
+    tx_queue_send_all();  // Connections at their share may go on
+}
+
+static void advertising_set(adv_phase_t phase) {
+    uint16_t interval = (phase == ADV_PHASE_IDLE) ? ADV_INTERVAL_IDLE : ADV_INTERVAL_FAST;
+    uint8_t adv_type = ADV_TYPE_IND;
+    int peer_addr_type = 0;
+    bd_addr_t peer_addr = {0};
+    if (phase == ADV_PHASE_DIRECTED) {
+        sm_key_t irk;
+        le_device_db_info(adv_peer_index, &peer_addr_type, peer_addr, irk);
+        adv_type = ADV_TYPE_DIRECT_IND_LOW;
+    }
+    adv_phase = phase;
+    if (connection_count == BLE_MIDI_MAX_CONNECTIONS)
+        return;  // No slot left; the next disconnect restarts advertising
+    gap_advertisements_set_params(interval, interval, adv_type, (uint8_t)peer_addr_type, peer_addr,
+                                  0x07, 0x00);
+    gap_advertisements_enable(1);
+}
+
+static void advertising_timer_handler(btstack_timer_source_t *ts) {
+    if (adv_phase != ADV_PHASE_DIRECTED) {
+        advertising_set(ADV_PHASE_IDLE);
+        return;
+    }
+    // The peer did not come back in time: become discoverable for everyone
+    advertising_set(ADV_PHASE_FAST);
+    btstack_run_loop_set_timer(ts, ADV_FAST_MS - ADV_DIRECTED_MS);
+    btstack_run_loop_add_timer(ts);
+}
+
+// Starts the fast advertising window, directed to `peer_index` first when it is >= 0.
+static void advertising_start(int peer_index) {
+    bool directed = (peer_index >= 0 && connection_count == 0);
+    adv_peer_index = peer_index;
+    advertising_set(directed ? ADV_PHASE_DIRECTED : ADV_PHASE_FAST);
+    btstack_run_loop_remove_timer(&adv_timer);
+    btstack_run_loop_set_timer_handler(&adv_timer, advertising_timer_handler);
+    btstack_run_loop_set_timer(&adv_timer, directed ? ADV_DIRECTED_MS : ADV_FAST_MS);
+    btstack_run_loop_add_timer(&adv_timer);
+}
+
+// The bond to reconnect to at boot: the only LE device DB entry, or -1 if none or several.
+static int advertising_boot_peer(void) {
+    int found = -1;
+    for (int i = 0; i < le_device_db_max_count(); i++) {
+        int addr_type;
+        bd_addr_t addr;
+        sm_key_t irk;
+        le_device_db_info(i, &addr_type, addr, irk);
+        if (addr_type == BD_ADDR_TYPE_UNKNOWN)
+            continue;
+        if (found >= 0)
+            return -1;
+        found = i;
+    }
+    return found;
+}
 
 static void start_advertising(void) {
-    uint16_t adv_int_min = 800;
-    uint16_t adv_int_max = 800;
-    uint8_t adv_type = 0;
-    bd_addr_t null_addr = {0};
-    gap_advertisements_set_params(adv_int_min, adv_int_max, adv_type, 0, null_addr, 0x07, 0x00);
     gap_advertisements_set_data(sizeof(ble_advertising_data), (uint8_t *)ble_advertising_data);
-    gap_advertisements_enable(1);
+    advertising_start(advertising_boot_peer());
+}
+
+static void log_connection_interval(const ble_midi_connection_t *connection, const char *reason) {
+    uint32_t interval_us = connection->link.interval * 1250u;
+    printf("[BLE] 0x%04x %s: interval %lu.%02lu ms, latency %u\n", connection->handle, reason,
+           (unsigned long)(interval_us / 1000), (unsigned long)(interval_us % 1000) / 10,
+           connection->link.latency);
+}
+
+// Runs CONN_TUNING_DELAY_MS after connecting: request low latency and the 2M PHY.
+static void tuning_timer_handler(btstack_timer_source_t *ts) {
+    ble_midi_connection_t *connection = btstack_run_loop_get_timer_context(ts);
+    if (connection->handle == HCI_CON_HANDLE_INVALID)
+        return;
+    gap_request_connection_parameter_update(connection->handle, CONN_INTERVAL_MIN,
+                                            CONN_INTERVAL_MAX, CONN_LATENCY,
+                                            CONN_SUPERVISION_TIMEOUT);
+    gap_le_set_phy(connection->handle, 0, LE_PHY_2M, LE_PHY_2M, 0);
+}
+
+static void handle_connection_complete(uint8_t *packet) {
+    ble_midi_connection_t *connection = connection_for_handle(HCI_CON_HANDLE_INVALID);
+    if (hci_subevent_le_connection_complete_get_status(packet) != ERROR_CODE_SUCCESS)
+        return;
+    if (connection == NULL)
+        return;  // More links than slots; MAX_NR_HCI_CONNECTIONS prevents this
+    connection->handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
+    connection->link.interval = hci_subevent_le_connection_complete_get_conn_interval(packet);
+    connection->link.latency = hci_subevent_le_connection_complete_get_conn_latency(packet);
+    connection->link.mtu = att_server_get_mtu(connection->handle);
+    connection->link.tx_phy = 1;
+    connection->queue_head = connection->queue_count = 0;
+    connection->in_flight = 0;
+    connection->pending_off_count = 0;
+    connection->all_off_channels = 0;
+    connection->rx_offset_valid = false;
+    connection->device_index = -1;  // Until the security manager recognises a bond
+    connection_count++;
+    update_packet_capacity();
+    log_connection_interval(connection, "connected");
+
+    if (connection_count == 1) {
+        wake_time_us = time_us_64();
+        wake_note_pending = true;
+        if (boot_times.connected_us == 0)
+            boot_times.connected_us = (uint32_t)wake_time_us;
+        if (dropout_us != 0)
+            printf("[BLE] reconnected %lu ms after the dropout\n",
+                   (unsigned long)((wake_time_us - dropout_us) / 1000));
+        if (step_timer_enabled) {
+            // Resume the parked step clock
+            btstack_run_loop_remove_timer(&step_timer);
+            btstack_run_loop_set_timer(&step_timer, 0);
+            btstack_run_loop_add_timer(&step_timer);
+        }
+    }
+    if (adv_phase == ADV_PHASE_DIRECTED)
+        advertising_set(ADV_PHASE_FAST);  // Directed adverts only reach the peer that is back
+    else
+        advertising_set(adv_phase);  // Stay discoverable for the next central
+
+    btstack_run_loop_set_timer_handler(&connection->tuning_timer, tuning_timer_handler);
+    btstack_run_loop_set_timer_context(&connection->tuning_timer, connection);
+    btstack_run_loop_set_timer(&connection->tuning_timer, CONN_TUNING_DELAY_MS);
+    btstack_run_loop_add_timer(&connection->tuning_timer);
+}
+
+static void handle_disconnection_complete(uint8_t *packet) {
+    ble_midi_connection_t *connection =
+        connection_for_handle(hci_event_disconnection_complete_get_connection_handle(packet));
+    if (connection == NULL)
+        return;
+    btstack_run_loop_remove_timer(&connection->tuning_timer);
+    int device_index = connection->device_index;
+    connection->handle = HCI_CON_HANDLE_INVALID;
+    connection->queue_count = 0;
+    connection->in_flight = 0;
+    connection_count--;
+    update_packet_capacity();
+    update_queue_depth();
+    if (connection_count == 0) {
+        tx_packet.length = 0;
+        tx_packet.running_status = 0;
+        dropout_us = time_us_64();
+    }
+    advertising_start(device_index);
+}
+
+static void handle_le_meta(uint8_t *packet) {
+    ble_midi_connection_t *connection;
+    switch (hci_event_le_meta_get_subevent_code(packet)) {
+        case HCI_SUBEVENT_LE_CONNECTION_COMPLETE:
+            handle_connection_complete(packet);
+            break;
+        case HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE:
+            connection = connection_for_handle(
+                hci_subevent_le_connection_update_complete_get_connection_handle(packet));
+            if (connection == NULL)
+                break;
+            connection->link.interval =
+                hci_subevent_le_connection_update_complete_get_conn_interval(packet);
+            connection->link.latency =
+                hci_subevent_le_connection_update_complete_get_conn_latency(packet);
+            log_connection_interval(connection, "updated");
+            break;
+        case HCI_SUBEVENT_LE_PHY_UPDATE_COMPLETE:
+            connection = connection_for_handle(
+                hci_subevent_le_phy_update_complete_get_connection_handle(packet));
+            if (connection == NULL)
+                break;
+            if (hci_subevent_le_phy_update_complete_get_status(packet) == ERROR_CODE_SUCCESS)
+                connection->link.tx_phy = hci_subevent_le_phy_update_complete_get_tx_phy(packet);
+            printf("[BLE] 0x%04x PHY %uM\n", connection->handle, connection->link.tx_phy);
+            break;
+        case HCI_SUBEVENT_LE_DATA_LENGTH_CHANGE:
+            printf("[BLE] 0x%04x data length tx %u rx %u octets\n",
+                   hci_subevent_le_data_length_change_get_connection_handle(packet),
+                   hci_subevent_le_data_length_change_get_max_tx_octets(packet),
+                   hci_subevent_le_data_length_change_get_max_rx_octets(packet));
+            break;
+        default:
+            break;
+    }
 }
 
 // BTstack event handler that routes incoming events and manages connection state.
@@ -53,16 +716,49 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t *packe
         case BTSTACK_EVENT_STATE:
             if (btstack_event_state_get_state(packet) != HCI_STATE_WORKING)
                 return;
+            boot_times.radio_ready_us = (uint32_t)time_us_64();
             start_advertising();
             break;
+        case SM_EVENT_IDENTITY_RESOLVING_SUCCEEDED: {
+            ble_midi_connection_t *connection =
+                connection_for_handle(sm_event_identity_resolving_succeeded_get_handle(packet));
+            if (connection != NULL)
+                connection->device_index =
+                    sm_event_identity_resolving_succeeded_get_index(packet);
+            break;
+        }
+        case SM_EVENT_IDENTITY_CREATED: {
+            ble_midi_connection_t *connection =
+                connection_for_handle(sm_event_identity_created_get_handle(packet));
+            if (connection != NULL)
+                connection->device_index = sm_event_identity_created_get_index(packet);
+            break;
+        }
         case HCI_EVENT_LE_META:
-            uint8_t subevent = hci_event_le_meta_get_subevent_code(packet);
-            if (subevent == HCI_SUBEVENT_LE_CONNECTION_COMPLETE) {
-                con_handle = hci_subevent_le_connection_complete_get_connection_handle(packet);
-            }
+            handle_le_meta(packet);
+            break;
+        case ATT_EVENT_CAN_SEND_NOW: {
+            ble_midi_connection_t *connection =
+                connection_for_handle(att_event_can_send_now_get_handle(packet));
+            if (connection != NULL)
+                tx_queue_send(connection);
+            break;
+        }
+        case HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS:
+            handle_completed_packets(packet);
             break;
+        case ATT_EVENT_MTU_EXCHANGE_COMPLETE: {
+            ble_midi_connection_t *connection =
+                connection_for_handle(att_event_mtu_exchange_complete_get_handle(packet));
+            if (connection == NULL)
+                break;
+            connection->link.mtu = att_event_mtu_exchange_complete_get_MTU(packet);
+            update_packet_capacity();
+            printf("[BLE] 0x%04x MTU %u\n", connection->handle, connection->link.mtu);
+            break;
+        }
         case HCI_EVENT_DISCONNECTION_COMPLETE:
-            con_handle = HCI_CON_HANDLE_INVALID;
+            handle_disconnection_complete(packet);
             break;
         default:
             break;
@@ -85,32 +781,284 @@ static uint16_t att_read_callback(hci_con_handle_t connection_handle, uint16_t a
     return 0;
 }
 
-// Initialise BTstack for BLE-MIDI and start advertising.
-void ble_midi_init(void (*step_cb)(btstack_timer_source_t *ts), uint32_t step_period_ms) {
+/*
+ * Local time of a message that the sender stamped `timestamp` and that
+ * arrived at `arrival_us`. Each central has its own clock, and so its own
+ * mapping.
+ */
+static uint64_t rx_event_time(ble_midi_connection_t *connection, uint64_t arrival_us,
+                              uint16_t timestamp) {
+    int64_t rx_offset_us = connection->rx_offset_us;
+    if (!connection->rx_offset_valid) {
+        rx_offset_us = (int64_t)arrival_us - (int64_t)timestamp * 1000;
+        connection->rx_offset_valid = true;
+    }
+    // Unwrap to the sender time nearest the one the mapping expects
+    int64_t expected_ms = ((int64_t)arrival_us - rx_offset_us) / 1000;
+    int32_t wrap = (int32_t)((timestamp - expected_ms) & (RX_TIMESTAMP_PERIOD_MS - 1));
+    if (wrap >= RX_TIMESTAMP_PERIOD_MS / 2)
+        wrap -= RX_TIMESTAMP_PERIOD_MS;
+    int64_t sender_us = (expected_ms + wrap) * 1000;
+
+    int64_t delay = (int64_t)arrival_us - (sender_us + rx_offset_us);
+    if (delay < 0)
+        rx_offset_us += delay;  // Faster than any delivery so far
+    else
+        rx_offset_us += delay >> RX_OFFSET_CREEP_SHIFT;
+    connection->rx_offset_us = rx_offset_us;
+    int64_t time_us = sender_us + rx_offset_us;
+    return (time_us < (int64_t)arrival_us) ? (uint64_t)time_us : arrival_us;
+}
+
+// Data bytes that follow `status`; system exclusive is handled separately.
+static uint8_t message_data_length(uint8_t status) {
+    switch (status & 0xF0) {
+        case 0xC0:
+        case 0xD0:
+            return 1;
+        case 0xF0:
+            return (status == 0xF1 || status == 0xF3) ? 1 : (status == 0xF2) ? 2 : 0;
+        default:
+            return 2;
+    }
+}
+
+/*
+ * Splits an inbound BLE-MIDI packet into messages and hands each one to the
+ * receive handler, stamped with its local time rebuilt from the message's
+ * timestamp. Works in place on the ATT buffer, one pass, no copies.
+ * Follows the BLE-MIDI grammar: every message starts with a timestamp byte
+ * unless it continues under running status (and keeps the previous time),
+ * and real-time bytes may appear anywhere, with their own timestamp, even
+ * inside a channel message, which then resumes, or system exclusive, which
+ * is skipped.
+ */
+static void parse_packet(ble_midi_connection_t *connection, const uint8_t *data, uint16_t length,
+                         uint64_t arrival_us) {
+    enum { EXPECT_TIMESTAMP, EXPECT_STATUS, EXPECT_DATA, IN_SYSEX } expect = EXPECT_TIMESTAMP;
+    uint8_t running = 0;
+    uint8_t message[3] = {0};
+    uint8_t count = 0;
+    uint8_t needed = 0;
+    bool resume = false;  // A timestamp cut into `message`; a real-time byte may follow
+    uint64_t message_time_us = arrival_us;
+    bool sysex_timestamp = false;
+    uint16_t timestamp_high = data[0] & 0x3F;
+    int16_t timestamp_low = -1;
+    uint64_t time_us = arrival_us;
+
+    for (uint16_t i = 1; i < length; i++) {  // data[0] is the header
+        uint8_t byte = data[i];
+        bool high = (byte & 0x80) != 0;
+        bool timestamp = high && (expect == IN_SYSEX ? !sysex_timestamp : expect != EXPECT_STATUS);
+        if (timestamp) {
+            uint8_t low = byte & 0x7F;
+            if (low < timestamp_low)
+                timestamp_high = (timestamp_high + 1) & 0x3F;  // Low part wrapped in the packet
+            timestamp_low = low;
+            time_us = rx_event_time(connection, arrival_us, (timestamp_high << 7) | low);
+        }
+        if (expect == IN_SYSEX) {
+            if (!high)
+                continue;
+            if (timestamp) {
+                sysex_timestamp = true;  // A timestamp precedes F7 and real-time bytes
+                continue;
+            }
+            sysex_timestamp = false;
+            if (byte >= 0xF8)
+                receive_handler(time_us, byte, 0, 0);
+            else if (byte == 0xF7)
+                expect = EXPECT_TIMESTAMP;
+            continue;
+        }
+        if (timestamp) {
+            resume = (expect == EXPECT_DATA);
+            expect = EXPECT_STATUS;
+            continue;
+        }
+        if (high) {
+            if (byte >= 0xF8) {
+                // Real-time bytes may sit inside a message, which then carries on
+                receive_handler(time_us, byte, 0, 0);
+                expect = resume ? EXPECT_DATA : EXPECT_TIMESTAMP;
+                resume = false;
+                continue;
+            }
+            expect = EXPECT_TIMESTAMP;
+            resume = false;
+            if (byte == 0xF0) {
+                expect = IN_SYSEX;
+                sysex_timestamp = false;
+                running = 0;  // Continuation packets start with bare data bytes
+                continue;
+            }
+            running = (byte < 0xF0) ? byte : 0;  // System common cancels running status
+            message[0] = byte;
+            message_time_us = time_us;
+            count = 0;
+            needed = message_data_length(byte);
+            if (needed == 0) {
+                receive_handler(time_us, byte, 0, 0);
+                continue;
+            }
+            expect = EXPECT_DATA;
+            continue;
+        }
+        if (expect != EXPECT_DATA) {
+            if (running == 0)
+                continue;  // Stray data byte
+            message[0] = running;  // Running status without a new timestamp
+            message_time_us = time_us;
+            count = 0;
+            needed = message_data_length(running);
+        }
+        message[1 + count++] = byte;
+        expect = EXPECT_DATA;
+        if (count == needed) {
+            receive_handler(message_time_us, message[0], message[1],
+                            (needed > 1) ? message[2] : 0);
+            expect = EXPECT_TIMESTAMP;
+        }
+    }
+}
+
+/*
+ * Handles ATT writes to the MIDI characteristic. Inbound BLE-MIDI packets go
+ * to the receive handler. With loopback on they are instead queued back
+ * unchanged to the writer, so a host can time round trips through the same
+ * send queue the notes use. The echo stays a notification of its own and
+ * ages from when the write arrived.
+ */
+static int att_write_callback(hci_con_handle_t connection_handle, uint16_t att_handle,
+                              uint16_t transaction_mode, uint16_t offset, uint8_t *buffer,
+                              uint16_t buffer_size) {
+    (void)transaction_mode;
+    uint64_t arrival_us = time_us_64();
+    ble_midi_connection_t *connection = connection_for_handle(connection_handle);
+    if (att_handle != MIDI_NOTE_HANDLE || offset != 0 || buffer_size < 2 ||
+        (buffer[0] & 0x80) == 0 || connection == NULL)
+        return 0;
+    if (!loopback) {
+        if (receive_handler != NULL)
+            parse_packet(connection, buffer, buffer_size, arrival_us);
+        return 0;
+    }
+    if (buffer_size > connection_capacity(connection))
+        return 0;
+
+    ble_midi_packet_t echo = {.length = buffer_size, .echo = true};
+    memcpy(echo.data, buffer, buffer_size);
+    echo.first_ms = echo.last_ms = (uint32_t)(arrival_us / 1000);  // Ages from its arrival
+    ble_midi_flush();  // Keep the echo behind the notes queued before it
+    tx_queue_push(connection, &echo);
+    tx_queue_send(connection);
+    return 0;
+}
+
+/*
+ * Initialise BTstack for BLE-MIDI and power the controller up. This returns
+ * once the Bluetooth firmware is loaded; the HCI init sequence and the start
+ * of advertising then run in the background, so the caller can restore its
+ * session meanwhile. `step_cb` may be NULL when the step clock is driven
+ * elsewhere (e.g. core 1).
+ */
+void ble_midi_init(void (*step_cb)(btstack_timer_source_t *ts)) {
+    for (uint8_t i = 0; i < BLE_MIDI_MAX_CONNECTIONS; i++)
+        connections[i].handle = HCI_CON_HANDLE_INVALID;
     l2cap_init();
     sm_init();
-    att_server_init(profile_data, att_read_callback, NULL);
+    att_server_init(profile_data, att_read_callback, att_write_callback);
     hci_event_callback_registration.callback = &packet_handler;
     hci_add_event_handler(&hci_event_callback_registration);
+    sm_event_callback_registration.callback = &packet_handler;
+    sm_add_event_handler(&sm_event_callback_registration);
     att_server_register_packet_handler(packet_handler);
+    step_handler = step_cb;
+
+    hci_power_control(HCI_POWER_ON);
+}
 
-    btstack_run_loop_set_timer_handler(&step_timer, step_cb);
+// Start the step timer given to ble_midi_init(), first firing in `step_period_ms`.
+void ble_midi_start_step_timer(uint32_t step_period_ms) {
+    if (step_handler == NULL)
+        return;
+    btstack_run_loop_set_timer_handler(&step_timer, step_handler);
     btstack_run_loop_set_timer(&step_timer, step_period_ms);
     btstack_run_loop_add_timer(&step_timer);
+    step_timer_enabled = true;
+}
 
-    hci_power_control(HCI_POWER_ON);
+/*
+ * Queues a Note-On scheduled at `time_us` into the current step packet.
+ * The BLE-MIDI timestamp is the 13-bit millisecond part of that time,
+ * letting the host compensate for connection-interval jitter. Velocity 0 is
+ * the Note-Off, encoded as Note-On so it can share the running status.
+ */
+void ble_midi_queue_note(uint64_t time_us, uint8_t channel, uint8_t note, uint8_t velocity) {
+    if (connection_count == 0)
+        return;
+
+    uint32_t ms = (uint32_t)(time_us / 1000);
+    packet_append(ms, 0x90 | (channel & 0x0F), note, velocity);
 }
 
-// Sends a Note-On followed immediately by a Note-Off (percussion “hit”).
-void ble_midi_send_note(uint8_t channel, uint8_t note, uint8_t velocity) {
-    if (con_handle == HCI_CON_HANDLE_INVALID)
+/*
+ * Queues a System Real-Time message (e.g. Timing Clock) scheduled at
+ * `time_us` into the current step packet, interleaved with its notes.
+ */
+void ble_midi_queue_realtime(uint64_t time_us, uint8_t status) {
+    if (connection_count == 0)
         return;
+    packet_append_realtime((uint32_t)(time_us / 1000), status);
+}
+
+/*
+ * Hands the pending step packet, if any, to the send queue of every
+ * connection as a single notification. It was encoded once; each connection
+ * gets a copy that it merges, sends or drops on its own.
+ */
+void ble_midi_flush(void) {
+    if (tx_packet.length > 0) {
+        for (uint8_t i = 0; i < BLE_MIDI_MAX_CONNECTIONS; i++) {
+            if (connections[i].handle == HCI_CON_HANDLE_INVALID)
+                continue;
+            tx_queue_push(&connections[i], &tx_packet);
+            tx_queue_send(&connections[i]);
+        }
+    }
+    tx_packet.length = 0;
+    tx_packet.running_status = 0;
+}
 
-    uint8_t packet[] = {0x80,     0x80, (uint8_t)(0x90 | (channel & 0x0F)), note,
-                        velocity, 0x80, (uint8_t)(0x80 | (channel & 0x0F)), note,
-                        0x00};
-    att_server_notify(con_handle, MIDI_NOTE_HANDLE, packet, sizeof(packet));
+// Sends a Note-On followed immediately by a Note-Off (percussion “hit”).
+void ble_midi_send_note(uint8_t channel, uint8_t note, uint8_t velocity) {
+    uint64_t now_us = time_us_64();
+    ble_midi_queue_note(now_us, channel, note, velocity);
+    ble_midi_queue_note(now_us, channel, note, 0x00);
+    ble_midi_flush();
 }
 
-// Returns true if a BLE MIDI connection is currently active.
-bool ble_midi_is_connected(void) { return con_handle != HCI_CON_HANDLE_INVALID; }
+// Enables echoing of packets written by the central (benchmark builds).
+void ble_midi_set_loopback(bool enable) { loopback = enable; }
+
+// Registers `handler` for every message a central writes to the MIDI characteristic.
+void ble_midi_set_receive_handler(ble_midi_receive_cb_t handler) { receive_handler = handler; }
+
+// Returns the send queue counters.
+const ble_midi_stats_t *ble_midi_get_stats(void) { return &stats; }
+
+// Returns the time from the last connection to its first note notification.
+uint32_t ble_midi_get_wake_latency_us(void) { return wake_latency_us; }
+
+// Returns how many wake-to-first-note times were measured; a change means a new one.
+uint32_t ble_midi_get_wake_count(void) { return wake_count; }
+
+// Returns when the radio came up, the first central connected and the first note went out.
+const ble_midi_boot_t *ble_midi_get_boot_times(void) { return &boot_times; }
+
+// Returns true if at least one BLE MIDI connection is active.
+bool ble_midi_is_connected(void) { return connection_count > 0; }
+
+// Returns the number of connected centrals.
+uint8_t ble_midi_connection_count(void) { return connection_count; }
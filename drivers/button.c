@@ -4,6 +4,15 @@
  * Handles physical button state (BOOTSEL on Pico) and generates logical button events.
  * Internally uses a state machine to detect short press, long press, and release.
  *
+ * A press is timestamped at its first edge and only then confirmed by the
+ * debouncer, so the press time reported by button_get_press_time_us() does
+ * not include debounce latency. Building with BUTTON_GPIO=<pin> reads an
+ * active-low button on that GPIO instead, timestamped from an edge IRQ.
+ *
+ * button_poll_delay_us() tells the caller when the next poll is due, so it
+ * can sleep instead of polling at a fixed rate. A GPIO button also reports
+ * each edge through the callback set with button_set_edge_callback().
+ *
  *
  * Copyright 2025, Hiroyuki OYAMA
  *
@@ -16,7 +25,13 @@
 
 #include "drivers/button.h"
 
+#ifndef BUTTON_GPIO
+#define BUTTON_GPIO (-1)  // -1 = BOOTSEL; otherwise an active-low GPIO with pull-up
+#endif
+
 #define BUTTON_DEBOUNCE_COUNT 5                    // consecutive reads needed for stable state
+#define BUTTON_DEBOUNCE_US 2500                    // quiet time after the last edge (GPIO)
+#define BUTTON_SAMPLE_US 500                       // BOOTSEL sample interval
 #define PRESS_DURATION_US (500 * 1000)             // 500 ms
 #define LONG_PRESS_DURATION_US (2000 * 1000)       // 2 s
 #define VERY_LONG_PRESS_DURATION_US (5000 * 1000)  // 5 s
@@ -32,8 +47,12 @@ typedef enum {
 typedef struct {
     button_state_t state;
     uint64_t press_start_us;
+    uint64_t release_us;  // Confirmed release of the most recent press
 } button_fsm_t;
 
+static button_fsm_t fsm = {0};
+
+#if BUTTON_GPIO < 0
 static bool __no_inline_not_in_flash_func(bootsel_button_raw)(void) {
     const uint CS_PIN_INDEX = 1;
 
@@ -51,11 +70,18 @@ static bool __no_inline_not_in_flash_func(bootsel_button_raw)(void) {
     return button_state;
 }
 
-static bool bootsel_button_debounce(void) {
+/*
+ * Debounces BOOTSEL by counting consecutive samples. The time of the first
+ * sample that saw the press is kept in `edge_us` until the press is confirmed.
+ */
+static bool button_debounce(uint64_t *edge_us) {
     static uint8_t counter = 0;
     static bool stable_state = false;
+    static uint64_t first_edge_us = 0;
 
     if (bootsel_button_raw()) {
+        if (counter == 0 && !stable_state)
+            first_edge_us = time_us_64();
         if (counter < BUTTON_DEBOUNCE_COUNT)
             counter++;
     } else {
@@ -66,23 +92,103 @@ static bool bootsel_button_debounce(void) {
     stable_state = (counter == BUTTON_DEBOUNCE_COUNT) ? true
                    : (counter == 0)                   ? false
                                                       : stable_state;
+    *edge_us = first_edge_us;
+    return stable_state;
+}
+
+void button_init(void) {}
+
+// BOOTSEL cannot interrupt, so no edge is ever reported.
+void button_set_edge_callback(void (*callback)(void)) { (void)callback; }
+
+/*
+ * BOOTSEL has to be sampled for as long as the debouncer runs, i.e. always.
+ * The first sample that sees a press is its timestamp, so a longer interval
+ * would shift recorded hits, and a press is confirmed after
+ * BUTTON_DEBOUNCE_COUNT samples (2.5 ms). BUTTON_GPIO is the build without
+ * this polling.
+ */
+static uint32_t button_debounce_delay_us(void) { return BUTTON_SAMPLE_US; }
+#else
+static volatile uint64_t last_edge_us = 0;   // Most recent edge in either direction
+static volatile uint64_t press_edge_us = 0;  // First falling edge of the current press
+static volatile bool press_armed = true;     // Next falling edge starts a new press
+static void (*edge_callback)(void) = NULL;
+
+// Edge IRQ: timestamp the first edge of a press; debounce happens in the poll.
+static void button_gpio_irq(uint gpio, uint32_t events) {
+    (void)gpio;
+    uint64_t now_us = time_us_64();
+    if ((events & GPIO_IRQ_EDGE_FALL) && press_armed) {
+        press_edge_us = now_us;
+        press_armed = false;
+    }
+    last_edge_us = now_us;
+    if (edge_callback != NULL)
+        edge_callback();
+}
+
+/*
+ * The level is trusted once no edge has been seen for BUTTON_DEBOUNCE_US.
+ * A bounce that settles back to released re-arms the press timestamp.
+ */
+static bool button_debounce(uint64_t *edge_us) {
+    static bool stable_state = false;
+
+    uint32_t flags = save_and_disable_interrupts();  // 64-bit stamps are shared with the IRQ
+    uint64_t last_us = last_edge_us;
+    *edge_us = press_edge_us;
+    restore_interrupts(flags);
+
+    if (time_us_64() - last_us >= BUTTON_DEBOUNCE_US) {
+        stable_state = !gpio_get(BUTTON_GPIO);
+        if (!stable_state)
+            press_armed = true;
+    }
     return stable_state;
 }
 
+void button_init(void) {
+    gpio_init(BUTTON_GPIO);
+    gpio_set_dir(BUTTON_GPIO, GPIO_IN);
+    gpio_pull_up(BUTTON_GPIO);
+    gpio_set_irq_enabled_with_callback(BUTTON_GPIO, GPIO_IRQ_EDGE_FALL | GPIO_IRQ_EDGE_RISE, true,
+                                       button_gpio_irq);
+}
+
+// Registers `callback` to run from the edge IRQ, so the caller can wake up and poll.
+void button_set_edge_callback(void (*callback)(void)) { edge_callback = callback; }
+
+// Time until the level after the last edge can be trusted, or UINT32_MAX once it settled.
+static uint32_t button_debounce_delay_us(void) {
+    uint32_t flags = save_and_disable_interrupts();
+    uint64_t last_us = last_edge_us;
+    restore_interrupts(flags);
+    uint64_t quiet_us = time_us_64() - last_us;
+    return (quiet_us < BUTTON_DEBOUNCE_US) ? (uint32_t)(BUTTON_DEBOUNCE_US - quiet_us) : UINT32_MAX;
+}
+#endif
+
+// Returns the time of the first edge of the current (or most recent) press.
+uint64_t button_get_press_time_us(void) { return fsm.press_start_us; }
+
+// Returns how long the most recent press was held, valid after its release event.
+uint64_t button_get_press_duration_us(void) { return fsm.release_us - fsm.press_start_us; }
+
 /*
  * Reads BOOTSEL button state and returns a button_event_t (see button.h).
  * Maintains internal FSM to distinguish short press, long press, and release.
  */
 button_event_t button_poll_event(void) {
-    static button_fsm_t fsm = {0};
     button_event_t ev = BUTTON_EVENT_NONE;
-    bool current_down = bootsel_button_debounce();
+    uint64_t edge_us;
+    bool current_down = button_debounce(&edge_us);
     uint64_t now_us = time_us_64();
 
     switch (fsm.state) {
         case BUTTON_STATE_IDLE:
             if (current_down) {
-                fsm.press_start_us = now_us;
+                fsm.press_start_us = edge_us;
                 fsm.state = BUTTON_STATE_PRESS_DOWN;
                 ev = BUTTON_EVENT_DOWN;
             }
@@ -90,6 +196,7 @@ button_event_t button_poll_event(void) {
         case BUTTON_STATE_PRESS_DOWN:
             if (!current_down) {
                 fsm.state = BUTTON_STATE_IDLE;
+                fsm.release_us = now_us;
                 ev = BUTTON_EVENT_CLICK_RELEASE;
             } else if (now_us - fsm.press_start_us > PRESS_DURATION_US) {
                 fsm.state = BUTTON_STATE_HOLD_ACTIVE;
@@ -123,3 +230,29 @@ button_event_t button_poll_event(void) {
     }
     return ev;
 }
+
+/*
+ * Time until button_poll_event() next has to run: when the debouncer needs a
+ * sample or the held button crosses the next hold threshold. UINT32_MAX means
+ * that only an edge can raise an event.
+ */
+uint32_t button_poll_delay_us(void) {
+    uint64_t threshold_us;
+    switch (fsm.state) {
+        case BUTTON_STATE_PRESS_DOWN:
+            threshold_us = PRESS_DURATION_US;
+            break;
+        case BUTTON_STATE_HOLD_ACTIVE:
+            threshold_us = LONG_PRESS_DURATION_US;
+            break;
+        case BUTTON_STATE_LONG_HOLD_ACTIVE:
+            threshold_us = VERY_LONG_PRESS_DURATION_US;
+            break;
+        default:
+            return button_debounce_delay_us();
+    }
+    uint64_t held_us = time_us_64() - fsm.press_start_us;
+    uint32_t hold_us = (held_us < threshold_us) ? (uint32_t)(threshold_us - held_us) + 1 : 0;
+    uint32_t debounce_us = button_debounce_delay_us();
+    return (debounce_us < hold_us) ? debounce_us : hold_us;
+}
@@ -0,0 +1,34 @@
+/*
+ * console.c
+ *
+ * Non-blocking key input from the serial console (UART or USB CDC).
+ * Used for settings that have no button gesture, such as the loop layout.
+ * A callback can be told when input arrives, so nobody has to poll for it.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "pico/stdlib.h"
+
+#include "drivers/console.h"
+
+static void (*key_callback)(void) = NULL;
+
+static void console_chars_available(void *param) {
+    (void)param;
+    if (key_callback != NULL)
+        key_callback();
+}
+
+// Registers `callback` to run (possibly from an IRQ) whenever input arrives.
+void console_set_key_callback(void (*callback)(void)) {
+    key_callback = callback;
+    stdio_set_chars_available_callback(console_chars_available, NULL);
+}
+
+// Returns the next pending key, or CONSOLE_NO_KEY without waiting.
+int console_poll_key(void) {
+    int c = getchar_timeout_us(0);
+    return (c == PICO_ERROR_TIMEOUT) ? CONSOLE_NO_KEY : c;
+}
@@ -5,14 +5,32 @@
  * This module is responsible for rendering the BLE connection status,
  * current looper state, and per-track step patterns over a serial console.
  *
+ * Each update is rendered into an off-screen frame buffer and compared with
+ * the frame last sent; only changed cells are emitted, using ANSI cursor
+ * addressing, into a ring buffer that display_flush() drains in small chunks
+ * outside the step tick, never more than the console takes without
+ * blocking. If the ring cannot hold a whole update the frame is dropped
+ * rather than blocking, and the next update carries the difference.
+ *
  * Copyright 2025, Hiroyuki OYAMA
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
+
+#include "pico/stdlib.h"
+#if LIB_PICO_STDIO_USB
+#include "tusb.h"
+#endif
+#if LIB_PICO_STDIO_UART
+#include "hardware/uart.h"
+#endif
 
 #include "drivers/ble_midi.h"
+#include "drivers/display.h"
+#include "groove.h"
 #include "looper.h"
 
 #define ANSI_RESET "\x1b[0m"
@@ -25,50 +43,285 @@
 #define ANSI_BOLD "\x1b[1m"
 #define ANSI_FG_WHITE "\x1b[97m"
 #define ANSI_BG_STEP_HL "\x1b[105m"
+#define ANSI_CLEAR_SCREEN "\x1b[2J"
+#define ANSI_CLEAR_BELOW "\x1b[J"
+
+#define DISPLAY_LABEL_COLS 13  // selection marker, 11-char name and a space
+#define DISPLAY_ROWS (2 + LOOPER_MAX_TRACKS)
+#define DISPLAY_FEEL_COLS 15   // " s62%" own swing and " straight" groove after the steps
+#define DISPLAY_COLS (DISPLAY_LABEL_COLS + LOOPER_MAX_STEPS + 2 + DISPLAY_FEEL_COLS)
+#define DISPLAY_RING_SIZE 4096       // Must be a power of two; holds at least one full row
+#define DISPLAY_FLUSH_CHUNK 64       // Bytes written per display_flush() call
+#define DISPLAY_REPAINT_FRAMES 256   // Full repaint interval, for late-attached terminals
+#define DISPLAY_UART_FIFO 32         // PL011 transmit FIFO depth
+
+typedef enum {
+    STYLE_NORMAL = 0,
+    STYLE_BOLD,
+    STYLE_RED,
+    STYLE_GREEN,
+    STYLE_BLUE,
+    STYLE_MAGENTA,
+    STYLE_STEP_HL,
+} cell_style_t;
+
+static const char *const style_sequences[] = {
+    [STYLE_NORMAL] = ANSI_RESET,
+    [STYLE_BOLD] = ANSI_RESET ANSI_BOLD,
+    [STYLE_RED] = ANSI_RESET ANSI_BRIGHT_RED,
+    [STYLE_GREEN] = ANSI_RESET ANSI_BRIGHT_GREEN,
+    [STYLE_BLUE] = ANSI_RESET ANSI_BRIGHT_BLUE,
+    [STYLE_MAGENTA] = ANSI_RESET ANSI_BRIGHT_MAGENTA,
+    [STYLE_STEP_HL] = ANSI_RESET ANSI_BRIGHT_CYAN ANSI_BG_STEP_HL,
+};
+
+typedef struct {
+    char ch;
+    uint8_t style;
+} cell_t;
+
+typedef struct {
+    cell_t cells[DISPLAY_ROWS][DISPLAY_COLS];
+} frame_t;
+
+static frame_t shown_frame;  // What the terminal currently shows
+static frame_t next_frame;   // Frame being composed
+static uint32_t frame_count = 0;
+
+static char ring[DISPLAY_RING_SIZE];
+static uint32_t ring_head = 0;  // Next byte to write
+static uint32_t ring_tail = 0;  // Next byte to send
+static bool ring_overflow = false;
+
+#define STYLE_UNKNOWN 0xFF  // Forces a style sequence before the next cell
+
+static void ring_put(const char *s, size_t len) {
+    if (ring_head - ring_tail + len > DISPLAY_RING_SIZE) {
+        ring_overflow = true;
+        return;
+    }
+    for (size_t i = 0; i < len; i++)
+        ring[(ring_head++) & (DISPLAY_RING_SIZE - 1)] = s[i];
+}
 
-// Prints a single track row with step highlighting and note indicators.
-static void print_track(const char *label, const bool *steps, uint8_t current_step,
-                        bool is_selected) {
-    printf("%s%-11s %s[", is_selected ? ANSI_BOLD ">" : " ", label, ANSI_RESET);
-    for (int i = 0; i < LOOPER_TOTAL_STEPS; ++i) {
-        bool note_on = steps[i];
-        if (current_step == i)
-            printf("%s%s%s", ANSI_BRIGHT_CYAN ANSI_BG_STEP_HL, note_on ? "*" : " ", ANSI_RESET);
-        else if (note_on)
-            printf("*");
-        else
-            printf(" ");
+static void ring_puts(const char *s) { ring_put(s, strlen(s)); }
+
+// Writes `text` into `row` starting at `col` with a single style.
+static void frame_text(uint8_t row, uint16_t col, const char *text, uint8_t style) {
+    for (; *text != '\0' && col < DISPLAY_COLS; text++, col++)
+        next_frame.cells[row][col] = (cell_t){*text, style};
+}
+
+// Composes a single track row with step highlighting and note indicators.
+static void frame_track(uint8_t row, const track_t *track, uint16_t current_step,
+                        uint16_t total_steps, bool is_selected) {
+    static const char level_glyph[LOOPER_LEVELS] = {'.', 'o', '*', '#'};
+    char name[DISPLAY_LABEL_COLS + 1];
+    snprintf(name, sizeof(name), "%s%-11s ", is_selected ? ">" : " ", track->name);
+    frame_text(row, 0, name, is_selected ? STYLE_BOLD : STYLE_NORMAL);
+
+    uint16_t col = DISPLAY_LABEL_COLS;
+    next_frame.cells[row][col++] = (cell_t){'[', STYLE_NORMAL};
+    for (uint16_t i = 0; i < total_steps; ++i) {
+        uint8_t style = (current_step == i) ? STYLE_STEP_HL : STYLE_NORMAL;
+        char ch = looper_pattern_get(&track->pattern, i)
+                      ? level_glyph[looper_level_get(&track->levels, i)]
+                      : ' ';
+        next_frame.cells[row][col++] = (cell_t){ch, style};
+    }
+    next_frame.cells[row][col++] = (cell_t){']', STYLE_NORMAL};
+
+    char feel[DISPLAY_FEEL_COLS + 1] = "";
+    int len = 0;
+    if (track->swing != LOOPER_TRACK_SWING_GLOBAL)
+        len = snprintf(feel, sizeof(feel), " s%u%%", track->swing);
+    if (track->groove != 0)
+        snprintf(feel + len, sizeof(feel) - len, " %s", groove_get(track->groove)->name);
+    frame_text(row, col, feel, STYLE_NORMAL);
+}
+
+// Emits the cells of one row of `next_frame` that differ from `shown_frame`.
+static void emit_row_diff(uint8_t row) {
+    uint8_t style = STYLE_UNKNOWN;
+    bool cursor_ok = false;
+    for (uint16_t col = 0; col < DISPLAY_COLS; col++) {
+        cell_t cell = next_frame.cells[row][col];
+        cell_t old = shown_frame.cells[row][col];
+        if (cell.ch == old.ch && cell.style == old.style) {
+            cursor_ok = false;
+            continue;
+        }
+        if (!cursor_ok) {
+            char pos[16];
+            int len = snprintf(pos, sizeof(pos), "\x1b[%u;%uH", row + 1, col + 1);
+            ring_put(pos, len);
+            cursor_ok = true;
+        }
+        if (cell.style != style) {
+            ring_puts(style_sequences[cell.style]);
+            style = cell.style;
+        }
+        ring_put(&cell.ch, 1);
+    }
+}
+
+static void blank_frame(frame_t *frame) {
+    for (uint8_t row = 0; row < DISPLAY_ROWS; row++)
+        for (uint16_t col = 0; col < DISPLAY_COLS; col++)
+            frame->cells[row][col] = (cell_t){' ', STYLE_NORMAL};
+}
+
+/*
+ * Emits the difference between `next_frame` and `shown_frame` row by row.
+ * A row that does not fit in the ring is dropped together with the rows
+ * after it; `shown_frame` keeps their old content so the next update
+ * carries them. A repaint clears the screen and diffs against a blank frame.
+ */
+static void emit_frame_diff(bool repaint) {
+    if (repaint) {
+        ring_overflow = false;
+        ring_puts(ANSI_RESET ANSI_CLEAR_SCREEN);
+        if (ring_overflow)
+            return;
+        blank_frame(&shown_frame);
+    }
+    for (uint8_t row = 0; row < DISPLAY_ROWS; row++) {
+        uint32_t mark = ring_head;
+        ring_overflow = false;
+        emit_row_diff(row);
+        if (ring_overflow) {
+            ring_head = mark;
+            break;
+        }
+        memcpy(shown_frame.cells[row], next_frame.cells[row], sizeof(shown_frame.cells[row]));
     }
-    printf("]\n");
 }
 
 // Displays the looper's playback state, connection status, and track patterns.
 void display_update_looper_status(bool ble_connected, const looper_status_t *looper,
                                   const track_t *tracks, size_t num_tracks) {
-    printf(ANSI_BOLD "#Pico_MIDI_Looper" ANSI_RESET "\n");
+    blank_frame(&next_frame);
 
-    const char *state_label = ANSI_BRIGHT_BLUE "WAITING" ANSI_RESET;
+    frame_text(0, 0, "#Pico_MIDI_Looper", STYLE_BOLD);
+
+    const char *state_label = "WAITING";
+    uint8_t state_style = STYLE_BLUE;
     if (ble_connected) {
         switch (looper->state) {
             case LOOPER_STATE_PLAYING:
             case LOOPER_STATE_TRACK_SWITCH:
-                state_label = ANSI_BRIGHT_GREEN "PLAYING" ANSI_RESET;
+                state_label = "PLAYING";
+                state_style = STYLE_GREEN;
                 break;
             case LOOPER_STATE_RECORDING:
-                state_label = ANSI_BRIGHT_RED "RECORDING" ANSI_RESET;
+                state_label = "RECORDING";
+                state_style = STYLE_RED;
                 break;
             case LOOPER_STATE_TAP_TEMPO:
-                state_label = ANSI_BRIGHT_MAGENTA "TAP TEMPO" ANSI_RESET;
+                state_label = "TAP TEMPO";
+                state_style = STYLE_MAGENTA;
                 break;
             default:
                 break;
         }
     }
-    printf("[%s] %s%u bpm\n" ANSI_RESET, state_label,
-           ((looper->current_step % LOOPER_CLICK_DIV) == 0 ? ANSI_BOLD : ""), looper->bpm);
+    uint8_t len = strlen(state_label);
+    char pattern[4] = {'A' + looper->pattern_index, '\0'};
+    if (looper->next_pattern_index != looper->pattern_index) {
+        pattern[1] = '>';  // Switches at the next bar line
+        pattern[2] = 'A' + looper->next_pattern_index;
+    }
+    char bpm[96];
+    const char *clock = "";
+    if (looper->clock_follow)
+        clock = looper->clock_locked ? " ext" : " ext?";  // '?' while no clock is received
+    else if (looper->clock_output)
+        clock = " clock out";
+    snprintf(bpm, sizeof(bpm),
+             "%u bpm%s  %u bar%s 1/%u  %u tracks  q %u%%  swing %u%%  pattern %s%s",
+             (unsigned)looper->bpm, clock, looper->bars, looper->bars > 1 ? "s" : "",
+             looper->steps_per_beat * 4, (unsigned)num_tracks, looper->quantize, looper->swing,
+             pattern, looper->chain ? " chain" : "");
+    frame_text(1, 0, "[", STYLE_NORMAL);
+    frame_text(1, 1, state_label, state_style);
+    frame_text(1, 1 + len, "] ", STYLE_NORMAL);
+    frame_text(1, 3 + len, bpm,
+               ((looper->current_step % looper->steps_per_beat) == 0) ? STYLE_BOLD : STYLE_NORMAL);
 
+    if (num_tracks > LOOPER_MAX_TRACKS)
+        num_tracks = LOOPER_MAX_TRACKS;
     for (uint8_t i = 0; i < num_tracks; i++)
-        print_track(tracks[i].name, tracks[i].pattern, looper->current_step,
+        frame_track(2 + i, &tracks[i], looper->current_step, looper->total_steps,
                     i == looper->current_track);
-    fflush(stdout);
+
+    emit_frame_diff((frame_count++ % DISPLAY_REPAINT_FRAMES) == 0);
+}
+
+/*
+ * Queues `text` below the looper view, replacing the previous report. The
+ * text goes through the same ring, so it never splits an escape sequence;
+ * returns false if the ring cannot take it whole. A full repaint clears it.
+ */
+bool display_show_report(const char *text) {
+    char pos[16];
+    snprintf(pos, sizeof(pos), "\x1b[%u;1H", DISPLAY_ROWS + 2);
+    uint32_t mark = ring_head;
+    ring_overflow = false;
+    ring_puts(pos);
+    ring_puts(ANSI_RESET ANSI_CLEAR_BELOW);
+    ring_puts(text);
+    if (ring_overflow) {
+        ring_head = mark;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Bytes every stdio output can take right now without blocking: the free
+ * space of the USB CDC FIFO, and the UART FIFO once it has drained. A USB
+ * host that is attached but not reading leaves this at 0. Outputs that are
+ * not connected drop what they get without waiting.
+ */
+static uint32_t display_writable(void) {
+    uint32_t room = DISPLAY_FLUSH_CHUNK;
+#if LIB_PICO_STDIO_USB
+    if (tud_cdc_connected() && tud_cdc_write_available() < room)
+        room = tud_cdc_write_available();
+#endif
+#if LIB_PICO_STDIO_UART
+    if (!(uart_get_hw(uart_default)->fr & UART_UARTFR_TXFE_BITS))
+        room = 0;
+    else if (room > DISPLAY_UART_FIFO)
+        room = DISPLAY_UART_FIFO;
+#endif
+    return room;
+}
+
+/*
+ * Sends as many pending bytes as the console takes without blocking, at most
+ * DISPLAY_FLUSH_CHUNK; the rest stays in the ring for the next call. Each
+ * newline goes out as CR LF, so it counts twice. Returns true while more
+ * output remains queued.
+ */
+bool display_flush(void) {
+    uint32_t pending = ring_head - ring_tail;
+    if (pending == 0)
+        return false;
+
+    uint32_t offset = ring_tail & (DISPLAY_RING_SIZE - 1);
+    uint32_t contiguous = DISPLAY_RING_SIZE - offset;
+    if (pending > contiguous)
+        pending = contiguous;
+    uint32_t room = display_writable();
+    uint32_t count = 0;
+    for (uint32_t cost = 0; count < pending; count++) {
+        cost += (ring[offset + count] == '\n') ? 2 : 1;
+        if (cost > room)
+            break;
+    }
+    if (count > 0)
+        stdio_put_string(&ring[offset], (int)count, false, true);
+    ring_tail += count;
+    return ring_head != ring_tail;
 }
@@ -0,0 +1,273 @@
+/*
+ * flash_store.c
+ *
+ * Versioned, CRC-protected snapshots in a ring of flash slots near the end of
+ * flash, below the BTstack flash bank. Each save goes to the next slot, so
+ * erases are spread over the whole ring; older slots stay as fallbacks.
+ *
+ * Writes never block the caller. A save only records the caller's buffer and
+ * its header. The buffer is then written by flash_store_task(), one sector
+ * erase or page program at a time, and only when the caller's window (the
+ * time until it next needs the CPU) covers the operation's worst case. The
+ * header page is programmed last, so a snapshot cut short by power loss is
+ * never seen as valid.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <string.h>
+
+#include "hardware/flash.h"
+#include "pico/flash.h"
+#include "pico/stdlib.h"
+
+#include "drivers/flash_store.h"
+
+#ifndef PICO_FLASH_BANK_TOTAL_SIZE
+#define PICO_FLASH_BANK_TOTAL_SIZE (FLASH_SECTOR_SIZE * 2u)  // BTstack TLV storage
+#endif
+
+#define FLASH_STORE_REGION_SIZE (FLASH_STORE_SLOT_SIZE * FLASH_STORE_SLOTS)
+#define FLASH_STORE_OFFSET \
+    (PICO_FLASH_SIZE_BYTES - PICO_FLASH_BANK_TOTAL_SIZE - FLASH_STORE_REGION_SIZE)
+#define FLASH_STORE_MAGIC 0x534C4D50u      // "PMLS"
+#define FLASH_STORE_LOCKOUT_TIMEOUT_MS 10  // Wait for the other core to park
+
+_Static_assert(FLASH_STORE_SLOT_SIZE % FLASH_SECTOR_SIZE == 0, "slots are whole sectors");
+_Static_assert(FLASH_STORE_SPARE < FLASH_STORE_SLOTS, "keep at least one fallback slot");
+
+typedef struct {
+    uint32_t magic;
+    uint32_t sequence;  // Increments with every save; the highest valid one wins
+    uint16_t version;   // Payload layout version, owned by the caller
+    uint16_t length;    // Payload bytes following the header
+    uint32_t crc;       // CRC-32 of the payload
+} flash_store_header_t;
+
+_Static_assert(sizeof(flash_store_header_t) == FLASH_STORE_SLOT_SIZE - FLASH_STORE_CAPACITY,
+               "FLASH_STORE_CAPACITY must match the header");
+
+typedef enum {
+    STORE_IDLE = 0,
+    STORE_ERASE,    // Erasing `slot`, sector by sector
+    STORE_PROGRAM,  // Programming the image into `slot`, page by page
+} flash_store_state_t;
+
+static flash_store_state_t state = STORE_IDLE;
+static int8_t latest_slot = -1;  // Slot of the newest valid snapshot
+static uint32_t latest_sequence = 0;
+static bool slot_blank[FLASH_STORE_SLOTS];
+
+static uint8_t slot;       // Slot being erased or programmed
+static uint16_t progress;  // Sectors erased or pages programmed so far
+static bool save_pending = false;
+static flash_store_header_t save_header;
+static const uint8_t *save_data;  // Caller's buffer, unchanged until the save completes
+static uint16_t save_pages;
+static uint8_t page_buffer[FLASH_PAGE_SIZE] __attribute__((aligned(4)));
+
+typedef struct {
+    uint32_t offset;
+    const uint8_t *data;
+    size_t length;
+} flash_store_op_t;
+
+static uint32_t slot_offset(uint8_t index) {
+    return FLASH_STORE_OFFSET + index * FLASH_STORE_SLOT_SIZE;
+}
+
+// Memory-mapped (XIP) view of a slot, for reads.
+static const uint8_t *slot_data(uint8_t index) {
+    return (const uint8_t *)(uintptr_t)(XIP_BASE + slot_offset(index));
+}
+
+// CRC-32 (IEEE 802.3, reflected), bitwise to stay table-free.
+static uint32_t crc32(const uint8_t *data, size_t length) {
+    uint32_t crc = 0xFFFFFFFFu;
+    while (length--) {
+        crc ^= *data++;
+        for (int i = 0; i < 8; i++)
+            crc = (crc >> 1) ^ (0xEDB88320u & -(crc & 1u));
+    }
+    return ~crc;
+}
+
+static bool slot_is_blank(uint8_t index) {
+    const uint32_t *words = (const uint32_t *)slot_data(index);
+    for (size_t i = 0; i < FLASH_STORE_SLOT_SIZE / sizeof(uint32_t); i++) {
+        if (words[i] != 0xFFFFFFFFu)
+            return false;
+    }
+    return true;
+}
+
+// Returns the header of `index` if it holds a complete snapshot, else NULL.
+static const flash_store_header_t *slot_header(uint8_t index) {
+    const flash_store_header_t *header = (const flash_store_header_t *)slot_data(index);
+    if (header->magic != FLASH_STORE_MAGIC || header->length > FLASH_STORE_CAPACITY)
+        return NULL;
+    if (crc32(slot_data(index) + sizeof(*header), header->length) != header->crc)
+        return NULL;
+    return header;
+}
+
+static void flash_store_erase_op(void *param) {
+    const flash_store_op_t *op = param;
+    flash_range_erase(op->offset, FLASH_SECTOR_SIZE);
+}
+
+static void flash_store_program_op(void *param) {
+    const flash_store_op_t *op = param;
+    flash_range_program(op->offset, op->data, op->length);
+}
+
+// Next slot after the latest snapshot that is already erased, or -1.
+static int8_t next_blank_slot(void) {
+    for (uint8_t k = 1; k <= FLASH_STORE_SLOTS; k++) {
+        uint8_t index = (latest_slot + k) % FLASH_STORE_SLOTS;
+        if (index != latest_slot && slot_blank[index])
+            return index;
+    }
+    return -1;
+}
+
+// Pick the slot for the pending image: an erased one, or the next to erase.
+static void start_write(void) {
+    int8_t blank = next_blank_slot();
+    slot = (blank >= 0) ? (uint8_t)blank : (uint8_t)((latest_slot + 1) % FLASH_STORE_SLOTS);
+    progress = 0;
+    state = (blank >= 0) ? STORE_PROGRAM : STORE_ERASE;
+}
+
+/*
+ * Scans the ring for the newest valid snapshot and notes which slots are
+ * already erased. Reads go through XIP; one CRC check per slot.
+ */
+void flash_store_init(void) {
+    latest_slot = -1;
+    latest_sequence = 0;
+    for (uint8_t i = 0; i < FLASH_STORE_SLOTS; i++) {
+        const flash_store_header_t *header = slot_header(i);
+        slot_blank[i] = (header == NULL) && slot_is_blank(i);
+        if (header != NULL && (latest_slot < 0 || header->sequence > latest_sequence)) {
+            latest_slot = i;
+            latest_sequence = header->sequence;
+        }
+    }
+    if (latest_slot < 0)
+        latest_slot = FLASH_STORE_SLOTS - 1;  // Start the ring at slot 0
+}
+
+/*
+ * Copies the newest snapshot of `version` and exactly `size` bytes into
+ * `data`. Returns false, leaving `data` untouched, when there is none.
+ */
+bool flash_store_load(void *data, size_t size, uint16_t version) {
+    const flash_store_header_t *header = slot_header(latest_slot);
+    if (header == NULL || header->version != version || header->length != size)
+        return false;
+    memcpy(data, slot_data(latest_slot) + sizeof(*header), size);
+    return true;
+}
+
+/*
+ * Queues `data` as the next snapshot. `data` is read while the save is
+ * written, so it must stay unchanged until flash_store_busy() is false.
+ * Returns false if it does not fit or a previous save is still being
+ * written; the caller retries later.
+ */
+bool flash_store_save(const void *data, size_t size, uint16_t version) {
+    if (size > FLASH_STORE_CAPACITY || save_pending)
+        return false;
+
+    save_header = (flash_store_header_t){
+        .magic = FLASH_STORE_MAGIC,
+        .sequence = latest_sequence + 1,
+        .version = version,
+        .length = (uint16_t)size,
+        .crc = crc32(data, size),
+    };
+    save_data = data;
+    save_pages = (sizeof(save_header) + size + FLASH_PAGE_SIZE - 1) / FLASH_PAGE_SIZE;
+    save_pending = true;
+    if (state == STORE_IDLE || (state == STORE_ERASE && next_blank_slot() >= 0))
+        start_write();  // An erase ahead of time gives way to a save into a ready slot
+    return true;
+}
+
+// Lay out page `page` of the pending slot image (header, payload, 0xFF fill).
+static void fill_page(uint16_t page) {
+    size_t start = page * FLASH_PAGE_SIZE;
+    size_t end = sizeof(save_header) + save_header.length;
+    size_t pos = 0;
+    memset(page_buffer, 0xFF, sizeof(page_buffer));
+    if (page == 0) {
+        memcpy(page_buffer, &save_header, sizeof(save_header));
+        pos = sizeof(save_header);
+    }
+    size_t count = FLASH_PAGE_SIZE - pos;
+    if (start + pos + count > end)
+        count = end - (start + pos);
+    memcpy(page_buffer + pos, save_data + start + pos - sizeof(save_header), count);
+}
+
+// True while a queued snapshot has not been fully written yet.
+bool flash_store_busy(void) { return save_pending; }
+
+/*
+ * Performs at most one flash operation, if it fits in `window_us`.
+ * Pages are programmed from the second one on and the header page last.
+ * With nothing to save, slots ahead of the latest snapshot are erased in
+ * advance so a later save only needs page programs, which fit between steps.
+ */
+void flash_store_task(uint32_t window_us) {
+    flash_store_op_t op;
+    switch (state) {
+        case STORE_IDLE:
+            for (uint8_t k = 1; k <= FLASH_STORE_SPARE; k++) {
+                uint8_t index = (latest_slot + k) % FLASH_STORE_SLOTS;
+                if (!slot_blank[index]) {
+                    slot = index;
+                    progress = 0;
+                    state = STORE_ERASE;
+                    break;
+                }
+            }
+            break;
+        case STORE_ERASE:
+            if (window_us < FLASH_STORE_ERASE_US)
+                break;
+            op.offset = slot_offset(slot) + progress * FLASH_SECTOR_SIZE;
+            if (flash_safe_execute(flash_store_erase_op, &op, FLASH_STORE_LOCKOUT_TIMEOUT_MS) !=
+                PICO_OK)
+                break;
+            if (++progress < FLASH_STORE_SLOT_SIZE / FLASH_SECTOR_SIZE)
+                break;
+            slot_blank[slot] = true;
+            state = STORE_IDLE;
+            if (save_pending)
+                start_write();
+            break;
+        case STORE_PROGRAM: {
+            if (window_us < FLASH_STORE_PROGRAM_US)
+                break;
+            uint16_t page = (progress + 1) % save_pages;  // header page (0) goes last
+            fill_page(page);
+            op.offset = slot_offset(slot) + page * FLASH_PAGE_SIZE;
+            op.data = page_buffer;
+            op.length = FLASH_PAGE_SIZE;
+            if (flash_safe_execute(flash_store_program_op, &op, FLASH_STORE_LOCKOUT_TIMEOUT_MS) !=
+                PICO_OK)
+                break;
+            slot_blank[slot] = false;
+            if (++progress < save_pages)
+                break;
+            latest_slot = slot;
+            latest_sequence++;
+            save_pending = false;
+            state = STORE_IDLE;
+            break;
+        }
+    }
+}
@@ -0,0 +1,22 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <stddef.h>
+
+// Boot stages marked by main(), in the order they complete.
+typedef enum {
+    BOOT_MARK_STDIO = 0,  // stdio is up
+    BOOT_MARK_CYW43,      // CYW43 driver and Wi-Fi firmware loaded
+    BOOT_MARK_RADIO,      // BTstack initialised and Bluetooth firmware loaded
+    BOOT_MARK_RESTORE,    // Saved session restored (overlaps the HCI init sequence)
+    BOOT_MARK_RUN_LOOP,   // Entering the BTstack run loop
+    BOOT_MARK_COUNT,
+} boot_mark_t;
+
+void boot_trace_mark(boot_mark_t mark);
+
+size_t boot_trace_format(char *buffer, size_t size);
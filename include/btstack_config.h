@@ -2,7 +2,9 @@
 
 #define ENABLE_HCI_CONTROLLER_TO_HOST_FLOW_CONTROL
 #define ENABLE_LE_BONDING
+#define ENABLE_LE_DATA_LENGTH_EXTENSION
 #define ENABLE_LE_PERIPHERAL
+#define ENABLE_LE_PRIVACY_ADDRESS_RESOLUTION
 #define ENABLE_PRINTF_HEXDUMP
 #define HAVE_ASSERT
 #define HAVE_EMBEDDED_TIME_MS
@@ -15,8 +17,8 @@
 #define HCI_OUTGOING_PRE_BUFFER_SIZE 4
 #define HCI_RESET_RESEND_TIMEOUT_MS 1000
 #define MAX_ATT_DB_SIZE 512
-#define MAX_NR_CONTROLLER_ACL_BUFFERS 1
-#define MAX_NR_HCI_CONNECTIONS 1
-#define MAX_NR_LE_DEVICE_DB_ENTRIES 1
-#define NVM_NUM_DEVICE_DB_ENTRIES 1
+#define MAX_NR_CONTROLLER_ACL_BUFFERS 3
+#define MAX_NR_HCI_CONNECTIONS 3
+#define MAX_NR_LE_DEVICE_DB_ENTRIES 3
+#define NVM_NUM_DEVICE_DB_ENTRIES 3
 #define NVM_NUM_LINK_KEYS 16
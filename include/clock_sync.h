@@ -0,0 +1,44 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "timing.h"
+
+#define CLOCK_SYNC_PPQN 24               // MIDI Timing Clock ticks per beat
+#define CLOCK_SYNC_TIMEOUT_US 500000     // Lock is lost after this long without a tick
+#define CLOCK_SYNC_ACQUIRE_TICKS 2       // Ticks before a period estimate exists
+
+// MIDI System Real-Time messages handled by the clock follower.
+enum {
+    MIDI_TIMING_CLOCK = 0xF8,
+    MIDI_START = 0xFA,
+    MIDI_CONTINUE = 0xFB,
+    MIDI_STOP = 0xFC,
+};
+
+/*
+ * Filtered view of the external clock. While running, the time of any tick
+ * `n` counted from the last Start is predicted as
+ * tick_time + (n - tick_index) * tick_period.
+ */
+typedef struct {
+    timing_fx_t tick_period;  // Filtered clock tick length in fixed-point µs
+    timing_fx_t tick_time;    // Filtered time of the latest tick
+    int32_t tick_index;       // Song position of that tick; -1 until the first after Start
+    uint32_t start_count;     // Incremented by every Start
+    bool running;             // Between Start/Continue and Stop
+} clock_sync_state_t;
+
+void clock_sync_handle_message(uint64_t time_us, uint8_t status);
+
+bool clock_sync_get(clock_sync_state_t *state);
+
+static inline timing_fx_t clock_sync_predict(const clock_sync_state_t *state, int32_t tick) {
+    return state->tick_time + (int64_t)(tick - state->tick_index) * (int64_t)state->tick_period;
+}
@@ -0,0 +1,35 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define COMMAND_QUEUE_SIZE 32  // Must be a power of two
+
+typedef enum {
+    COMMAND_RECORD_HIT = 0,  // Record a hit of the current track pressed at `time_us`, level `arg`
+    COMMAND_RECORD_NOTE,     // Record Note-On `value` played at `time_us`, level `arg`
+    COMMAND_BACKUP,          // A press began: back up the current track for undo
+    COMMAND_UNDO,            // Revert the current track to its backup
+    COMMAND_SWITCH_TRACK,    // Move on to the next track
+    COMMAND_TAP_TEMPO,       // Enter (`arg` = 1) or leave (`arg` = 0) tap-tempo mode
+    COMMAND_SET_TEMPO,       // Set the beat period to `value` (timing_fx_t)
+    COMMAND_CLEAR,           // Clear every track of the playing pattern
+    COMMAND_SETTING,         // Apply the console setting key `arg`
+    COMMAND_SNAPSHOT,        // Copy the persisted state for a save (dual-core mode)
+} command_type_t;
+
+typedef struct {
+    uint64_t time_us;  // When the input happened
+    uint64_t value;
+    uint8_t type;  // command_type_t
+    uint8_t arg;
+} command_t;
+
+bool command_queue_push(const command_t *command);
+
+bool command_queue_pop(command_t *command);
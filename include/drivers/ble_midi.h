@@ -7,8 +7,51 @@
 
 #include "btstack.h"
 
-void ble_midi_init(void (*step_cb)(btstack_timer_source_t *ts), uint32_t step_period_ms);
+// Counters of the outbound BLE-MIDI packet queues, summed over all connections.
+typedef struct {
+    uint32_t packets_sent;     // Notifications accepted by the stack
+    uint32_t packets_merged;   // Step packets folded into an unsent queued packet
+    uint32_t dropped_full;     // Oldest packets dropped because the queue was full
+    uint32_t dropped_stale;    // Packets dropped for waiting past BLE_MIDI_STALE_MS
+    uint32_t offs_carried;     // Note-Offs of dropped packets sent on in a later one
+    uint16_t queue_depth;      // Packets waiting right now in the deepest queue
+    uint16_t max_queue_depth;  // High-water mark
+} ble_midi_stats_t;
+
+// Boot milestones in µs since power-on; 0 until reached.
+typedef struct {
+    uint32_t radio_ready_us;  // BTstack reached HCI_STATE_WORKING and started advertising
+    uint32_t connected_us;    // First central connected
+    uint32_t first_note_us;   // First notification sent
+} ble_midi_boot_t;
+
+void ble_midi_init(void (*step_cb)(btstack_timer_source_t *ts));
+
+void ble_midi_start_step_timer(uint32_t step_period_ms);
 
 bool ble_midi_is_connected(void);
 
+uint8_t ble_midi_connection_count(void);
+
+uint32_t ble_midi_get_wake_latency_us(void);
+
+uint32_t ble_midi_get_wake_count(void);
+
+const ble_midi_boot_t *ble_midi_get_boot_times(void);
+
+const ble_midi_stats_t *ble_midi_get_stats(void);
+
+void ble_midi_set_loopback(bool enable);
+
+typedef void (*ble_midi_receive_cb_t)(uint64_t time_us, uint8_t status, uint8_t data1,
+                                      uint8_t data2);
+
+void ble_midi_set_receive_handler(ble_midi_receive_cb_t handler);
+
 void ble_midi_send_note(uint8_t channel, uint8_t note, uint8_t velocity);
+
+void ble_midi_queue_note(uint64_t time_us, uint8_t channel, uint8_t note, uint8_t velocity);
+
+void ble_midi_queue_realtime(uint64_t time_us, uint8_t status);
+
+void ble_midi_flush(void);
@@ -21,4 +21,14 @@ typedef enum {
 
 bool __no_inline_not_in_flash_func(bb_get_bootsel_button)();
 
+void button_init(void);
+
+void button_set_edge_callback(void (*callback)(void));
+
 button_event_t button_poll_event(void);
+
+uint32_t button_poll_delay_us(void);
+
+uint64_t button_get_press_time_us(void);
+
+uint64_t button_get_press_duration_us(void);
@@ -0,0 +1,12 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#define CONSOLE_NO_KEY (-1)
+
+void console_set_key_callback(void (*callback)(void));
+
+int console_poll_key(void);
@@ -4,3 +4,7 @@
 
 void display_update_looper_status(bool ble_connected, const looper_status_t *looper,
                                   const track_t *tracks, size_t num_tracks);
+
+bool display_show_report(const char *text);
+
+bool display_flush(void);
@@ -0,0 +1,28 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FLASH_STORE_SLOT_SIZE (32 * 1024)  // Eight 4 KB sectors per snapshot
+#define FLASH_STORE_SLOTS 4                // Ring of slots written in turn (wear levelling)
+#define FLASH_STORE_SPARE 2                // Slots kept erased ahead of the latest snapshot
+#define FLASH_STORE_CAPACITY (FLASH_STORE_SLOT_SIZE - 16)  // Payload bytes after the header
+
+#define FLASH_STORE_ERASE_US 400000  // Worst-case 4 KB sector erase
+#define FLASH_STORE_PROGRAM_US 3000  // Worst-case 256 B page program
+
+void flash_store_init(void);
+
+bool flash_store_load(void *data, size_t size, uint16_t version);
+
+bool flash_store_save(const void *data, size_t size, uint16_t version);
+
+bool flash_store_busy(void);
+
+void flash_store_task(uint32_t window_us);
@@ -0,0 +1,24 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <stdint.h>
+
+#define GROOVE_SLOTS 16  // One template position per 16th of a 4/4 bar
+
+/*
+ * A groove template: how far each 16th of the bar is pushed or dragged, in
+ * 1/96ths of a step, and how much its velocity is raised or lowered.
+ */
+typedef struct {
+    const char *name;
+    int8_t offset[GROOVE_SLOTS];
+    int8_t velocity[GROOVE_SLOTS];
+} groove_t;
+
+uint8_t groove_count(void);
+
+const groove_t *groove_get(uint8_t index);
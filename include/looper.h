@@ -1,15 +1,72 @@
 #pragma once
 
+#include <string.h>
+
 #include "drivers/button.h"
 #include "drivers/ble_midi.h"
+#include "timing.h"
+
+#ifndef LOOPER_DUAL_CORE
+#define LOOPER_DUAL_CORE 0  // 1 = step clock and pattern engine run on core 1
+#endif
+
+#ifndef LOOPER_BENCH
+#define LOOPER_BENCH 0  // 1 = play the latency benchmark instead of user patterns
+#endif
+
+#define LOOPER_DEFAULT_BPM 120           // Beats per minute (global tempo)
+#define LOOPER_DEFAULT_BARS 2            // Loop length in bars at boot
+#define LOOPER_BEATS_PER_BAR 4           // Time signature numerator (e.g., 4/4)
+#define LOOPER_DEFAULT_STEPS_PER_BEAT 4  // Resolution at boot (4 = 16th notes)
+#define LOOPER_DEFAULT_TRACKS 4          // Tracks in use at boot
+
+/*
+ * Build-time arena limits. Patterns, the step table and the display frame are
+ * sized for these maxima, so the loop length, resolution and track count can
+ * be changed at run time without reallocating. BPM is clamped so a step never
+ * gets shorter than LOOPER_MIN_STEP_PERIOD_US, the tick-time budget.
+ */
+#define LOOPER_MAX_TRACKS 16
+#define LOOPER_MAX_BARS 8
+#define LOOPER_MAX_STEPS_PER_BEAT 8  // 1/32 notes
+#define LOOPER_MAX_STEPS (LOOPER_MAX_STEPS_PER_BEAT * LOOPER_BEATS_PER_BAR * LOOPER_MAX_BARS)
+#define LOOPER_MIN_STEP_PERIOD_US 20000
+#define LOOPER_PATTERN_WORDS ((LOOPER_MAX_STEPS + 31) / 32)  // 32 steps per word
+#define LOOPER_LEVEL_WORDS ((LOOPER_MAX_STEPS + 15) / 16)    // 2-bit levels, 16 steps per word
+#define LOOPER_BANK_PATTERNS 4  // Patterns A-D, e.g. A/B variations and a fill
+
+#define LOOPER_TIMER_SPIN_US 1000     // The ms timer fires this early; the rest is spun out
+#define LOOPER_IDLE_POLL_US 20000     // Input poll interval while waiting for a connection
+#define LOOPER_IDLE_BLINK_MS 2000     // LED blink period while waiting for a connection
+#define LOOPER_IDLE_BLINK_ON_MS 60    // LED on-time per blink
 
-#define LOOPER_DEFAULT_BPM 120   // Beats per minute (global tempo)
-#define LOOPER_BARS 2            // Loop length in bars
-#define LOOPER_BEATS_PER_BAR 4   // Time signature numerator (e.g., 4/4)
-#define LOOPER_STEPS_PER_BEAT 4  // Resolution (4 = 16th notes)
+#define LOOPER_GATE_UNITS 16          // Gate lengths are counted in 1/16ths of a step
+#define LOOPER_DEFAULT_GATE 8         // Half a step
+#define LOOPER_EVENT_MERGE_US 2000    // Timed notes this close to a step ride in its packet
 
-#define LOOPER_TOTAL_STEPS (LOOPER_STEPS_PER_BEAT * LOOPER_BEATS_PER_BAR * LOOPER_BARS)
-#define LOOPER_CLICK_DIV (LOOPER_TOTAL_STEPS / LOOPER_BARS / LOOPER_STEPS_PER_BEAT )
+#define LOOPER_OFFSET_UNITS 96        // Recorded micro-offsets are 1/96ths of a step
+#define LOOPER_DEFAULT_QUANTIZE 100   // Playback quantize strength, percent (100 = on the grid)
+#define LOOPER_DEFAULT_SWING 50       // Odd-step swing, percent (50 = straight)
+#define LOOPER_TRACK_SWING_GLOBAL 0   // Track swing value that follows the global swing
+
+/*
+ * Hit levels. Each hit stores one of LOOPER_LEVELS dynamics, picked from how
+ * long the button was held: a quick tap is a ghost note, a firm press an accent.
+ */
+#define LOOPER_LEVELS 4
+#define LOOPER_LEVEL_GHOST 0
+#define LOOPER_LEVEL_ACCENT (LOOPER_LEVELS - 1)
+#define LOOPER_LEVEL_SOFT_US 40000     // Shorter presses record a ghost note
+#define LOOPER_LEVEL_NORMAL_US 90000   // ... a soft hit
+#define LOOPER_LEVEL_ACCENT_US 200000  // ... a normal hit; longer clicks record an accent
+
+/*
+ * Step modes. Each hit also stores a play chance, 100 % down to 25 % in
+ * quarters, and a ratchet count: how many evenly spaced notes it plays
+ * within its step. Both use the 2-bit packing of the levels.
+ */
+#define LOOPER_CHANCE_ALWAYS 0  // Chance 0-3 plays 4 - chance times in 4
+#define LOOPER_MAX_RATCHET 4     // Ratchet 0-3 plays 1-4 notes
 
 // Represents the current playback or recording state.
 typedef enum {
@@ -23,6 +80,7 @@ typedef enum {
 
 typedef struct {
     uint64_t last_step_time_us;      // Time of last step transition
+    timing_fx_t next_step_deadline;  // Absolute due time of the next step (fixed-point µs)
     uint64_t button_press_start_us;  // Timestamp when button was pressed
 } looper_timing_t;
 
@@ -31,24 +89,76 @@ typedef struct {
  * Holds track index, current step, recording progress, and last tick time.
  */
 typedef struct {
-    uint32_t bpm;
-    uint32_t step_duration_ms;
+    uint32_t bpm;                  // Tempo rounded to whole BPM, for display.
+    timing_fx_t beat_period;       // Beat length in fixed-point µs.
+    timing_fx_t step_period;       // Step length in fixed-point µs.
     looper_state_t state;          // Current looper mode (e.g. PLAYING, RECORDING).
-    uint8_t current_track;         // Index of the active track (for recording or preview).
-    uint8_t current_step;          // Index of the current step in the sequence loop.
-    uint8_t recording_step_count;  // Number of steps recorded so far in this session.
+    uint8_t current_track;          // Index of the active track (for recording or preview).
+    uint16_t current_step;          // Index of the current step in the sequence loop.
+    uint16_t recording_step_count;  // Number of steps recorded so far in this session.
+    uint8_t num_tracks;             // Tracks in use (<= LOOPER_MAX_TRACKS).
+    uint8_t bars;                   // Loop length in bars (<= LOOPER_MAX_BARS).
+    uint8_t steps_per_beat;         // Step resolution (<= LOOPER_MAX_STEPS_PER_BEAT).
+    uint16_t total_steps;           // bars * LOOPER_BEATS_PER_BAR * steps_per_beat.
+    uint8_t quantize;               // Share of each micro-offset removed on playback, percent.
+    uint8_t swing;                  // Position of odd steps within a step pair, percent.
+    uint8_t pattern_index;          // Playing pattern of the bank (0 = A).
+    uint8_t next_pattern_index;     // Pattern queued for the next bar line.
+    bool chain;                     // At each loop end, move on to the next non-empty pattern.
+    bool clock_follow;              // Tempo and phase follow an external MIDI clock.
+    bool clock_locked;              // ... and that clock is currently being received.
+    bool clock_output;              // Send 24 PPQN Timing Clock and Start/Stop to the host.
     looper_timing_t timing;
 } looper_status_t;
 
+// Bit-packed step pattern: bit (step % 32) of word (step / 32) is set when the step plays.
+typedef struct {
+    uint32_t bits[LOOPER_PATTERN_WORDS];
+} looper_pattern_t;
+
+// Per-step 2-bit values (levels, chances, ratchets); only meaningful where there is a hit.
+typedef struct {
+    uint32_t bits[LOOPER_LEVEL_WORDS];
+} looper_levels_t;
+
 // Represents each MIDI track with note and sequence pattern.
 typedef struct {
-    const char *name;                       // Human-readable name of the track.
-    uint8_t note;                           // MIDI note to trigger.
-    uint8_t channel;                        // MIDI channel.
-    bool pattern[LOOPER_TOTAL_STEPS];       // Current active pattern
-    bool hold_pattern[LOOPER_TOTAL_STEPS];  // Temporary copy saved on button down.
+    const char *name;                 // Human-readable name of the track.
+    uint8_t note;                     // MIDI note to trigger.
+    uint8_t channel;                  // MIDI channel.
+    uint8_t gate;                     // Note length in 1/LOOPER_GATE_UNITS of a step.
+    looper_pattern_t pattern;         // Current active pattern
+    int8_t offset[LOOPER_MAX_STEPS];  // Recorded micro-offset of each hit (1/96 step).
+    looper_levels_t levels;           // Recorded level of each hit.
+    uint8_t swing;                    // Own swing, percent, or LOOPER_TRACK_SWING_GLOBAL.
+    uint8_t groove;                   // Groove template index (0 = straight).
+    looper_levels_t chance;           // Play chance of each hit (LOOPER_CHANCE_ALWAYS = 100 %).
+    looper_levels_t ratchet;          // Notes per hit, minus one.
 } track_t;
 
+static inline bool looper_pattern_get(const looper_pattern_t *pattern, uint16_t step) {
+    return (pattern->bits[step / 32] >> (step % 32)) & 1u;
+}
+
+static inline void looper_pattern_set(looper_pattern_t *pattern, uint16_t step) {
+    pattern->bits[step / 32] |= 1u << (step % 32);
+}
+
+static inline void looper_pattern_clear(looper_pattern_t *pattern) {
+    memset(pattern->bits, 0, sizeof(pattern->bits));
+}
+
+static inline uint8_t looper_level_get(const looper_levels_t *levels, uint16_t step) {
+    return (levels->bits[step / 16] >> (2 * (step % 16))) & 3u;
+}
+
+static inline void looper_level_set(looper_levels_t *levels, uint16_t step, uint8_t level) {
+    uint32_t shift = 2 * (step % 16);
+    levels->bits[step / 16] = (levels->bits[step / 16] & ~(3u << shift)) | ((level & 3u) << shift);
+}
+
+
+void looper_init(void);
 
 looper_status_t *looper_status_get(void);
 
@@ -56,10 +166,24 @@ uint32_t looper_get_step_interval_ms(void);
 
 void looper_update_bpm(uint32_t bpm);
 
+void looper_update_beat_period(timing_fx_t beat_period);
+
+bool looper_request_layout(uint8_t num_tracks, uint8_t bars, uint8_t steps_per_beat);
+
+bool looper_request_pattern(uint8_t index);
+
 void looper_process_state(uint64_t start_us);
 
 void looper_handle_button_event(button_event_t event);
 
 void looper_handle_tick(btstack_timer_source_t *ts);
 
-void looper_handle_input(void);
+bool looper_is_idle(void);
+
+void looper_restore(void);
+
+void looper_start_service(void);
+
+#if LOOPER_DUAL_CORE
+void looper_launch_core1(void);
+#endif
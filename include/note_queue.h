@@ -0,0 +1,34 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Must be a power of two, and hold every event of one step (checked in looper.c)
+#define NOTE_QUEUE_SIZE 1024
+
+typedef enum {
+    NOTE_EVENT_NOTE = 0,  // Queue a note into the current step packet
+    NOTE_EVENT_FLUSH,     // End of step: send the packet
+    NOTE_EVENT_REALTIME,  // Queue the System Real-Time byte in `note` into the packet
+} note_event_type_t;
+
+typedef struct {
+    uint64_t time_us;  // Scheduled step time
+    uint8_t type;      // note_event_type_t
+    uint8_t channel;
+    uint8_t note;
+    uint8_t velocity;
+} note_event_t;
+
+void note_queue_init(void (*consumer)(void));
+
+bool note_queue_push(const note_event_t *event);
+
+bool note_queue_pop(note_event_t *event);
+
+void note_queue_notify(void);
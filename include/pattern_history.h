@@ -0,0 +1,33 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PATTERN_HISTORY_SIZE 64  // Word deltas kept; must be a power of two
+
+// Called once per delta to XOR `bits` into word `word` of a track's pattern.
+typedef void (*pattern_history_apply_cb_t)(uint8_t pattern, uint8_t track, uint8_t word,
+                                           uint32_t bits);
+
+void pattern_history_reset(void);
+
+void pattern_history_begin(void);
+
+void pattern_history_record(uint8_t pattern, uint8_t track, uint8_t word, uint32_t bits);
+
+bool pattern_history_undo(pattern_history_apply_cb_t apply);
+
+bool pattern_history_redo(pattern_history_apply_cb_t apply);
+
+uint32_t pattern_history_mark(void);
+
+void pattern_history_undo_to(uint32_t mark, pattern_history_apply_cb_t apply);
+
+uint8_t pattern_history_undo_steps(void);
+
+uint8_t pattern_history_redo_steps(void);
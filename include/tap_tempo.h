@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include "drivers/button.h"
+#include "timing.h"
 
 typedef enum {
     TAP_NONE = 0,
@@ -14,4 +15,5 @@ typedef enum {
 bool taptempo_active(void);
 tap_result_t taptempo_handle_event(button_event_t ev);
 uint16_t taptempo_get_bpm(void);
+timing_fx_t taptempo_get_beat_period(void);
 bool taptempo_is_ready(void);
@@ -0,0 +1,45 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Histogram buckets. Times use power-of-two buckets: bucket 0 counts 0 µs,
+ * bucket i counts [2^(i-1), 2^i) µs and the last one everything from
+ * 16.4 ms up. Queue depths use one bucket per packet.
+ */
+#define TICK_STATS_BUCKETS 16
+
+typedef struct {
+    uint32_t count[TICK_STATS_BUCKETS];
+    uint32_t max;  // Largest sample, unbucketed
+} tick_histogram_t;
+
+typedef struct {
+    uint32_t steps;                // Steps recorded since boot or the last reset
+    uint32_t flushes;              // Step and timed-note packets handed to BLE-MIDI
+    uint32_t flushes_deferred;     // ... that left packets waiting for the controller
+    uint32_t events_dropped;       // Note events lost to a full core 1 -> core 0 queue
+    tick_histogram_t lateness;     // Actual minus scheduled step time, µs
+    tick_histogram_t wake_margin;  // Timer wake-up ahead of the deadline, µs (spun out)
+    tick_histogram_t duration;     // Step handler run time, µs
+    tick_histogram_t queue_depth;  // BLE-MIDI packets still queued after each flush
+} tick_stats_t;
+
+void tick_stats_record_step(uint64_t scheduled_us, uint64_t woke_us, uint64_t fired_us,
+                            uint64_t done_us);
+
+void tick_stats_record_flush(uint16_t queue_depth);
+
+void tick_stats_record_dropped_event(void);
+
+const tick_stats_t *tick_stats_get(void);
+
+void tick_stats_reset(void);
+
+size_t tick_stats_format(char *buffer, size_t size);
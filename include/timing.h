@@ -0,0 +1,34 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Fixed-point time: µs with TIMING_FRAC_BITS fractional bits, in 64 bits.
+ * Step periods reach seconds at slow tempos and deadlines are absolute times,
+ * so the integer part needs more than 16 bits; the 16-bit fraction keeps
+ * tempo and phase exact to 1/65536 µs.
+ */
+#define TIMING_FRAC_BITS 16
+
+typedef uint64_t timing_fx_t;
+
+static inline timing_fx_t timing_from_us(uint64_t us) { return us << TIMING_FRAC_BITS; }
+
+static inline uint64_t timing_to_us(timing_fx_t t) { return t >> TIMING_FRAC_BITS; }
+
+int64_t timing_div_round(int64_t n, int64_t d);
+
+timing_fx_t timing_beat_period(uint32_t bpm);
+
+timing_fx_t timing_beat_period_from_span(uint64_t span_us, uint8_t beats);
+
+uint32_t timing_bpm(timing_fx_t beat_period);
+
+int64_t timing_ticks(int64_t delta_us, timing_fx_t period, uint32_t units);
+
+int64_t timing_ticks_us(int64_t ticks, timing_fx_t period, uint32_t units);
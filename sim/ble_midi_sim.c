@@ -0,0 +1,239 @@
+/*
+ * ble_midi_sim.c
+ *
+ * Host simulation of the BLE-MIDI driver. The unmodified drivers/ble_midi.c
+ * runs on the virtual clock against the BTstack and controller model of
+ * sim_btstack.c, and this harness streams gated notes through it, one step
+ * every SIM_STEP_US, while one central stalls and holds its buffers:
+ *
+ *   - isolation: the centrals that keep up receive every Note-On and
+ *     Note-Off, however long the other one stalls
+ *   - share: the stalled central never holds more controller buffers than
+ *     its share
+ *   - no hanging notes: the Note-Offs of the packets the stalled central's
+ *     queue drops are carried on, so every note it heard is released
+ *   - loopback: a packet the central writes comes back byte for byte as a
+ *     notification of its own, even with step packets queued around it
+ *
+ * Exits non-zero when a check fails.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "drivers/ble_midi.h"
+#include "pico/time.h"
+#include "sim.h"
+
+#define SIM_START_US 1000000
+#define SIM_STEP_US 10000  // 16ths at 375 bpm: denser than any pattern
+#define SIM_DRAIN_US 500000
+#define SIM_CHANNEL 9
+#define SIM_NOTES 8  // Notes 36.. played in turn, each until the next step
+#define SIM_ECHO_CHANNEL 15  // Only the loopback probe uses it
+
+typedef struct {
+    uint32_t notes_on;
+    uint32_t notes_off;
+    uint32_t stray_offs;
+    uint8_t sounding[16][128];
+} sim_peer_t;
+
+static sim_peer_t peers[SIM_BLE_MAX_LINKS];
+static btstack_timer_source_t step_timer;
+static uint32_t steps_left = 0;
+static uint32_t notes_sent = 0;
+static uint8_t playing_note = 0;  // 0 while nothing sounds
+
+// Loopback probe: a Note-On the central writes, and how it came back.
+static const uint8_t echo_probe[] = {0x80, 0x80, 0x90 | SIM_ECHO_CHANNEL, 127, 1};
+static uint32_t echoes = 0;         // Notifications identical to the probe
+static uint32_t echoes_merged = 0;  // Probe messages inside any other notification
+
+static void on_message(uint8_t link, uint8_t status, uint8_t data1, uint8_t data2) {
+    sim_peer_t *peer = &peers[link];
+    if ((status & 0xF0) != 0x90)
+        return;
+    uint8_t channel = status & 0x0F;
+    if (channel == SIM_ECHO_CHANNEL) {
+        echoes_merged++;
+        return;
+    }
+    if (data2 != 0) {
+        peer->notes_on++;
+        peer->sounding[channel][data1]++;
+    } else {
+        peer->notes_off++;
+        if (peer->sounding[channel][data1] == 0)
+            peer->stray_offs++;
+        else
+            peer->sounding[channel][data1]--;
+    }
+}
+
+// Splits a notification into its messages: timestamp, then status or running-status data.
+static void on_receive(uint8_t link, const uint8_t *data, uint16_t length, uint64_t time_us) {
+    (void)time_us;
+    if (length == sizeof(echo_probe) && memcmp(data, echo_probe, length) == 0) {
+        echoes++;
+        return;
+    }
+    uint8_t status = 0;
+    for (uint16_t i = 1; i < length;) {  // data[0] is the header
+        if (data[i] & 0x80) {
+            i++;  // Timestamp
+            if (i < length && (data[i] & 0x80)) {
+                if (data[i] < 0xF8)
+                    status = data[i];
+                i++;
+            }
+            continue;
+        }
+        if (i + 1 >= length)
+            break;
+        on_message(link, status, data[i], data[i + 1]);
+        i += 2;
+    }
+}
+
+// Releases the note that sounds, if any, at `time_us`.
+static void release_note(uint64_t time_us) {
+    if (playing_note != 0)
+        ble_midi_queue_note(time_us, SIM_CHANNEL, playing_note, 0);
+    playing_note = 0;
+}
+
+// One step: the previous note's Note-Off and a new Note-On, in one packet.
+static void on_step(btstack_timer_source_t *ts) {
+    uint64_t now_us = time_us_64();
+    release_note(now_us);
+    if (steps_left > 0) {
+        playing_note = 36 + notes_sent % SIM_NOTES;
+        ble_midi_queue_note(now_us, SIM_CHANNEL, playing_note, 100);
+        notes_sent++;
+        steps_left--;
+    }
+    ble_midi_flush();
+    if (steps_left > 0 || playing_note != 0) {
+        ts->due_us = now_us + SIM_STEP_US;
+        btstack_run_loop_add_timer(ts);
+    }
+}
+
+// Sounding notes left on `peer` once everything was sent and delivered.
+static uint32_t hanging_notes(const sim_peer_t *peer) {
+    uint32_t hanging = 0;
+    for (uint8_t channel = 0; channel < 16; channel++)
+        for (uint8_t note = 0; note < 128; note++)
+            hanging += peer->sounding[channel][note];
+    return hanging;
+}
+
+static bool report_check(const char *name, bool ok) {
+    if (!ok)
+        printf("FAIL %s\n", name);
+    return ok;
+}
+
+// Connects `links` centrals and starts `steps` steps; returns the time of the first.
+static uint64_t start_run(uint8_t links, uint32_t steps) {
+    memset(peers, 0, sizeof(peers));
+    notes_sent = 0;
+    for (uint8_t i = 0; i < links; i++)
+        sim_ble_connect(i);
+
+    uint64_t start_us = time_us_64();
+    steps_left = steps;
+    btstack_run_loop_set_timer_handler(&step_timer, on_step);
+    step_timer.due_us = start_us;
+    btstack_run_loop_add_timer(&step_timer);
+    return start_us;
+}
+
+/*
+ * Plays `steps` steps to `links` centrals while link 0 stalls from
+ * `stall_from_us` to `stall_until_us` into the run, then lets every queue
+ * drain and disconnects.
+ */
+static bool run_stall(const char *name, uint8_t links, uint32_t steps, uint64_t stall_from_us,
+                      uint64_t stall_until_us) {
+    uint64_t start_us = start_run(links, steps);
+    sim_run_until(start_us + stall_from_us);
+    sim_ble_stall(0, true);
+    sim_run_until(start_us + stall_until_us);
+    sim_ble_stall(0, false);
+    sim_run_until(start_us + (uint64_t)(steps + 1) * SIM_STEP_US + SIM_DRAIN_US);
+
+    bool ok = true;
+    uint8_t share = MAX_NR_CONTROLLER_ACL_BUFFERS - (links - 1);
+    printf("%s: %u notes to %u centrals, link 0 stalled %llu ms\n", name, notes_sent, links,
+           (unsigned long long)((stall_until_us - stall_from_us) / 1000));
+    for (uint8_t i = 0; i < links; i++) {
+        const sim_peer_t *peer = &peers[i];
+        printf("  link %u: on %u off %u stray %u hanging %u, buffers held max %u\n", i,
+               peer->notes_on, peer->notes_off, peer->stray_offs, hanging_notes(peer),
+               sim_ble_max_in_flight(i));
+        ok &= report_check("hanging notes", hanging_notes(peer) == 0);
+        if (i == 0) {
+            ok &= report_check("share", sim_ble_max_in_flight(0) <= share);
+        } else {
+            ok &= report_check("isolation",
+                               peer->notes_on == notes_sent && peer->notes_off == notes_sent);
+        }
+    }
+    for (uint8_t i = 0; i < links; i++)
+        sim_ble_disconnect(i);
+    return ok;
+}
+
+/*
+ * With loopback on, the central writes the probe while its link stalls, so
+ * the step packets before and after it wait in the same queue.
+ */
+static bool run_loopback(void) {
+    const uint32_t steps = 100;
+    echoes = echoes_merged = 0;
+    ble_midi_set_loopback(true);
+    uint64_t start_us = start_run(1, steps);
+    uint64_t stall_us = start_us + 50 * SIM_STEP_US + SIM_STEP_US / 2;  // Between two steps
+    sim_run_until(stall_us);
+    sim_ble_stall(0, true);
+    sim_run_until(stall_us + 4 * SIM_STEP_US);  // The controller buffers fill, then the queue
+    sim_ble_write(0, echo_probe, sizeof(echo_probe));
+    sim_run_until(stall_us + 4 * SIM_STEP_US + 8000);  // One more step queues behind it
+    sim_ble_stall(0, false);
+    sim_run_until(start_us + (uint64_t)(steps + 1) * SIM_STEP_US + SIM_DRAIN_US);
+
+    const sim_peer_t *peer = &peers[0];
+    printf("loopback: %u notes, echoes %u whole, %u merged; on %u off %u\n", notes_sent, echoes,
+           echoes_merged, peer->notes_on, peer->notes_off);
+    bool ok = report_check("loopback", echoes == 1 && echoes_merged == 0);
+    ok &= report_check("hanging notes", hanging_notes(peer) == 0);
+    sim_ble_disconnect(0);
+    ble_midi_set_loopback(false);
+    return ok;
+}
+
+int main(void) {
+    sim_set_time_us(SIM_START_US);
+    sim_ble_set_receiver(on_receive);
+    ble_midi_init(NULL);
+
+    bool ok = true;
+    for (uint8_t links = 2; links <= SIM_BLE_MAX_LINKS; links++) {
+        char name[32];
+        snprintf(name, sizeof(name), "stall with %u centrals", links);
+        ok &= run_stall(name, links, 200, 0, 200 * SIM_STEP_US);
+    }
+    // A stall long enough to drop queued packets, then the queue drains.
+    ok &= run_stall("stall and resume", 2, 200, 500000, 1000000);
+    ok &= run_loopback();
+    const ble_midi_stats_t *stats = ble_midi_get_stats();
+    printf("ble sent %u  merged %u  dropped %u full, %u stale  offs carried %u  queue max %u\n",
+           stats->packets_sent, stats->packets_merged, stats->dropped_full, stats->dropped_stale,
+           stats->offs_carried, stats->max_queue_depth);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,246 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+/*
+ * Host simulation: the subset of the BTstack run loop the looper core uses.
+ * Timers keep BTstack's whole-ms resolution against the virtual clock, so the
+ * step clock still has to spin out the remainder like on the device.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct btstack_timer_source {
+    struct btstack_timer_source *next;
+    uint64_t due_us;
+    void (*process)(struct btstack_timer_source *ts);
+    void *context;
+} btstack_timer_source_t;
+
+typedef enum {
+    DATA_SOURCE_CALLBACK_POLL = 1 << 0,
+} btstack_data_source_callback_type_t;
+
+typedef struct btstack_data_source {
+    void (*process)(struct btstack_data_source *ds,
+                    btstack_data_source_callback_type_t callback_type);
+    uint16_t flags;
+} btstack_data_source_t;
+
+void btstack_run_loop_set_timer(btstack_timer_source_t *ts, uint32_t timeout_ms);
+void btstack_run_loop_set_timer_handler(btstack_timer_source_t *ts,
+                                        void (*process)(btstack_timer_source_t *ts));
+void btstack_run_loop_set_timer_context(btstack_timer_source_t *ts, void *context);
+void *btstack_run_loop_get_timer_context(btstack_timer_source_t *ts);
+void btstack_run_loop_add_timer(btstack_timer_source_t *ts);
+int btstack_run_loop_remove_timer(btstack_timer_source_t *ts);
+
+void btstack_run_loop_set_data_source_handler(
+    btstack_data_source_t *ds,
+    void (*process)(btstack_data_source_t *ds, btstack_data_source_callback_type_t callback_type));
+void btstack_run_loop_enable_data_source_callbacks(btstack_data_source_t *ds, uint16_t callbacks);
+void btstack_run_loop_add_data_source(btstack_data_source_t *ds);
+void btstack_run_loop_poll_data_sources_from_irq(void);
+
+/*
+ * The subset of the BTstack host API that drivers/ble_midi.c uses, for the
+ * BLE-MIDI simulation (sim_btstack.c). Events keep BTstack's HCI layouts,
+ * since the driver reads some of them by offset.
+ */
+
+#include <string.h>
+
+#include "btstack_config.h"
+
+typedef uint16_t hci_con_handle_t;
+typedef uint8_t bd_addr_t[6];
+typedef uint8_t sm_key_t[16];
+
+typedef void (*btstack_packet_handler_t)(uint8_t packet_type, uint16_t channel, uint8_t *packet,
+                                         uint16_t size);
+
+typedef struct {
+    btstack_packet_handler_t callback;
+} btstack_packet_callback_registration_t;
+
+typedef uint16_t (*att_read_callback_t)(hci_con_handle_t con_handle, uint16_t attribute_handle,
+                                        uint16_t offset, uint8_t *buffer, uint16_t buffer_size);
+typedef int (*att_write_callback_t)(hci_con_handle_t con_handle, uint16_t attribute_handle,
+                                    uint16_t transaction_mode, uint16_t offset, uint8_t *buffer,
+                                    uint16_t buffer_size);
+
+#define HCI_CON_HANDLE_INVALID 0xffff
+#define HCI_EVENT_PACKET 0x04
+#define HCI_POWER_ON 1
+#define HCI_STATE_WORKING 2
+#define ERROR_CODE_SUCCESS 0x00
+#define BTSTACK_ACL_BUFFERS_FULL 0x57
+#define BD_ADDR_TYPE_UNKNOWN 0xff
+
+#define HCI_EVENT_DISCONNECTION_COMPLETE 0x05
+#define HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS 0x13
+#define HCI_EVENT_LE_META 0x3e
+#define HCI_SUBEVENT_LE_CONNECTION_COMPLETE 0x01
+#define HCI_SUBEVENT_LE_CONNECTION_UPDATE_COMPLETE 0x03
+#define HCI_SUBEVENT_LE_DATA_LENGTH_CHANGE 0x07
+#define HCI_SUBEVENT_LE_PHY_UPDATE_COMPLETE 0x0c
+#define BTSTACK_EVENT_STATE 0x60
+#define ATT_EVENT_MTU_EXCHANGE_COMPLETE 0xb5
+#define ATT_EVENT_CAN_SEND_NOW 0xb7
+#define SM_EVENT_IDENTITY_RESOLVING_SUCCEEDED 0xcf
+#define SM_EVENT_IDENTITY_CREATED 0xd0
+
+#define BLUETOOTH_DATA_TYPE_FLAGS 0x01
+#define BLUETOOTH_DATA_TYPE_COMPLETE_LIST_OF_128_BIT_SERVICE_CLASS_UUIDS 0x07
+#define BLUETOOTH_DATA_TYPE_SHORTENED_LOCAL_NAME 0x08
+
+static inline uint16_t little_endian_read_16(const uint8_t *buffer, int position) {
+    return (uint16_t)(buffer[position] | (buffer[position + 1] << 8));
+}
+
+static inline void little_endian_store_16(uint8_t *buffer, uint16_t position, uint16_t value) {
+    buffer[position] = (uint8_t)value;
+    buffer[position + 1] = (uint8_t)(value >> 8);
+}
+
+static inline uint8_t hci_event_packet_get_type(const uint8_t *event) { return event[0]; }
+
+static inline uint8_t btstack_event_state_get_state(const uint8_t *event) { return event[2]; }
+
+static inline uint8_t hci_event_le_meta_get_subevent_code(const uint8_t *event) {
+    return event[2];
+}
+
+static inline uint8_t hci_subevent_le_connection_complete_get_status(const uint8_t *event) {
+    return event[3];
+}
+
+static inline hci_con_handle_t hci_subevent_le_connection_complete_get_connection_handle(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 4);
+}
+
+static inline uint16_t hci_subevent_le_connection_complete_get_conn_interval(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 14);
+}
+
+static inline uint16_t hci_subevent_le_connection_complete_get_conn_latency(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 16);
+}
+
+static inline hci_con_handle_t hci_subevent_le_connection_update_complete_get_connection_handle(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 4);
+}
+
+static inline uint16_t hci_subevent_le_connection_update_complete_get_conn_interval(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 6);
+}
+
+static inline uint16_t hci_subevent_le_connection_update_complete_get_conn_latency(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 8);
+}
+
+static inline uint8_t hci_subevent_le_phy_update_complete_get_status(const uint8_t *event) {
+    return event[3];
+}
+
+static inline hci_con_handle_t hci_subevent_le_phy_update_complete_get_connection_handle(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 4);
+}
+
+static inline uint8_t hci_subevent_le_phy_update_complete_get_tx_phy(const uint8_t *event) {
+    return event[6];
+}
+
+static inline hci_con_handle_t hci_subevent_le_data_length_change_get_connection_handle(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 3);
+}
+
+static inline uint16_t hci_subevent_le_data_length_change_get_max_tx_octets(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 5);
+}
+
+static inline uint16_t hci_subevent_le_data_length_change_get_max_rx_octets(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 9);
+}
+
+static inline hci_con_handle_t hci_event_disconnection_complete_get_connection_handle(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 3);
+}
+
+static inline hci_con_handle_t att_event_can_send_now_get_handle(const uint8_t *event) {
+    return little_endian_read_16(event, 2);
+}
+
+static inline hci_con_handle_t att_event_mtu_exchange_complete_get_handle(const uint8_t *event) {
+    return little_endian_read_16(event, 2);
+}
+
+static inline uint16_t att_event_mtu_exchange_complete_get_MTU(const uint8_t *event) {
+    return little_endian_read_16(event, 4);
+}
+
+static inline hci_con_handle_t sm_event_identity_resolving_succeeded_get_handle(
+    const uint8_t *event) {
+    return little_endian_read_16(event, 2);
+}
+
+static inline uint16_t sm_event_identity_resolving_succeeded_get_index(const uint8_t *event) {
+    return little_endian_read_16(event, 4);
+}
+
+static inline hci_con_handle_t sm_event_identity_created_get_handle(const uint8_t *event) {
+    return little_endian_read_16(event, 2);
+}
+
+static inline uint16_t sm_event_identity_created_get_index(const uint8_t *event) {
+    return little_endian_read_16(event, 4);
+}
+
+void hci_add_event_handler(btstack_packet_callback_registration_t *callback_handler);
+void hci_power_control(int power_mode);
+int hci_number_free_acl_slots_for_handle(hci_con_handle_t con_handle);
+void l2cap_init(void);
+void sm_init(void);
+void sm_add_event_handler(btstack_packet_callback_registration_t *callback_handler);
+
+void att_server_init(const uint8_t *db, att_read_callback_t read_callback,
+                     att_write_callback_t write_callback);
+void att_server_register_packet_handler(btstack_packet_handler_t handler);
+uint16_t att_server_get_mtu(hci_con_handle_t con_handle);
+int att_server_can_send_packet_now(hci_con_handle_t con_handle);
+int att_server_request_can_send_now_event(hci_con_handle_t con_handle);
+int att_server_notify(hci_con_handle_t con_handle, uint16_t attribute_handle,
+                      const uint8_t *value, uint16_t value_len);
+uint16_t att_read_callback_handle_blob(const uint8_t *blob, uint16_t blob_size, uint16_t offset,
+                                       uint8_t *buffer, uint16_t buffer_size);
+
+void gap_advertisements_set_params(uint16_t adv_int_min, uint16_t adv_int_max, uint8_t adv_type,
+                                   uint8_t direct_address_typ, bd_addr_t direct_address,
+                                   uint8_t channel_map, uint8_t filter_policy);
+void gap_advertisements_set_data(uint8_t advertising_data_length, uint8_t *advertising_data);
+void gap_advertisements_enable(int enabled);
+void gap_local_bd_addr(bd_addr_t address_buffer);
+int gap_request_connection_parameter_update(hci_con_handle_t con_handle, uint16_t conn_interval_min,
+                                            uint16_t conn_interval_max, uint16_t conn_latency,
+                                            uint16_t supervision_timeout);
+int gap_le_set_phy(hci_con_handle_t con_handle, uint8_t all_phys, uint8_t tx_phys,
+                   uint8_t rx_phys, uint16_t phy_options);
+const char *bd_addr_to_str(const bd_addr_t addr);
+
+int le_device_db_max_count(void);
+void le_device_db_info(int index, int *addr_type, bd_addr_t addr, sm_key_t irk);
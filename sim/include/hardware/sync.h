@@ -0,0 +1,15 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// Host simulation: everything runs on one thread, so a compiler barrier will do.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define __no_inline_not_in_flash_func(name) name
+
+static inline void __dmb(void) { __atomic_signal_fence(__ATOMIC_SEQ_CST); }
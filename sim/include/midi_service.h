@@ -0,0 +1,15 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// Host simulation: stands in for the header compile_gatt.py generates from midi_service.gatt.
+
+#include <stdint.h>
+
+#define ATT_CHARACTERISTIC_GAP_DEVICE_NAME_01_VALUE_HANDLE 0x0003
+#define ATT_CHARACTERISTIC_7772E5DB_3868_4112_A1A9_F2669D106BF3_01_VALUE_HANDLE 0x000b
+
+static const uint8_t profile_data[] = {0};
@@ -0,0 +1,14 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// Host simulation: the status LED is recorded by sim_platform.c.
+
+#include "pico/stdlib.h"
+
+#define CYW43_WL_GPIO_LED_PIN 0
+
+void cyw43_arch_gpio_put(unsigned int pin, bool value);
@@ -0,0 +1,26 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+// Host simulation: the Pico SDK time API over the virtual clock of sim_platform.c.
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef uint64_t absolute_time_t;
+
+uint64_t time_us_64(void);
+
+static inline uint32_t time_us_32(void) { return (uint32_t)time_us_64(); }
+
+static inline absolute_time_t from_us_since_boot(uint64_t us) { return us; }
+
+// Waiting costs no host time: the virtual clock jumps to `target`.
+void busy_wait_until(absolute_time_t target);
+
+void sleep_until(absolute_time_t target);
+
+void sleep_us(uint64_t us);
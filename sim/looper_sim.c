@@ -0,0 +1,386 @@
+/*
+ * looper_sim.c
+ *
+ * Host simulation of the looper core. The unmodified sequencer in src/ runs
+ * on a virtual clock through the sim drivers, with its step timer, deadline
+ * spin and looper service, and this harness checks what comes out:
+ *
+ *   - drift: every beat click falls on its fixed-point step deadline
+ *   - lateness: each packet is flushed no later than its messages are due
+ *   - gating: no Note-On sounds again before its Note-Off
+ *   - quantization: MIDI notes played with up to ±40 % of a step of jitter
+ *     in one recording pass play back on their nearest steps in every
+ *     later loop
+ *   - tick cost: host time per step handler call
+ *
+ * With --fuzz, random console keys, button gestures, inbound notes and
+ * dropouts are thrown at the looper instead, and only the checks that hold
+ * for any input are run. The run ends with one more dropout, after which
+ * every note the central heard must be released. Exits non-zero when a check fails, so it can gate
+ * CI; build with -DLOOPER_SIM_SANITIZE=ON to fuzz under ASan and UBSan.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "looper.h"
+#include "pico/time.h"
+#include "sim.h"
+#include "timing.h"
+
+#define SIM_START_US 1000000  // A zero step deadline means "not started yet"
+#define SIM_RECORD_JITTER 40  // Largest recorded offset, percent of a step
+#define SIM_TRACKS 4          // Tracks played into the recording pass
+
+// Notes of the first track presets in src/looper.c.
+static const uint8_t track_notes[SIM_TRACKS] = {36, 38, 42, 46};
+
+typedef struct {
+    uint32_t bars;
+    uint32_t bpm;
+    uint32_t seed;
+    bool fuzz;
+} sim_options_t;
+
+typedef struct {
+    uint64_t time_us;
+    uint8_t track;
+} sim_hit_t;
+
+static sim_options_t options = {10000, LOOPER_DEFAULT_BPM, 1, false};
+static uint32_t rng_state;
+
+// Timeline of the run: step 0 at t0, one fixed-point step period apart.
+static timing_fx_t t0_fx = 0;
+static timing_fx_t step_period = 0;
+static uint16_t total_steps = 0;
+static bool started = false;
+
+// Tick cost, in host ns.
+static uint64_t steps = 0;
+static uint64_t step_ns_total = 0;
+static uint64_t step_ns_max = 0;
+
+// Checks.
+static uint64_t notes_on = 0;
+static uint64_t notes_off = 0;
+static uint64_t clicks = 0;
+static uint64_t drift_max_us = 0;
+static uint64_t late_max_us = 0;
+static uint64_t last_click_us = 0;
+static uint32_t retriggers = 0;
+static uint32_t stray_offs = 0;
+static uint32_t misordered = 0;
+static uint8_t sounding[16][128];
+static bool draining = false;  // Only releases of notes already sounding count
+
+// Quantization: hits expected on every step of a loop, against those played.
+static uint16_t expected_hits[LOOPER_MAX_STEPS];
+static uint16_t played_hits[LOOPER_MAX_STEPS];
+static uint32_t checked_loop = 0;
+static uint32_t loops_checked = 0;
+static uint32_t loop_mismatches = 0;
+static uint32_t offgrid = 0;
+static uint32_t recorded_hits = 0;
+
+static uint32_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint64_t host_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t step_time_us(int64_t step) {
+    return timing_to_us(t0_fx + (timing_fx_t)step * step_period);
+}
+
+// Nearest step of the timeline to `time_us`.
+static int64_t step_at(uint64_t time_us) {
+    return timing_div_round((int64_t)(timing_from_us(time_us) - t0_fx), (int64_t)step_period);
+}
+
+// Step timer handler: the looper's own, timed in host ns.
+static void sim_step(btstack_timer_source_t *ts) {
+    uint64_t begin_ns = host_ns();
+    looper_handle_tick(ts);
+    uint64_t ns = host_ns() - begin_ns;
+    steps++;
+    step_ns_total += ns;
+    if (ns > step_ns_max)
+        step_ns_max = ns;
+    if (!started) {
+        // The first tick started the timeline one step before the next deadline
+        const looper_status_t *status = looper_status_get();
+        step_period = status->step_period;
+        t0_fx = status->timing.next_step_deadline - step_period;
+        total_steps = status->total_steps;
+        started = true;
+    }
+}
+
+// Compare the hits played in `checked_loop` with the recorded take.
+static void check_loop(void) {
+    loops_checked++;
+    if (memcmp(played_hits, expected_hits, total_steps * sizeof(played_hits[0])) != 0)
+        loop_mismatches++;
+    memset(played_hits, 0, sizeof(played_hits));
+}
+
+static void check_track_note(uint64_t time_us, uint8_t note) {
+    int64_t step = step_at(time_us);
+    if (step_time_us(step) != time_us)
+        offgrid++;
+    uint32_t loop = (uint32_t)(step / total_steps);
+    if (loop < 3)
+        return;  // Loop 1 is recorded into; the take ends during loop 2
+    if (loop != checked_loop) {
+        if (checked_loop >= 3)
+            check_loop();
+        checked_loop = loop;
+    }
+    for (uint8_t i = 0; i < SIM_TRACKS; i++) {
+        if (track_notes[i] == note)
+            played_hits[step % total_steps] |= 1u << i;
+    }
+}
+
+static void on_output(uint64_t time_us, uint8_t status, uint8_t data1, uint8_t data2,
+                      uint64_t sent_us) {
+    if (options.fuzz) {
+        // Any input: nothing is scheduled far from when it is sent
+        if (time_us > sent_us + 2000000 || time_us + 10000000 < sent_us)
+            misordered++;
+    } else if (sent_us > time_us && sent_us - time_us > late_max_us) {
+        late_max_us = sent_us - time_us;
+    }
+    if ((status & 0xF0) != 0x90)
+        return;
+    uint8_t channel = status & 0x0F;
+    if (data2 == 0) {
+        if (sounding[channel][data1] > 0) {
+            notes_off++;
+            sounding[channel][data1]--;
+        } else if (!draining) {
+            notes_off++;
+            stray_offs++;
+        }
+        return;
+    }
+    if (draining)
+        return;
+    notes_on++;
+    if (sounding[channel][data1] > 0 && !options.fuzz)
+        retriggers++;  // Button previews may overlap a step note; the step path may not
+    if (sounding[channel][data1] < UINT8_MAX)
+        sounding[channel][data1]++;
+
+    if (channel == 0 && data1 == 37) {
+        // Beat click: on its deadline, and after the previous one
+        clicks++;
+        if (time_us <= last_click_us)
+            misordered++;
+        last_click_us = time_us;
+        if (!options.fuzz) {
+            uint64_t due_us = step_time_us(step_at(time_us));
+            uint64_t drift_us = (time_us > due_us) ? time_us - due_us : due_us - time_us;
+            if (drift_us > drift_max_us)
+                drift_max_us = drift_us;
+        }
+    } else if (channel == 9 && !options.fuzz) {
+        check_track_note(time_us, data1);
+    }
+}
+
+static int compare_hits(const void *a, const void *b) {
+    const sim_hit_t *x = a, *y = b;
+    return (x->time_us > y->time_us) - (x->time_us < y->time_us);
+}
+
+/*
+ * Play loop 1 into the looper as MIDI notes: every track hits a third of the
+ * steps, each hit early or late by up to SIM_RECORD_JITTER percent of a step.
+ * The last step is only played early, so the take ends inside its pass.
+ */
+static void record_take(void) {
+    static sim_hit_t hits[LOOPER_MAX_STEPS * SIM_TRACKS];
+    size_t count = 0;
+    int64_t step_us = (int64_t)timing_to_us(step_period);
+    for (uint16_t s = 0; s < total_steps; s++) {
+        for (uint8_t i = 0; i < SIM_TRACKS; i++) {
+            if (rng_next() % 3 != 0)
+                continue;
+            int64_t jitter = (int64_t)(rng_next() % (2 * SIM_RECORD_JITTER + 1)) -
+                             SIM_RECORD_JITTER;
+            if (s == total_steps - 1 && jitter > 0)
+                jitter = -jitter;
+            uint64_t time_us = step_time_us(total_steps + s) + jitter * step_us / 100;
+            hits[count++] = (sim_hit_t){time_us, i};
+            expected_hits[s] |= 1u << i;
+        }
+    }
+    qsort(hits, count, sizeof(hits[0]), compare_hits);
+    for (size_t k = 0; k < count; k++) {
+        sim_run_until(hits[k].time_us);
+        sim_midi_in(hits[k].time_us, 0x99, track_notes[hits[k].track], 100);
+    }
+    recorded_hits = (uint32_t)count;
+}
+
+// One random input at the current time, then a random wait of up to two steps.
+static void fuzz_input(void) {
+    static const char fuzz_keys[] = "lrg+-qsSGpt1234cuUxm";
+    uint64_t now_us = time_us_64();
+    switch (rng_next() % 8) {
+        case 0:
+            sim_console_push(fuzz_keys[rng_next() % (sizeof(fuzz_keys) - 1)]);
+            break;
+        case 1: {
+            uint64_t duration_us = rng_next() % 300000;
+            sim_button_push(BUTTON_EVENT_DOWN, now_us, 0);
+            sim_button_push(BUTTON_EVENT_CLICK_RELEASE, now_us, duration_us);
+            break;
+        }
+        case 2: {
+            static const button_event_t holds[] = {
+                BUTTON_EVENT_HOLD_RELEASE,
+                BUTTON_EVENT_LONG_HOLD_RELEASE,
+                BUTTON_EVENT_VERY_LONG_HOLD_RELEASE,
+            };
+            sim_button_push(BUTTON_EVENT_DOWN, now_us, 0);
+            sim_button_push(holds[rng_next() % 3], now_us, 1000000);
+            break;
+        }
+        case 3:
+            if (rng_next() % 64 == 0) {
+                sim_set_connected(false);
+                sim_run_until(now_us + rng_next() % 3000000);
+                sim_set_connected(true);
+            }
+            break;
+        default:
+            sim_midi_in(now_us - rng_next() % 20000, 0x90 | (rng_next() % 16),
+                        rng_next() % 128, 1 + rng_next() % 127);
+            break;
+    }
+    uint64_t wait_us = rng_next() % (2 * timing_to_us(looper_status_get()->step_period) + 1);
+    sim_run_until(time_us_64() + wait_us);
+}
+
+/*
+ * Ends a fuzz run with a dropout and returns the notes still sounding once
+ * the central is back for a step. The looper keeps the Note-Offs of the notes
+ * it played, so none may be left.
+ */
+static uint32_t drain_hanging_notes(void) {
+    uint64_t step_us = timing_to_us(looper_status_get()->step_period);
+    sim_set_connected(false);
+    sim_run_until(time_us_64() + 1000000);
+    draining = true;
+    sim_set_connected(true);
+    sim_run_until(time_us_64() + step_us);
+    uint32_t hanging = 0;
+    for (uint8_t channel = 0; channel < 16; channel++)
+        for (uint8_t note = 0; note < 128; note++)
+            hanging += sounding[channel][note];
+    return hanging;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "usage: %s [--bars N] [--bpm N] [--seed N] [--fuzz]\n", name);
+    exit(2);
+}
+
+static void parse_options(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--fuzz") == 0) {
+            options.fuzz = true;
+        } else if (i + 1 < argc && strcmp(argv[i], "--bars") == 0) {
+            options.bars = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && strcmp(argv[i], "--bpm") == 0) {
+            options.bpm = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else if (i + 1 < argc && strcmp(argv[i], "--seed") == 0) {
+            options.seed = (uint32_t)strtoul(argv[++i], NULL, 0);
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (options.bars < 4 || options.bpm == 0)
+        usage(argv[0]);
+    rng_state = options.seed ? options.seed : 1;
+}
+
+static bool report_check(const char *name, bool ok) {
+    if (!ok)
+        printf("FAIL %s\n", name);
+    return ok;
+}
+
+int main(int argc, char **argv) {
+    parse_options(argc, argv);
+    sim_set_time_us(SIM_START_US);
+    sim_set_output(on_output);
+
+    looper_init();
+    looper_update_bpm(options.bpm);
+    ble_midi_init(sim_step);
+    looper_restore();
+    ble_midi_start_step_timer(looper_get_step_interval_ms());
+    looper_start_service();
+    sim_run_until(SIM_START_US + 1);
+    while (!started)
+        sim_run_until(time_us_64() + 1000);
+
+    uint64_t begin_ns = host_ns();
+    uint16_t steps_per_bar = looper_status_get()->steps_per_beat * LOOPER_BEATS_PER_BAR;
+    uint64_t end_us = step_time_us((int64_t)options.bars * steps_per_bar);
+    if (options.fuzz) {
+        while (time_us_64() < end_us)
+            fuzz_input();
+    } else {
+        record_take();
+        sim_run_until(end_us);
+    }
+    double seconds = (double)(host_ns() - begin_ns) / 1e9;
+    uint32_t hanging = options.fuzz ? drain_hanging_notes() : 0;
+
+    printf("simulated %u bars at %u bpm (%llu steps) in %.2f s: %.0f bars/s\n", options.bars,
+           options.bpm, (unsigned long long)steps, seconds, options.bars / seconds);
+    printf("step handler ns: mean %llu  max %llu\n",
+           (unsigned long long)(steps ? step_ns_total / steps : 0),
+           (unsigned long long)step_ns_max);
+    printf("notes on %llu  off %llu  clicks %llu  led changes %u\n",
+           (unsigned long long)notes_on, (unsigned long long)notes_off,
+           (unsigned long long)clicks, sim_led_changes());
+
+    bool ok = report_check("click order", misordered == 0);
+    ok &= report_check("stray Note-Offs", stray_offs == 0);
+    if (options.fuzz) {
+        printf("hanging notes after a dropout %u\n", hanging);
+        ok &= report_check("hanging notes", hanging == 0);
+    }
+    if (!options.fuzz) {
+        uint64_t loop_end_us = step_time_us((int64_t)(checked_loop + 1) * total_steps - 1);
+        if (checked_loop >= 3 && time_us_64() >= loop_end_us)
+            check_loop();  // The last loop, if it played to its end
+        printf("drift max %llu us  late max %llu us  retriggers %u\n",
+               (unsigned long long)drift_max_us, (unsigned long long)late_max_us, retriggers);
+        printf("quantize: %u hits recorded, %u of %u loops differ, %u notes off the grid\n",
+               recorded_hits, loop_mismatches, loops_checked, offgrid);
+        ok &= report_check("drift", drift_max_us == 0);
+        ok &= report_check("lateness", late_max_us == 0);
+        ok &= report_check("retriggers", retriggers == 0);
+        ok &= report_check("quantize", loops_checked > 0 && loop_mismatches == 0 && offgrid == 0);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,42 @@
+/*
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "btstack_config.h"
+#include "drivers/button.h"
+
+// Virtual clock and run loop (sim_platform.c).
+void sim_set_time_us(uint64_t time_us);
+void sim_run_until(uint64_t end_us);
+uint32_t sim_led_changes(void);
+
+// A MIDI message leaving the looper: its scheduled time and when its packet was flushed.
+typedef void (*sim_output_cb_t)(uint64_t time_us, uint8_t status, uint8_t data1, uint8_t data2,
+                                uint64_t sent_us);
+
+// Output sink and input sources (sim_drivers.c).
+void sim_set_output(sim_output_cb_t output);
+void sim_set_connected(bool connected);
+void sim_midi_in(uint64_t time_us, uint8_t status, uint8_t data1, uint8_t data2);
+void sim_button_push(button_event_t event, uint64_t press_us, uint64_t duration_us);
+void sim_console_push(int key);
+
+// BLE-MIDI simulation: centrals on links 0..SIM_BLE_MAX_LINKS-1 (sim_btstack.c).
+#define SIM_BLE_MAX_LINKS MAX_NR_HCI_CONNECTIONS
+
+// A notification link `link` received at `time_us`.
+typedef void (*sim_ble_receive_cb_t)(uint8_t link, const uint8_t *data, uint16_t length,
+                                     uint64_t time_us);
+
+void sim_ble_set_receiver(sim_ble_receive_cb_t callback);
+void sim_ble_connect(uint8_t link);
+void sim_ble_disconnect(uint8_t link);
+void sim_ble_stall(uint8_t link, bool stalled);
+uint8_t sim_ble_max_in_flight(uint8_t link);
+void sim_ble_write(uint8_t link, const uint8_t *data, uint16_t length);
@@ -0,0 +1,290 @@
+/*
+ * sim_btstack.c
+ *
+ * Host simulation of BTstack and the controller beneath drivers/ble_midi.c.
+ * Each simulated central is a link with a connection event every
+ * SIM_LINK_INTERVAL_US. At each event the link delivers the notifications it
+ * holds in controller buffers to the harness, then reports them completed, as
+ * HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS does. A stalled link holds its
+ * buffers until it is released, like a peer out of range or with a long
+ * connection interval. The buffers are shared by all links, and BTstack's own
+ * view of them is capped at MAX_NR_CONTROLLER_ACL_BUFFERS.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stddef.h>
+
+#include "btstack.h"
+#include "midi_service.h"
+#include "pico/time.h"
+#include "sim.h"
+
+#define SIM_CONTROLLER_ACL_BUFFERS 8  // What the controller reports; BTstack uses fewer
+#if SIM_CONTROLLER_ACL_BUFFERS < MAX_NR_CONTROLLER_ACL_BUFFERS
+#define SIM_ACL_BUFFERS SIM_CONTROLLER_ACL_BUFFERS
+#else
+#define SIM_ACL_BUFFERS MAX_NR_CONTROLLER_ACL_BUFFERS
+#endif
+#define SIM_LINK_INTERVAL_US 7500  // 7.5 ms connection interval
+#define SIM_LINK_MTU 131           // A full 128-byte BLE-MIDI packet
+#define SIM_LINK_PACKETS_PER_EVENT 4
+#define SIM_LINK_HANDLE_BASE 0x0040
+#define MIDI_CHARACTERISTIC_HANDLE \
+    ATT_CHARACTERISTIC_7772E5DB_3868_4112_A1A9_F2669D106BF3_01_VALUE_HANDLE
+
+typedef struct {
+    uint8_t data[SIM_LINK_MTU];
+    uint16_t length;
+} sim_notification_t;
+
+typedef struct {
+    bool connected;
+    bool stalled;
+    bool can_send_requested;
+    sim_notification_t in_flight[SIM_ACL_BUFFERS];  // Oldest at `head`
+    uint8_t head;
+    uint8_t count;
+    uint8_t max_count;
+    btstack_timer_source_t event_timer;
+} sim_link_t;
+
+static sim_link_t links[SIM_BLE_MAX_LINKS];
+static btstack_packet_handler_t hci_handler = NULL;
+static btstack_packet_handler_t att_handler = NULL;
+static att_write_callback_t write_callback = NULL;
+static sim_ble_receive_cb_t receiver = NULL;
+
+static hci_con_handle_t link_handle(uint8_t link) { return SIM_LINK_HANDLE_BASE + link; }
+
+static sim_link_t *link_for_handle(hci_con_handle_t handle) {
+    uint16_t index = handle - SIM_LINK_HANDLE_BASE;
+    if (index >= SIM_BLE_MAX_LINKS || !links[index].connected)
+        return NULL;
+    return &links[index];
+}
+
+static int free_buffers(void) {
+    int used = 0;
+    for (uint8_t i = 0; i < SIM_BLE_MAX_LINKS; i++)
+        used += links[i].count;
+    return SIM_ACL_BUFFERS - used;
+}
+
+static void emit(btstack_packet_handler_t handler, uint8_t *event, uint16_t size) {
+    if (handler != NULL)
+        handler(HCI_EVENT_PACKET, 0, event, size);
+}
+
+// Buffers came back: answer the can-send-now requests that can be served now.
+static void emit_can_send_now(void) {
+    for (uint8_t i = 0; i < SIM_BLE_MAX_LINKS && free_buffers() > 0; i++) {
+        if (!links[i].connected || !links[i].can_send_requested)
+            continue;
+        links[i].can_send_requested = false;
+        uint8_t event[4] = {ATT_EVENT_CAN_SEND_NOW, 2};
+        little_endian_store_16(event, 2, link_handle(i));
+        emit(att_handler, event, sizeof(event));
+    }
+}
+
+// One connection event: deliver what the link holds, then report it completed.
+static void link_event(btstack_timer_source_t *ts) {
+    uint8_t index = (uint8_t)(uintptr_t)btstack_run_loop_get_timer_context(ts);
+    sim_link_t *link = &links[index];
+    if (!link->connected)
+        return;
+    uint16_t completed = 0;
+    while (!link->stalled && link->count > 0 && completed < SIM_LINK_PACKETS_PER_EVENT) {
+        sim_notification_t *notification = &link->in_flight[link->head];
+        if (receiver != NULL)
+            receiver(index, notification->data, notification->length, time_us_64());
+        link->head = (link->head + 1) % SIM_ACL_BUFFERS;
+        link->count--;
+        completed++;
+    }
+    if (completed > 0) {
+        uint8_t event[7] = {HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS, 5, 1};
+        little_endian_store_16(event, 3, link_handle(index));
+        little_endian_store_16(event, 5, completed);
+        emit(hci_handler, event, sizeof(event));
+        emit_can_send_now();
+    }
+    ts->due_us = time_us_64() + SIM_LINK_INTERVAL_US;
+    btstack_run_loop_add_timer(ts);
+}
+
+void sim_ble_set_receiver(sim_ble_receive_cb_t callback) { receiver = callback; }
+
+void sim_ble_connect(uint8_t index) {
+    sim_link_t *link = &links[index];
+    *link = (sim_link_t){.connected = true};
+    uint8_t event[21] = {HCI_EVENT_LE_META, 19, HCI_SUBEVENT_LE_CONNECTION_COMPLETE,
+                         ERROR_CODE_SUCCESS};
+    little_endian_store_16(event, 4, link_handle(index));
+    little_endian_store_16(event, 14, SIM_LINK_INTERVAL_US / 1250);
+    emit(hci_handler, event, sizeof(event));
+
+    btstack_run_loop_set_timer_handler(&link->event_timer, link_event);
+    btstack_run_loop_set_timer_context(&link->event_timer, (void *)(uintptr_t)index);
+    link->event_timer.due_us = time_us_64() + SIM_LINK_INTERVAL_US;
+    btstack_run_loop_add_timer(&link->event_timer);
+}
+
+// The link goes away with whatever it still held; its buffers return to the pool.
+void sim_ble_disconnect(uint8_t index) {
+    sim_link_t *link = &links[index];
+    if (!link->connected)
+        return;
+    btstack_run_loop_remove_timer(&link->event_timer);
+    link->connected = false;
+    link->count = 0;
+    uint8_t event[6] = {HCI_EVENT_DISCONNECTION_COMPLETE, 4, ERROR_CODE_SUCCESS};
+    little_endian_store_16(event, 3, link_handle(index));
+    emit(hci_handler, event, sizeof(event));
+    emit_can_send_now();
+}
+
+void sim_ble_stall(uint8_t index, bool stalled) { links[index].stalled = stalled; }
+
+uint8_t sim_ble_max_in_flight(uint8_t index) { return links[index].max_count; }
+
+// A central writes `data` to the MIDI characteristic over link `index`.
+void sim_ble_write(uint8_t index, const uint8_t *data, uint16_t length) {
+    uint8_t buffer[SIM_LINK_MTU];
+    if (write_callback == NULL || length > sizeof(buffer))
+        return;
+    memcpy(buffer, data, length);
+    write_callback(link_handle(index), MIDI_CHARACTERISTIC_HANDLE, 0, 0, buffer, length);
+}
+
+// BTstack host API.
+
+void hci_add_event_handler(btstack_packet_callback_registration_t *callback_handler) {
+    hci_handler = callback_handler->callback;
+}
+
+void hci_power_control(int power_mode) {
+    (void)power_mode;
+    uint8_t event[3] = {BTSTACK_EVENT_STATE, 1, HCI_STATE_WORKING};
+    emit(hci_handler, event, sizeof(event));
+}
+
+int hci_number_free_acl_slots_for_handle(hci_con_handle_t con_handle) {
+    return link_for_handle(con_handle) != NULL ? free_buffers() : 0;
+}
+
+void l2cap_init(void) {}
+
+void sm_init(void) {}
+
+// No pairing in the simulation, so the security manager never reports anything.
+void sm_add_event_handler(btstack_packet_callback_registration_t *callback_handler) {
+    (void)callback_handler;
+}
+
+void att_server_init(const uint8_t *db, att_read_callback_t read_callback,
+                     att_write_callback_t callback) {
+    (void)db;
+    (void)read_callback;
+    write_callback = callback;
+}
+
+void att_server_register_packet_handler(btstack_packet_handler_t handler) { att_handler = handler; }
+
+uint16_t att_server_get_mtu(hci_con_handle_t con_handle) {
+    return link_for_handle(con_handle) != NULL ? SIM_LINK_MTU : 0;
+}
+
+int att_server_can_send_packet_now(hci_con_handle_t con_handle) {
+    return link_for_handle(con_handle) != NULL && free_buffers() > 0;
+}
+
+int att_server_request_can_send_now_event(hci_con_handle_t con_handle) {
+    sim_link_t *link = link_for_handle(con_handle);
+    if (link != NULL)
+        link->can_send_requested = true;
+    return ERROR_CODE_SUCCESS;
+}
+
+int att_server_notify(hci_con_handle_t con_handle, uint16_t attribute_handle,
+                      const uint8_t *value, uint16_t value_len) {
+    (void)attribute_handle;
+    sim_link_t *link = link_for_handle(con_handle);
+    if (link == NULL || free_buffers() == 0 || value_len > SIM_LINK_MTU - 3)
+        return BTSTACK_ACL_BUFFERS_FULL;
+    uint8_t slot = (link->head + link->count) % SIM_ACL_BUFFERS;
+    sim_notification_t *notification = &link->in_flight[slot];
+    memcpy(notification->data, value, value_len);
+    notification->length = value_len;
+    link->count++;
+    if (link->count > link->max_count)
+        link->max_count = link->count;
+    return ERROR_CODE_SUCCESS;
+}
+
+uint16_t att_read_callback_handle_blob(const uint8_t *blob, uint16_t blob_size, uint16_t offset,
+                                       uint8_t *buffer, uint16_t buffer_size) {
+    (void)blob;
+    (void)offset;
+    (void)buffer;
+    (void)buffer_size;
+    return blob_size;
+}
+
+void gap_advertisements_set_params(uint16_t adv_int_min, uint16_t adv_int_max, uint8_t adv_type,
+                                   uint8_t direct_address_typ, bd_addr_t direct_address,
+                                   uint8_t channel_map, uint8_t filter_policy) {
+    (void)adv_int_min;
+    (void)adv_int_max;
+    (void)adv_type;
+    (void)direct_address_typ;
+    (void)direct_address;
+    (void)channel_map;
+    (void)filter_policy;
+}
+
+void gap_advertisements_set_data(uint8_t advertising_data_length, uint8_t *advertising_data) {
+    (void)advertising_data_length;
+    (void)advertising_data;
+}
+
+void gap_advertisements_enable(int enabled) { (void)enabled; }
+
+void gap_local_bd_addr(bd_addr_t address_buffer) { memset(address_buffer, 0, sizeof(bd_addr_t)); }
+
+int gap_request_connection_parameter_update(hci_con_handle_t con_handle, uint16_t conn_interval_min,
+                                            uint16_t conn_interval_max, uint16_t conn_latency,
+                                            uint16_t supervision_timeout) {
+    (void)con_handle;
+    (void)conn_interval_min;
+    (void)conn_interval_max;
+    (void)conn_latency;
+    (void)supervision_timeout;
+    return ERROR_CODE_SUCCESS;
+}
+
+int gap_le_set_phy(hci_con_handle_t con_handle, uint8_t all_phys, uint8_t tx_phys,
+                   uint8_t rx_phys, uint16_t phy_options) {
+    (void)con_handle;
+    (void)all_phys;
+    (void)tx_phys;
+    (void)rx_phys;
+    (void)phy_options;
+    return ERROR_CODE_SUCCESS;
+}
+
+const char *bd_addr_to_str(const bd_addr_t addr) {
+    (void)addr;
+    return "00:00:00:00:00:00";
+}
+
+int le_device_db_max_count(void) { return 0; }
+
+void le_device_db_info(int index, int *addr_type, bd_addr_t addr, sm_key_t irk) {
+    (void)index;
+    (void)addr;
+    (void)irk;
+    *addr_type = BD_ADDR_TYPE_UNKNOWN;
+}
@@ -0,0 +1,237 @@
+/*
+ * sim_drivers.c
+ *
+ * Host simulation drivers behind the same interfaces as drivers/: BLE-MIDI
+ * hands every flushed message to the harness's output sink, inbound MIDI,
+ * button events and console keys come from queues the harness fills, the
+ * display draws nothing and flash is a RAM slot.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <string.h>
+
+#include "drivers/ble_midi.h"
+#include "drivers/button.h"
+#include "drivers/console.h"
+#include "drivers/display.h"
+#include "drivers/flash_store.h"
+#include "pico/time.h"
+#include "sim.h"
+
+// BLE-MIDI: one packet per flush, like the device; no radio, so nothing is ever dropped.
+
+#define SIM_PACKET_MAX 256
+
+typedef struct {
+    uint64_t time_us;
+    uint8_t status;
+    uint8_t data1;
+    uint8_t data2;
+} sim_message_t;
+
+static sim_message_t packet[SIM_PACKET_MAX];
+static uint16_t packet_length = 0;
+static sim_output_cb_t output = NULL;
+static bool connected = true;
+static void (*step_handler)(btstack_timer_source_t *ts) = NULL;
+static btstack_timer_source_t step_timer;
+static ble_midi_receive_cb_t receive_handler = NULL;
+static ble_midi_stats_t stats = {0};
+static ble_midi_boot_t boot_times = {0};
+
+static void packet_append(uint64_t time_us, uint8_t status, uint8_t data1, uint8_t data2) {
+    if (!connected)
+        return;
+    if (packet_length == SIM_PACKET_MAX) {
+        stats.dropped_full++;
+        return;
+    }
+    packet[packet_length++] = (sim_message_t){time_us, status, data1, data2};
+}
+
+void ble_midi_init(void (*step_cb)(btstack_timer_source_t *ts)) { step_handler = step_cb; }
+
+void ble_midi_start_step_timer(uint32_t step_period_ms) {
+    btstack_run_loop_set_timer_handler(&step_timer, step_handler);
+    btstack_run_loop_set_timer(&step_timer, step_period_ms);
+    btstack_run_loop_add_timer(&step_timer);
+}
+
+bool ble_midi_is_connected(void) { return connected; }
+
+uint8_t ble_midi_connection_count(void) { return connected ? 1 : 0; }
+
+uint32_t ble_midi_get_wake_latency_us(void) { return 0; }
+
+uint32_t ble_midi_get_wake_count(void) { return 0; }
+
+const ble_midi_boot_t *ble_midi_get_boot_times(void) { return &boot_times; }
+
+const ble_midi_stats_t *ble_midi_get_stats(void) { return &stats; }
+
+void ble_midi_set_loopback(bool enable) { (void)enable; }
+
+void ble_midi_set_receive_handler(ble_midi_receive_cb_t handler) { receive_handler = handler; }
+
+void ble_midi_send_note(uint8_t channel, uint8_t note, uint8_t velocity) {
+    ble_midi_queue_note(time_us_64(), channel, note, velocity);
+    ble_midi_flush();
+}
+
+void ble_midi_queue_note(uint64_t time_us, uint8_t channel, uint8_t note, uint8_t velocity) {
+    packet_append(time_us, 0x90 | (channel & 0x0F), note, velocity);
+}
+
+void ble_midi_queue_realtime(uint64_t time_us, uint8_t status) {
+    packet_append(time_us, status, 0, 0);
+}
+
+void ble_midi_flush(void) {
+    if (packet_length == 0)
+        return;
+    uint64_t sent_us = time_us_64();
+    for (uint16_t i = 0; i < packet_length && output != NULL; i++)
+        output(packet[i].time_us, packet[i].status, packet[i].data1, packet[i].data2, sent_us);
+    packet_length = 0;
+    stats.packets_sent++;
+}
+
+void sim_set_output(sim_output_cb_t sink) { output = sink; }
+
+/*
+ * A disconnect parks the step clock in the looper's next step; a connect
+ * restarts it at once, as the BLE driver does.
+ */
+void sim_set_connected(bool state) {
+    bool resume = state && !connected;
+    connected = state;
+    packet_length = 0;
+    if (resume && step_handler != NULL) {
+        btstack_run_loop_set_timer(&step_timer, 0);
+        btstack_run_loop_add_timer(&step_timer);
+    }
+}
+
+void sim_midi_in(uint64_t time_us, uint8_t status, uint8_t data1, uint8_t data2) {
+    if (receive_handler != NULL)
+        receive_handler(time_us, status, data1, data2);
+}
+
+// Button: events are replayed as if the FSM in drivers/button.c had produced them.
+
+#define SIM_QUEUE_LEN 64
+
+typedef struct {
+    button_event_t event;
+    uint64_t press_us;
+    uint64_t duration_us;
+} sim_button_t;
+
+static sim_button_t buttons[SIM_QUEUE_LEN];
+static uint8_t button_head = 0;
+static uint8_t button_count = 0;
+static sim_button_t button_last = {BUTTON_EVENT_NONE, 0, 0};
+static void (*button_edge)(void) = NULL;
+
+void button_init(void) {}
+
+void button_set_edge_callback(void (*callback)(void)) { button_edge = callback; }
+
+button_event_t button_poll_event(void) {
+    if (button_count == 0)
+        return BUTTON_EVENT_NONE;
+    button_last = buttons[button_head];
+    button_head = (button_head + 1) % SIM_QUEUE_LEN;
+    button_count--;
+    return button_last.event;
+}
+
+uint32_t button_poll_delay_us(void) { return UINT32_MAX; }  // Pushes wake the service
+
+uint64_t button_get_press_time_us(void) { return button_last.press_us; }
+
+uint64_t button_get_press_duration_us(void) { return button_last.duration_us; }
+
+void sim_button_push(button_event_t event, uint64_t press_us, uint64_t duration_us) {
+    if (button_count == SIM_QUEUE_LEN)
+        return;
+    buttons[(button_head + button_count) % SIM_QUEUE_LEN] =
+        (sim_button_t){event, press_us, duration_us};
+    button_count++;
+    if (button_edge != NULL)
+        button_edge();
+}
+
+// Console
+
+static int keys[SIM_QUEUE_LEN];
+static uint8_t key_head = 0;
+static uint8_t key_count = 0;
+static void (*key_callback)(void) = NULL;
+
+void console_set_key_callback(void (*callback)(void)) { key_callback = callback; }
+
+int console_poll_key(void) {
+    if (key_count == 0)
+        return CONSOLE_NO_KEY;
+    int key = keys[key_head];
+    key_head = (key_head + 1) % SIM_QUEUE_LEN;
+    key_count--;
+    return key;
+}
+
+void sim_console_push(int key) {
+    if (key_count == SIM_QUEUE_LEN)
+        return;
+    keys[(key_head + key_count) % SIM_QUEUE_LEN] = key;
+    key_count++;
+    if (key_callback != NULL)
+        key_callback();
+}
+
+// Display: nothing to draw; the harness reads the looper state directly.
+
+void display_update_looper_status(bool ble_connected, const looper_status_t *looper,
+                                  const track_t *tracks, size_t num_tracks) {
+    (void)ble_connected;
+    (void)looper;
+    (void)tracks;
+    (void)num_tracks;
+}
+
+bool display_show_report(const char *text) {
+    (void)text;
+    return true;
+}
+
+bool display_flush(void) { return false; }
+
+// Flash: one slot in RAM; saves complete at once.
+
+static uint8_t flash_slot[FLASH_STORE_CAPACITY];
+static size_t flash_size = 0;
+static uint16_t flash_version = 0;
+
+void flash_store_init(void) {}
+
+bool flash_store_load(void *data, size_t size, uint16_t version) {
+    if (flash_size != size || flash_version != version)
+        return false;
+    memcpy(data, flash_slot, size);
+    return true;
+}
+
+bool flash_store_save(const void *data, size_t size, uint16_t version) {
+    if (size > sizeof(flash_slot))
+        return false;
+    memcpy(flash_slot, data, size);
+    flash_size = size;
+    flash_version = version;
+    return true;
+}
+
+bool flash_store_busy(void) { return false; }
+
+void flash_store_task(uint32_t window_us) { (void)window_us; }
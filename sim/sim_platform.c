@@ -0,0 +1,114 @@
+/*
+ * sim_platform.c
+ *
+ * Host simulation platform: a virtual µs clock and a single-threaded BTstack
+ * run loop on top of it. Nothing waits in host time: a busy wait or sleep
+ * moves the clock to its target, and sim_run_until() jumps from one timer to
+ * the next, so thousands of bars run per second.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stddef.h>
+
+#include "btstack.h"
+#include "pico/cyw43_arch.h"
+#include "sim.h"
+
+static uint64_t now_us = 0;
+static btstack_timer_source_t *timers = NULL;  // Sorted by due time
+static btstack_data_source_t *data_source = NULL;
+static bool poll_pending = false;
+static bool led_on = false;
+static uint32_t led_changes = 0;
+
+uint64_t time_us_64(void) { return now_us; }
+
+void busy_wait_until(absolute_time_t target) {
+    if (target > now_us)
+        now_us = target;
+}
+
+void sleep_until(absolute_time_t target) { busy_wait_until(target); }
+
+void sleep_us(uint64_t us) { now_us += us; }
+
+void sim_set_time_us(uint64_t time_us) { now_us = time_us; }
+
+void cyw43_arch_gpio_put(unsigned int pin, bool value) {
+    (void)pin;
+    if (value != led_on)
+        led_changes++;
+    led_on = value;
+}
+
+uint32_t sim_led_changes(void) { return led_changes; }
+
+// Like BTstack's embedded run loop: due at the ms tick `timeout_ms` from now.
+void btstack_run_loop_set_timer(btstack_timer_source_t *ts, uint32_t timeout_ms) {
+    ts->due_us = (now_us / 1000 + timeout_ms) * 1000;
+}
+
+void btstack_run_loop_set_timer_handler(btstack_timer_source_t *ts,
+                                        void (*process)(btstack_timer_source_t *ts)) {
+    ts->process = process;
+}
+
+void btstack_run_loop_set_timer_context(btstack_timer_source_t *ts, void *context) {
+    ts->context = context;
+}
+
+void *btstack_run_loop_get_timer_context(btstack_timer_source_t *ts) { return ts->context; }
+
+int btstack_run_loop_remove_timer(btstack_timer_source_t *ts) {
+    for (btstack_timer_source_t **link = &timers; *link != NULL; link = &(*link)->next) {
+        if (*link == ts) {
+            *link = ts->next;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void btstack_run_loop_add_timer(btstack_timer_source_t *ts) {
+    btstack_run_loop_remove_timer(ts);
+    btstack_timer_source_t **link = &timers;
+    while (*link != NULL && (*link)->due_us <= ts->due_us)
+        link = &(*link)->next;
+    ts->next = *link;
+    *link = ts;
+}
+
+void btstack_run_loop_set_data_source_handler(
+    btstack_data_source_t *ds,
+    void (*process)(btstack_data_source_t *ds, btstack_data_source_callback_type_t callback_type)) {
+    ds->process = process;
+}
+
+void btstack_run_loop_enable_data_source_callbacks(btstack_data_source_t *ds, uint16_t callbacks) {
+    ds->flags |= callbacks;
+}
+
+// The looper service is the only data source.
+void btstack_run_loop_add_data_source(btstack_data_source_t *ds) { data_source = ds; }
+
+void btstack_run_loop_poll_data_sources_from_irq(void) { poll_pending = true; }
+
+// Run every timer due by `end_us` in order, and the polled data source after each.
+void sim_run_until(uint64_t end_us) {
+    while (true) {
+        if (poll_pending && data_source != NULL) {
+            poll_pending = false;
+            data_source->process(data_source, DATA_SOURCE_CALLBACK_POLL);
+            continue;
+        }
+        btstack_timer_source_t *ts = timers;
+        if (ts == NULL || ts->due_us > end_us)
+            break;
+        timers = ts->next;
+        busy_wait_until(ts->due_us);
+        ts->process(ts);
+    }
+    busy_wait_until(end_us);
+}
@@ -0,0 +1,50 @@
+/*
+ * boot_trace.c
+ *
+ * Timing markers of the boot path. main() marks each stage as it completes
+ * and the BLE-MIDI driver records when the radio came up, the first central
+ * connected and the first note went out. The timing report prints them all
+ * in ms since power-on, so it shows where boot-to-first-note time goes even
+ * though nothing is listening on stdio that early.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdio.h>
+
+#include "pico/time.h"
+
+#include "boot_trace.h"
+#include "drivers/ble_midi.h"
+
+static uint32_t marks[BOOT_MARK_COUNT];
+
+static const char *const mark_names[BOOT_MARK_COUNT] = {
+    "stdio", "cyw43", "radio", "restore", "run",
+};
+
+void boot_trace_mark(boot_mark_t mark) { marks[mark] = (uint32_t)time_us_64(); }
+
+static size_t format_mark(char *buffer, size_t size, const char *name, uint32_t us) {
+    if (us == 0)
+        return snprintf(buffer, size, "  %s -", name);
+    return snprintf(buffer, size, "  %s %lu.%lu", name, (unsigned long)(us / 1000),
+                    (unsigned long)(us % 1000) / 100);
+}
+
+// Format the markers as one line, in ms since power-on; "-" marks a stage not reached yet.
+size_t boot_trace_format(char *buffer, size_t size) {
+    const ble_midi_boot_t *ble = ble_midi_get_boot_times();
+    const char *names[] = {"hci", "connect", "note"};
+    const uint32_t times[] = {ble->radio_ready_us, ble->connected_us, ble->first_note_us};
+
+    size_t len = snprintf(buffer, size, "boot ms:");
+    for (int i = 0; i < BOOT_MARK_COUNT && len < size; i++)
+        len += format_mark(buffer + len, size - len, mark_names[i], marks[i]);
+    for (size_t i = 0; i < sizeof(times) / sizeof(times[0]) && len < size; i++)
+        len += format_mark(buffer + len, size - len, names[i], times[i]);
+    if (len < size)
+        len += snprintf(buffer + len, size - len, "\n");
+    return (len < size) ? len : size - 1;
+}
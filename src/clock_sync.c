@@ -0,0 +1,118 @@
+/*
+ * clock_sync.c
+ *
+ * Follows an external MIDI Timing Clock (24 PPQN). Clock bytes arrive over
+ * BLE in bursts, one connection interval apart, so single tick intervals
+ * can be off by several ms. A second-order software PLL turns the arrival
+ * times into a smooth tick period and phase: each tick's error against the
+ * prediction moves the phase by 1/8 and the period by 1/64 of the error.
+ * That settles within a few beats and leaves connection-interval jitter in
+ * the µs range. Integer-only, in the fixed-point time of timing.h.
+ *
+ * Messages are handled on core 0 (BTstack context). The filtered state is
+ * published under a sequence counter so the step clock can read a
+ * consistent copy from either core without locking.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "hardware/sync.h"
+#include "pico/stdlib.h"
+
+#include "clock_sync.h"
+
+#define CLOCK_SYNC_PHASE_SHIFT 3   // Phase gain 1/8
+#define CLOCK_SYNC_PERIOD_SHIFT 6  // Period gain 1/64
+
+static clock_sync_state_t state = {0};
+static volatile uint32_t sequence = 0;  // Odd while `state` is being written
+static volatile uint64_t last_tick_us = 0;
+static uint8_t acquired = 0;  // Ticks seen since the estimate was (re)started
+
+static void publish_begin(void) {
+    sequence++;
+    __dmb();
+}
+
+static void publish_end(void) {
+    __dmb();
+    sequence++;
+}
+
+// Advance the PLL by one tick that arrived at `time_us`.
+static void handle_tick(uint64_t time_us) {
+    timing_fx_t arrival = timing_from_us(time_us);
+    if (acquired < CLOCK_SYNC_ACQUIRE_TICKS) {
+        if (acquired > 0)
+            state.tick_period = arrival - state.tick_time;
+        state.tick_time = arrival;
+        acquired++;
+        return;
+    }
+    timing_fx_t predicted = state.tick_time + state.tick_period;
+    int64_t error = (int64_t)(arrival - predicted);
+    int64_t limit = (int64_t)(state.tick_period / 2);
+    if (error > limit || error < -limit) {
+        // Lost ticks or a tempo jump: start a new estimate from this tick
+        state.tick_time = arrival;
+        acquired = 1;
+        return;
+    }
+    state.tick_time = predicted + (error >> CLOCK_SYNC_PHASE_SHIFT);
+    state.tick_period += error >> CLOCK_SYNC_PERIOD_SHIFT;
+}
+
+/*
+ * Feed one System Real-Time message received at `time_us`. Start counts
+ * ticks from zero again, Continue resumes the count, Stop halts it; the PLL
+ * keeps tracking clocks in every case, as hosts often send them while
+ * stopped.
+ */
+void clock_sync_handle_message(uint64_t time_us, uint8_t status) {
+    publish_begin();
+    switch (status) {
+        case MIDI_TIMING_CLOCK:
+            if (time_us - last_tick_us > CLOCK_SYNC_TIMEOUT_US)
+                acquired = 0;
+            handle_tick(time_us);
+            last_tick_us = time_us;
+            if (state.running)
+                state.tick_index++;  // The song position only moves while running
+            break;
+        case MIDI_START:
+            state.tick_index = -1;  // The next tick is the downbeat
+            state.start_count++;
+            state.running = true;
+            break;
+        case MIDI_CONTINUE:
+            state.running = true;
+            break;
+        case MIDI_STOP:
+            state.running = false;
+            break;
+        default:
+            break;
+    }
+    publish_end();
+}
+
+/*
+ * Copy the filtered clock into `out`. Returns false, leaving `out` unusable,
+ * while no clock is locked: too few ticks so far, or none for
+ * CLOCK_SYNC_TIMEOUT_US.
+ */
+bool clock_sync_get(clock_sync_state_t *out) {
+    uint32_t begin;
+    uint8_t ready;
+    uint64_t tick_us;
+    do {
+        begin = sequence;
+        __dmb();
+        *out = state;
+        ready = acquired;
+        tick_us = last_tick_us;
+        __dmb();
+    } while ((begin & 1u) || begin != sequence);
+    return ready >= CLOCK_SYNC_ACQUIRE_TICKS && time_us_64() - tick_us <= CLOCK_SYNC_TIMEOUT_US;
+}
@@ -0,0 +1,46 @@
+/*
+ * command_queue.c
+ *
+ * Lock-free single-producer/single-consumer queue that carries edits from the
+ * input path (button, console, MIDI input, all in BTstack context on core 0)
+ * to the sequencer, which applies them at step boundaries. The tick path
+ * therefore owns the patterns and the looper state outright: it never takes
+ * a lock and never sees an edit half done, on either core.
+ * The producer never blocks: a full queue drops the command.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "hardware/sync.h"
+
+#include "command_queue.h"
+
+#define COMMAND_QUEUE_MASK (COMMAND_QUEUE_SIZE - 1)
+
+static command_t commands[COMMAND_QUEUE_SIZE];
+static volatile uint32_t head = 0;  // written by the producer only
+static volatile uint32_t tail = 0;  // written by the consumer only
+
+// Producer side. Returns false and drops the command if the queue is full.
+bool command_queue_push(const command_t *command) {
+    uint32_t h = head;
+    if (h - tail >= COMMAND_QUEUE_SIZE)
+        return false;
+    commands[h & COMMAND_QUEUE_MASK] = *command;
+    __dmb();  // publish the payload before the index
+    head = h + 1;
+    return true;
+}
+
+// Consumer side. Returns false when the queue is empty.
+bool command_queue_pop(command_t *command) {
+    uint32_t t = tail;
+    if (t == head)
+        return false;
+    __dmb();  // read the payload after observing the index
+    *command = commands[t & COMMAND_QUEUE_MASK];
+    __dmb();
+    tail = t + 1;
+    return true;
+}
@@ -0,0 +1,41 @@
+/*
+ * groove.c
+ *
+ * Groove templates. Template 0 is straight and is what every track plays
+ * until another one is picked; the others shift 16th positions off the grid
+ * or shape their dynamics. The looper compiles a track's template into its
+ * playback schedule, so none of this is read on the tick path.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "groove.h"
+
+static const groove_t grooves[] = {
+    {"straight", {0}, {0}},
+    // Off-beats rush ahead of the beat
+    {"push",
+     {0, -4, -6, -4, 0, -4, -6, -4, 0, -4, -6, -4, 0, -4, -6, -4},
+     {0}},
+    // Backbeats and off-beats sit behind the beat
+    {"lazy",
+     {0, 6, 4, 6, 12, 6, 4, 6, 0, 6, 4, 6, 12, 6, 4, 6},
+     {0}},
+    // Beats accented, odd 16ths played softer
+    {"accent",
+     {0},
+     {16, -16, 0, -16, 16, -16, 0, -16, 16, -16, 0, -16, 16, -16, 0, -16}},
+    // A fixed, small spread of timing and dynamics, like a player's hand
+    {"human",
+     {0, 3, -2, 5, -1, 4, 2, -3, 1, 5, -2, 3, -4, 2, 1, -5},
+     {0, -8, 4, -12, 6, -6, -2, -10, 8, -4, 2, -12, 4, -8, 0, -6}},
+};
+
+// Number of templates; index 0 is straight.
+uint8_t groove_count(void) { return sizeof(grooves) / sizeof(grooves[0]); }
+
+// Template `index`, or the straight one if `index` is out of range.
+const groove_t *groove_get(uint8_t index) {
+    return &grooves[index < groove_count() ? index : 0];
+}
@@ -1,28 +1,44 @@
 /*
  * looper.c
  *
- * Core looper module: Implements a 2-bar step sequencer driven by timer ticks
- * and button input. Exposes functions for processing sequencer steps,
+ * Core looper module: Implements a step sequencer, 2 bars of 16ths by default,
+ * driven by timer ticks and button input. Exposes functions for processing sequencer steps,
  * handling timer ticks, and handling user input events.
  *
  * Copyright 2025, Hiroyuki OYAMA
  *
  * SPDX-License-Identifier: BSD-3-Clause
  */
-#include <math.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "pico/cyw43_arch.h"
+#if LOOPER_DUAL_CORE
+#include "hardware/sync.h"
+#include "pico/flash.h"
+#include "pico/multicore.h"
+#endif
 
+#include "boot_trace.h"
+#include "clock_sync.h"
+#include "command_queue.h"
 #include "drivers/ble_midi.h"
 #include "drivers/button.h"
+#include "drivers/console.h"
 #include "drivers/display.h"
+#include "drivers/flash_store.h"
+#include "groove.h"
 #include "looper.h"
+#include "note_queue.h"
+#include "pattern_history.h"
 #include "tap_tempo.h"
+#include "tick_stats.h"
+#include "timing.h"
 
 enum {
     MIDI_CHANNEL_1 = 0,
     MIDI_CHANNEL_10 = 9,
+    MIDI_CHANNEL_16 = 15,
 };
 
 enum {
@@ -31,21 +47,258 @@ enum {
     SNARE_DRUM = 38,
     HAND_CLAP = 39,
     CLOSED_HIHAT = 42,
+    PEDAL_HIHAT = 44,
+    LOW_TOM = 45,
     OPEN_HIHAT = 46,
+    MID_TOM = 47,
     CYMBAL = 49,
+    HIGH_TOM = 50,
+    RIDE_CYMBAL = 51,
+    TAMBOURINE = 54,
+    COWBELL = 56,
+    LOW_CONGA = 64,
+    CLAVES = 75,
 };
 
-static looper_status_t looper_status = {.bpm = LOOPER_DEFAULT_BPM, .state = LOOPER_STATE_WAITING};
+static looper_status_t looper_status = {
+    .bpm = LOOPER_DEFAULT_BPM,
+    .state = LOOPER_STATE_WAITING,
+    .num_tracks = LOOPER_DEFAULT_TRACKS,
+    .bars = LOOPER_DEFAULT_BARS,
+    .steps_per_beat = LOOPER_DEFAULT_STEPS_PER_BEAT,
+    .total_steps = LOOPER_DEFAULT_BARS * LOOPER_BEATS_PER_BAR * LOOPER_DEFAULT_STEPS_PER_BEAT,
+    .quantize = LOOPER_DEFAULT_QUANTIZE,
+    .swing = LOOPER_DEFAULT_SWING,
+};
+
+/*
+ * Track presets: every slot is preset; `looper_status.num_tracks` selects how many play.
+ * Each starts with the global swing, no groove, and hits that always play once.
+ */
+#define TRACK_PRESET(name, note)                                        \
+    {name, note, MIDI_CHANNEL_10, LOOPER_DEFAULT_GATE, {{0}}, {0}, {{0}}, \
+     LOOPER_TRACK_SWING_GLOBAL, 0, {{0}}, {{0}}}
 
-static track_t tracks[] = {
-    {"Bass", BASS_DRUM, MIDI_CHANNEL_10, {0}, {0}},
-    {"Snare", SNARE_DRUM, MIDI_CHANNEL_10, {0}, {0}},
-    {"Hi-hat", CLOSED_HIHAT, MIDI_CHANNEL_10, {0}, {0}},
-    {"Open Hi-hat", OPEN_HIHAT, MIDI_CHANNEL_10, {0}, {0}},
+static const track_t track_presets[LOOPER_MAX_TRACKS] = {
+    TRACK_PRESET("Bass", BASS_DRUM),
+    TRACK_PRESET("Snare", SNARE_DRUM),
+    TRACK_PRESET("Hi-hat", CLOSED_HIHAT),
+    TRACK_PRESET("Open Hi-hat", OPEN_HIHAT),
+    TRACK_PRESET("Cymbal", CYMBAL),
+    TRACK_PRESET("Ride", RIDE_CYMBAL),
+    TRACK_PRESET("Low Tom", LOW_TOM),
+    TRACK_PRESET("Mid Tom", MID_TOM),
+    TRACK_PRESET("High Tom", HIGH_TOM),
+    TRACK_PRESET("Rim Shot", RIM_SHOT),
+    TRACK_PRESET("Hand Clap", HAND_CLAP),
+    TRACK_PRESET("Pedal Hat", PEDAL_HIHAT),
+    TRACK_PRESET("Tambourine", TAMBOURINE),
+    TRACK_PRESET("Cowbell", COWBELL),
+    TRACK_PRESET("Low Conga", LOW_CONGA),
+    TRACK_PRESET("Claves", CLAVES),
 };
-static const size_t NUM_TRACKS = sizeof(tracks) / sizeof(track_t);
+_Static_assert(LOOPER_MAX_TRACKS <= 16, "step table holds one bit per track in 16 bits");
+_Static_assert(LOOPER_MAX_STEPS <= UINT16_MAX, "step indices are 16-bit");
+
+/*
+ * Playback schedule of a pattern, compiled from its hits and the feel
+ * settings: quantize, the global and per-track swing and each track's groove
+ * template. It is recompiled per hit when a hit is recorded or restored, and
+ * per pattern only when a setting changes, so the tick never evaluates any
+ * of it; it reads each hit's fire offset and velocity from here. Bit `i` of
+ * early[s] is set when the hit of track `i` on step `s` fires before the
+ * step, i.e. from the previous step's tick. Only meaningful under a set bit
+ * of the step table.
+ */
+typedef struct {
+    uint16_t early[LOOPER_MAX_STEPS];
+    int8_t offset[LOOPER_MAX_TRACKS][LOOPER_MAX_STEPS];     // 1/LOOPER_OFFSET_UNITS of a step
+    uint8_t velocity[LOOPER_MAX_TRACKS][LOOPER_MAX_STEPS];  // MIDI velocity
+} looper_schedule_t;
+
+/*
+ * Pattern bank: LOOPER_BANK_PATTERNS complete patterns in one static arena.
+ * Each holds the tracks, a step-major view of them and their schedule: bit
+ * `i` of step_tracks[s] is set when track `i` plays on step `s`. The view is
+ * kept in sync on every record/clear/undo so the tick only reads one word per
+ * step instead of scanning every track.
+ *
+ * `tracks` and `step_tracks` point into the playing pattern. Switching is
+ * done at a bar line by swapping these pointers, never by copying, so a live
+ * switch costs the tick nothing. A global feel change recompiles only the
+ * playing pattern's schedule; the others are marked stale and compiled when
+ * they are next played.
+ */
+typedef struct {
+    track_t tracks[LOOPER_MAX_TRACKS];
+    uint16_t step_tracks[LOOPER_MAX_STEPS];
+    looper_schedule_t schedule;
+    bool schedule_stale;  // Compiled before the last quantize or swing change
+} looper_bank_pattern_t;
+
+static looper_bank_pattern_t bank[LOOPER_BANK_PATTERNS];
+static track_t *tracks = bank[0].tracks;
+static uint16_t *step_tracks = bank[0].step_tracks;
+static uint32_t press_mark = 0;  // Undo history position when the last press began
+static uint16_t take_tracks = 0;  // Tracks already cleared for the current recording pass
+
+// The hit recorded last, which the play-chance and ratchet keys edit.
+typedef struct {
+    uint8_t pattern;
+    uint8_t track;
+    uint16_t step;  // UINT16_MAX: none since the last re-grid
+} looper_last_hit_t;
+
+static looper_last_hit_t last_hit = {0, 0, UINT16_MAX};
+
+// Early hits of the next step, played (or rolled out) by the previous step's lookahead.
+typedef struct {
+    uint8_t pattern;
+    uint16_t step;
+    uint16_t tracks;
+} looper_early_played_t;
+
+static looper_early_played_t early_played = {0, UINT16_MAX, 0};
+
+// MIDI velocity of each hit level, ghost note to accent.
+static const uint8_t level_velocity[LOOPER_LEVELS] = {40, 72, 100, 127};
+
+// Layout change requested from the input path, applied at the next bar line.
+typedef struct {
+    bool pending;
+    uint8_t num_tracks;
+    uint8_t bars;
+    uint8_t steps_per_beat;
+} looper_layout_request_t;
+
+static looper_layout_request_t layout_request = {0};
+
+/*
+ * Notes waiting for their due time: Note-Offs ending a gate (velocity 0) and
+ * Note-Ons of hits played off the grid. Every note from the step path is
+ * gated, its Note-Off due `gate` after the Note-On. Entries due within
+ * LOOPER_EVENT_MERGE_US of a step are sent in that step's packet; the others
+ * get a wake-up of their own from the step clock.
+ */
+// Offs, two steps of hits, every one ratcheted, a click and a clap
+#define LOOPER_MAX_TIMED_NOTES (3 * LOOPER_MAX_RATCHET * LOOPER_MAX_TRACKS + 2)
+_Static_assert(LOOPER_MAX_TIMED_NOTES <= UINT8_MAX, "timed notes are counted in 8 bits");
+
+typedef struct {
+    uint64_t due_us;
+    uint8_t channel;
+    uint8_t note;
+    uint8_t velocity;  // 0 = Note-Off
+    uint8_t gate;      // Gate of a pending Note-On, in 1/LOOPER_GATE_UNITS of a step
+} looper_timed_note_t;
+
+static looper_timed_note_t timed_notes[LOOPER_MAX_TIMED_NOTES];
+static uint8_t timed_note_count = 0;
+static btstack_timer_source_t timed_note_timer;  // Wakes for notes between steps
+
+static timing_fx_t offset_period;  // 1/LOOPER_OFFSET_UNITS of a step, from the step period
+static uint32_t chance_state = 0x2545f491;  // Play-chance dice, never zero
+
+/*
+ * Persisted state. Any edit marks the snapshot dirty; it is written to flash
+ * once edits have settled for LOOPER_SAVE_DELAY_US, in the gaps between steps.
+ */
+#define LOOPER_SNAPSHOT_VERSION 3
+#define LOOPER_SAVE_DELAY_US (2 * 1000 * 1000)
+
+typedef struct {
+    uint8_t gate;
+    uint8_t swing;
+    uint8_t groove;
+    looper_pattern_t pattern;
+    looper_levels_t levels;
+    looper_levels_t chance;
+    looper_levels_t ratchet;
+    int8_t offset[LOOPER_MAX_STEPS];
+} looper_track_snapshot_t;
+
+typedef struct {
+    timing_fx_t beat_period;
+    uint8_t num_tracks;
+    uint8_t bars;
+    uint8_t steps_per_beat;
+    uint8_t current_track;
+    uint8_t quantize;
+    uint8_t swing;
+    uint8_t pattern_index;
+    bool chain;
+    looper_track_snapshot_t tracks[LOOPER_BANK_PATTERNS][LOOPER_MAX_TRACKS];
+} looper_snapshot_t;
+_Static_assert(sizeof(looper_snapshot_t) <= FLASH_STORE_CAPACITY, "snapshot must fit a slot");
+
+static looper_snapshot_t snapshot;  // Static: too large for the stack
+static volatile bool snapshot_dirty = false;
+static volatile uint32_t snapshot_changed_us;  // 32-bit so it is written atomically
+
+#if LOOPER_DUAL_CORE
+/*
+ * Core 1 owns the bank, the tempo and the step deadline, so core 0 never
+ * reads them. It asks core 1 for a snapshot through the command queue and
+ * saves once `snapshot_taken` is set. Before each wait core 1 publishes when
+ * it next needs the CPU, as 32-bit µs so the write is atomic.
+ */
+static volatile bool snapshot_requested = false;
+static volatile bool snapshot_taken = false;
+static volatile uint32_t core1_wake_us = 0;
+#endif
+
+#if LOOPER_BENCH
+/*
+ * Latency benchmark. Each stage plays LOOPER_BENCH_STAGE_LOOPS one-bar loops
+ * in which every track in use hits every step, so `tracks` is the density in
+ * notes per step. A marker hit on channel 16, note = stage index, rides in the
+ * packet of each stage's first step. tools/bench_latency.py holds the same
+ * table; keep the two in step.
+ */
+#define LOOPER_BENCH_STAGE_LOOPS 8
+
+typedef struct {
+    uint16_t bpm;
+    uint8_t tracks;
+    uint8_t steps_per_beat;
+} looper_bench_stage_t;
+
+static const looper_bench_stage_t bench_stages[] = {
+    {90, 1, 4}, {120, 1, 4}, {120, 4, 4}, {120, 16, 4},
+    {180, 4, 4}, {240, 8, 4}, {300, 16, 4}, {120, 4, 8},
+};
+static uint8_t bench_next_stage = 0;
+static uint8_t bench_loops_left = 0;
+#endif
+
+static bool clock_output_started = false;  // A Start went out and no Stop since
+
+// External clock follow: the tick number of the step at `next_step_deadline`.
+static int32_t follow_tick = 0;
+static uint32_t follow_start_count = 0;
+static bool follow_running = false;
 
 static bool status_led_on = false;
+static bool status_led_shown = false;  // Last value written to the CYW43 LED
+static uint16_t displayed_step = UINT16_MAX;  // Step shown by the last display update
+
+/*
+ * Input, LED, display and storage run as a BTstack data source, woken by
+ * button edges, console input and every step, plus a timer for what has to
+ * happen in between (debounce, hold thresholds, idle blink, pending writes).
+ */
+static btstack_data_source_t service_source;
+static btstack_timer_source_t service_timer;
+#define LOOPER_SERVICE_BUSY_US 1000  // Poll interval while console or flash output is pending
+
+// Note that persisted state changed; the save waits for edits to settle.
+static void looper_mark_dirty(void) {
+    snapshot_changed_us = time_us_32();
+    snapshot_dirty = true;
+}
+
+// Wake the service from any context: IRQ, BTstack or the other core.
+static void looper_request_service(void) { btstack_run_loop_poll_data_sources_from_irq(); }
 
 /*
  * Controls the built-in LED on the Pico W.
@@ -56,9 +309,16 @@ static void looper_set_status_led(bool on) { status_led_on = on; }
 /*
  * Manages LED blinking when in WAITING state (BLE disconnected).
  * Otherwise mirrors the `status_led_on` flag during playback/recording.
+ * The CYW43 is only written when the LED actually changes.
  */
 static void looper_update_status_led(void) {
-    cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, status_led_on);
+    bool on = status_led_on;
+    if (looper_status.state == LOOPER_STATE_WAITING)
+        on = (time_us_64() / 1000) % LOOPER_IDLE_BLINK_MS < LOOPER_IDLE_BLINK_ON_MS;
+    if (on == status_led_shown)
+        return;
+    status_led_shown = on;
+    cyw43_arch_gpio_put(CYW43_WL_GPIO_LED_PIN, on);
 }
 
 // Check if the note output destination is ready.
@@ -66,71 +326,795 @@ static bool looper_perform_ready(void) {
     return ble_midi_is_connected();
 }
 
-// Send a note event to the output destination.
-static void looper_perform_note(uint8_t channel, uint8_t note, uint8_t velocity) {
-    ble_midi_send_note(channel, note, velocity);
+#if LOOPER_DUAL_CORE
+/*
+ * Note queue events one step can produce before its flush. Every Note-On of
+ * a step fits the timed-note table, and each brings at most two Note-Offs
+ * (a retrigger and a table-full fallback); add the Timing Clock ticks of a
+ * one-beat step, Start or Stop, the benchmark marker pair and the flush.
+ */
+#define LOOPER_MAX_STEP_EVENTS (3 * LOOPER_MAX_TIMED_NOTES + CLOCK_SYNC_PPQN + 4)
+_Static_assert(NOTE_QUEUE_SIZE >= LOOPER_MAX_STEP_EVENTS, "a step must fit the note queue");
+
+// Queue `event` for the BLE core; a full queue drops it, and the drop is counted.
+static void looper_push_event(const note_event_t *event) {
+    if (!note_queue_push(event))
+        tick_stats_record_dropped_event();
+}
+
+// Hand a note event, scheduled at `time_us`, to the BLE core.
+static void looper_perform_note(uint64_t time_us, uint8_t channel, uint8_t note,
+                                uint8_t velocity) {
+    note_event_t event = {time_us, NOTE_EVENT_NOTE, channel, note, velocity};
+    looper_push_event(&event);
+}
+
+// Hand a System Real-Time message, scheduled at `time_us`, to the BLE core.
+static void looper_perform_realtime(uint64_t time_us, uint8_t status) {
+    note_event_t event = {time_us, NOTE_EVENT_REALTIME, 0, status, 0};
+    looper_push_event(&event);
+}
+
+// Mark the end of the step and wake the BLE core to send it as one packet.
+static void looper_perform_flush(void) {
+    note_event_t event = {.type = NOTE_EVENT_FLUSH};
+    looper_push_event(&event);
+    note_queue_notify();
+}
+
+// Runs on core 0 in BTstack context: forward queued step events to BLE-MIDI.
+static void looper_drain_output(void) {
+    note_event_t event;
+    while (note_queue_pop(&event)) {
+        if (event.type == NOTE_EVENT_FLUSH) {
+            ble_midi_flush();
+            tick_stats_record_flush(ble_midi_get_stats()->queue_depth);
+            looper_request_service();  // A step went by: refresh LED and display
+        } else if (event.type == NOTE_EVENT_REALTIME) {
+            ble_midi_queue_realtime(event.time_us, event.note);
+        } else {
+            ble_midi_queue_note(event.time_us, event.channel, event.note, event.velocity);
+        }
+    }
+}
+#else
+// Queue a note event, scheduled at `time_us`, for the output destination.
+static void looper_perform_note(uint64_t time_us, uint8_t channel, uint8_t note,
+                                uint8_t velocity) {
+    ble_midi_queue_note(time_us, channel, note, velocity);
+}
+
+// Queue a System Real-Time message, scheduled at `time_us`, for the output destination.
+static void looper_perform_realtime(uint64_t time_us, uint8_t status) {
+    ble_midi_queue_realtime(time_us, status);
+}
+
+// Deliver every note queued since the last flush as one packet.
+static void looper_perform_flush(void) {
+    ble_midi_flush();
+    tick_stats_record_flush(ble_midi_get_stats()->queue_depth);
+}
+#endif
+
+/*
+ * Send a preview hit straight away; used from the input path on core 0.
+ * Previews live outside the step timeline, so they stay an On/Off pair.
+ */
+static void looper_preview_note(uint64_t time_us, uint8_t channel, uint8_t note,
+                                uint8_t velocity) {
+    ble_midi_queue_note(time_us, channel, note, velocity);
+    ble_midi_queue_note(time_us, channel, note, 0);
+    ble_midi_flush();
+}
+
+// Converts a gate in 1/LOOPER_GATE_UNITS of a step to µs at the current tempo.
+static uint64_t looper_gate_us(uint8_t gate) {
+    return (uint64_t)timing_ticks_us(gate, looper_status.step_period, LOOPER_GATE_UNITS);
+}
+
+// Drop `timed_notes[index]` from the table.
+static void looper_remove_timed_note(uint8_t index) {
+    timed_notes[index] = timed_notes[--timed_note_count];
+}
+
+/*
+ * With nobody connected, pending Note-Ons are dropped, but the Note-Offs of
+ * the notes already played stay in the table. They go out as soon as a
+ * central connects, so the notes the last one heard are released.
+ */
+static void looper_drop_timed_note_ons(void) {
+    for (uint8_t i = 0; i < timed_note_count;) {
+        if (timed_notes[i].velocity != 0)
+            looper_remove_timed_note(i);
+        else
+            i++;
+    }
+}
+
+/*
+ * Play a note and schedule its Note-Off `gate` later. A note that is still
+ * sounding is released first, so a retrigger is always Off then On.
+ */
+static void looper_perform_gated_note(uint64_t time_us, uint8_t channel, uint8_t note,
+                                      uint8_t velocity, uint8_t gate) {
+    for (uint8_t i = 0; i < timed_note_count; i++) {
+        looper_timed_note_t *pending = &timed_notes[i];
+        if (pending->velocity == 0 && pending->channel == channel && pending->note == note) {
+            looper_perform_note(time_us, channel, note, 0);
+            looper_remove_timed_note(i);
+            break;
+        }
+    }
+    looper_perform_note(time_us, channel, note, velocity);
+    if (timed_note_count == LOOPER_MAX_TIMED_NOTES) {
+        looper_perform_note(time_us, channel, note, 0);  // No room: degrade to a hit
+        return;
+    }
+    timed_notes[timed_note_count++] =
+        (looper_timed_note_t){time_us + looper_gate_us(gate), channel, note, 0, 0};
+}
+
+// Play a gated note at `due_us`, now if it is close enough, otherwise from the table.
+static void looper_schedule_note(uint64_t time_us, uint64_t due_us, uint8_t channel,
+                                 uint8_t note, uint8_t velocity, uint8_t gate) {
+    if (due_us <= time_us + LOOPER_EVENT_MERGE_US ||
+        timed_note_count == LOOPER_MAX_TIMED_NOTES) {
+        looper_perform_gated_note(time_us, channel, note, velocity, gate);
+        return;
+    }
+    timed_notes[timed_note_count++] =
+        (looper_timed_note_t){due_us, channel, note, velocity, gate};
+}
+
+/*
+ * Send every timed note due by `time_us` + LOOPER_EVENT_MERGE_US, all stamped
+ * at `time_us` so they share the packet's timestamp with the notes that
+ * follow. Note-Offs go first; the Note-Offs of Note-Ons played here are new
+ * entries and wait for their own due time.
+ */
+static void looper_fire_timed_notes(uint64_t time_us) {
+    uint64_t until_us = time_us + LOOPER_EVENT_MERGE_US;
+    for (uint8_t i = 0; i < timed_note_count;) {
+        looper_timed_note_t *pending = &timed_notes[i];
+        if (pending->velocity == 0 && pending->due_us <= until_us) {
+            looper_perform_note(time_us, pending->channel, pending->note, 0);
+            looper_remove_timed_note(i);
+        } else {
+            i++;
+        }
+    }
+    for (uint8_t i = 0; i < timed_note_count;) {
+        looper_timed_note_t on = timed_notes[i];
+        if (on.velocity != 0 && on.due_us <= until_us) {
+            looper_remove_timed_note(i);
+            looper_perform_gated_note(time_us, on.channel, on.note, on.velocity, on.gate);
+        } else {
+            i++;
+        }
+    }
+}
+
+/*
+ * Due time of the earliest timed note that cannot wait for the next step
+ * packet, or 0 when every pending note rides with the next step or waits
+ * for a connection.
+ */
+static uint64_t looper_next_timed_note_us(void) {
+    if (!looper_perform_ready())
+        return 0;
+    uint64_t step_us = timing_to_us(looper_status.timing.next_step_deadline);
+    uint64_t next_us = 0;
+    for (uint8_t i = 0; i < timed_note_count; i++) {
+        uint64_t due_us = timed_notes[i].due_us;
+        if (due_us + LOOPER_EVENT_MERGE_US < step_us && (next_us == 0 || due_us < next_us))
+            next_us = due_us;
+    }
+    return next_us;
+}
+
+/*
+ * Compile the hit of track `i` on `step` of `pattern` into its schedule: the
+ * recorded micro-offset scaled down by the quantize strength, the track's
+ * swing delay on odd steps and its groove template's push or drag, and the
+ * level's velocity shaped by the template. The offset is kept within a step
+ * of the grid, so an early hit always fires from the previous step.
+ */
+static void looper_compile_hit(looper_bank_pattern_t *pattern, uint8_t i, uint16_t step) {
+    const track_t *track = &pattern->tracks[i];
+    const groove_t *groove = groove_get(track->groove);
+    uint16_t steps_per_bar = looper_status.steps_per_beat * LOOPER_BEATS_PER_BAR;
+    uint8_t slot = (uint8_t)((uint32_t)(step % steps_per_bar) * GROOVE_SLOTS / steps_per_bar);
+    uint8_t swing = track->swing;
+    if (swing == LOOPER_TRACK_SWING_GLOBAL)
+        swing = looper_status.swing;
+
+    int32_t offset = track->offset[step] * (100 - looper_status.quantize) / 100;
+    if (step & 1u)
+        offset += (2 * swing - 100) * LOOPER_OFFSET_UNITS / 100;
+    offset += groove->offset[slot];
+    if (offset >= LOOPER_OFFSET_UNITS)
+        offset = LOOPER_OFFSET_UNITS - 1;
+    else if (offset <= -LOOPER_OFFSET_UNITS)
+        offset = 1 - LOOPER_OFFSET_UNITS;
+    int32_t velocity = level_velocity[looper_level_get(&track->levels, step)];
+    velocity += groove->velocity[slot];
+
+    looper_schedule_t *compiled = &pattern->schedule;
+    compiled->offset[i][step] = (int8_t)offset;
+    compiled->velocity[i][step] = (uint8_t)(velocity < 1 ? 1 : velocity > 127 ? 127 : velocity);
+    if (offset < 0)
+        compiled->early[step] |= 1u << i;
+    else
+        compiled->early[step] &= ~(1u << i);
+}
+
+// Recompile every hit of track `i` of `pattern`, after one of its feel settings changed.
+static void looper_compile_track(looper_bank_pattern_t *pattern, uint8_t i) {
+    for (uint16_t step = 0; step < looper_status.total_steps; step++) {
+        if ((pattern->step_tracks[step] >> i) & 1u)
+            looper_compile_hit(pattern, i, step);
+    }
+}
+
+// Recompile every hit of `pattern` from its step table.
+static void looper_compile_pattern(looper_bank_pattern_t *pattern) {
+    pattern->schedule_stale = false;
+    for (uint16_t step = 0; step < looper_status.total_steps; step++) {
+        uint32_t hits = pattern->step_tracks[step];
+        while (hits) {
+            uint8_t i = __builtin_ctz(hits);
+            hits &= hits - 1;
+            looper_compile_hit(pattern, i, step);
+        }
+    }
+}
+
+/*
+ * After a global feel setting changed: recompile the playing pattern now and
+ * leave the others to looper_compiled_pattern(), so the step that applies the
+ * setting pays for one pattern instead of the whole bank.
+ */
+static void looper_update_bank_schedules(void) {
+    for (uint8_t p = 0; p < LOOPER_BANK_PATTERNS; p++)
+        bank[p].schedule_stale = true;
+    looper_compile_pattern(&bank[looper_status.pattern_index]);
+}
+
+// Pattern `index` with its schedule up to date, compiling it first if it is stale.
+static looper_bank_pattern_t *looper_compiled_pattern(uint8_t index) {
+    looper_bank_pattern_t *pattern = &bank[index];
+    if (pattern->schedule_stale)
+        looper_compile_pattern(pattern);
+    return pattern;
+}
+
+/*
+ * Converts a signed offset in 1/LOOPER_OFFSET_UNITS of a step to µs: one
+ * multiply by the unit length kept by looper_set_beat_period().
+ */
+static int64_t looper_offset_us(int32_t offset) {
+    uint64_t us = ((uint64_t)(offset < 0 ? -offset : offset) * offset_period) >> TIMING_FRAC_BITS;
+    return (offset < 0) ? -(int64_t)us : (int64_t)us;
+}
+
+// Roll a hit's play chance: LOOPER_CHANCE_ALWAYS always plays, 3 plays one time in four.
+static bool looper_roll_chance(uint8_t chance) {
+    chance_state ^= chance_state << 13;  // xorshift32
+    chance_state ^= chance_state >> 17;
+    chance_state ^= chance_state << 5;
+    return (chance_state >> 30) < (uint32_t)(4 - chance);
+}
+
+/*
+ * Play the compiled hit of track `i` on `step` of `pattern`, whose grid time
+ * is `grid_us`, from the tick at `time_us`. A ratcheted hit plays its notes
+ * evenly through the step, each gated to fit before the next. Notes already
+ * due, e.g. an early hit its lookahead missed, play at `time_us`.
+ */
+static void looper_play_hit(uint64_t time_us, uint64_t grid_us,
+                            const looper_bank_pattern_t *pattern, uint8_t i, uint16_t step) {
+    const track_t *track = &pattern->tracks[i];
+    uint8_t chance = looper_level_get(&track->chance, step);
+    if (chance != LOOPER_CHANCE_ALWAYS && !looper_roll_chance(chance))
+        return;
+    int32_t offset = pattern->schedule.offset[i][step];
+    uint8_t velocity = pattern->schedule.velocity[i][step];
+    uint8_t notes = looper_level_get(&track->ratchet, step) + 1;
+    uint8_t gate = track->gate;
+    if (notes > 1 && gate > LOOPER_GATE_UNITS / notes)
+        gate = LOOPER_GATE_UNITS / notes;
+    for (uint8_t k = 0; k < notes; k++) {
+        int32_t at = offset + k * LOOPER_OFFSET_UNITS / notes;
+        looper_schedule_note(time_us, grid_us + looper_offset_us(at), track->channel, track->note,
+                             velocity, gate);
+    }
 }
 
 // Sends a MIDI click at specific steps to indicate rhythm.
-static void send_click_if_needed(void) {
-    if ((looper_status.current_step % LOOPER_CLICK_DIV) == 0)
-        looper_perform_note(MIDI_CHANNEL_1, RIM_SHOT, 0x20);
+static void send_click_if_needed(uint64_t step_time_us) {
+    if ((looper_status.current_step % looper_status.steps_per_beat) == 0)
+        looper_perform_gated_note(step_time_us, MIDI_CHANNEL_1, RIM_SHOT, 0x20,
+                                  LOOPER_DEFAULT_GATE);
 }
 
-// Perform all note events for the current step across all tracks.
-// If the current track is active, also update the status LED.
-static void looper_perform_step(void) {
-    for (uint8_t i = 0; i < NUM_TRACKS; i++) {
-        bool note_on = tracks[i].pattern[looper_status.current_step];
-        if (note_on) {
-            looper_perform_note(tracks[i].channel, tracks[i].note, 0x7f);
-            if (i == looper_status.current_track)
-                looper_set_status_led(1);
-        } else if (i == looper_status.current_track) {
-            looper_set_status_led(0);
+// Record a hit of `track_index` on `step` in both the pattern and the step table.
+static void looper_set_step(uint8_t track_index, uint16_t step, int8_t offset, uint8_t level) {
+    if (!looper_pattern_get(&tracks[track_index].pattern, step))
+        pattern_history_record(looper_status.pattern_index, track_index, step / 32,
+                               1u << (step % 32));
+    track_t *track = &tracks[track_index];
+    looper_pattern_set(&track->pattern, step);
+    looper_level_set(&track->levels, step, level);
+    looper_level_set(&track->chance, step, LOOPER_CHANCE_ALWAYS);  // A new take plays plain
+    looper_level_set(&track->ratchet, step, 0);
+    track->offset[step] = offset;
+    step_tracks[step] |= 1u << track_index;
+    looper_compile_hit(&bank[looper_status.pattern_index], track_index, step);
+    last_hit = (looper_last_hit_t){looper_status.pattern_index, track_index, step};
+}
+
+// Re-derive the step table column and schedule of one track from its pattern.
+static void looper_sync_step_table(uint8_t track_index) {
+    uint16_t bit = 1u << track_index;
+    for (uint16_t step = 0; step < looper_status.total_steps; step++) {
+        if (looper_pattern_get(&tracks[track_index].pattern, step)) {
+            step_tracks[step] |= bit;
+            looper_compile_hit(&bank[looper_status.pattern_index], track_index, step);
+        } else {
+            step_tracks[step] &= ~bit;
         }
     }
 }
 
+// Clear one track of the playing pattern, keeping the old words for undo.
+static void looper_clear_track(uint8_t track_index) {
+    looper_pattern_t *pattern = &tracks[track_index].pattern;
+    for (uint8_t word = 0; word < LOOPER_PATTERN_WORDS; word++)
+        pattern_history_record(looper_status.pattern_index, track_index, word, pattern->bits[word]);
+    looper_pattern_clear(pattern);
+}
+
+/*
+ * Undo/redo callback: flip `bits` of one pattern word, and the matching
+ * step table bits if the track is in use, so the cost is per changed hit.
+ */
+static void looper_apply_delta(uint8_t pattern, uint8_t track, uint8_t word, uint32_t bits) {
+    looper_bank_pattern_t *target = &bank[pattern];
+    target->tracks[track].pattern.bits[word] ^= bits;
+    if (track >= looper_status.num_tracks)
+        return;  // Not in the step table
+    while (bits) {
+        uint16_t step = word * 32 + __builtin_ctz(bits);
+        bits &= bits - 1;
+        if (step >= looper_status.total_steps)
+            continue;
+        target->step_tracks[step] ^= 1u << track;
+        if ((target->step_tracks[step] >> track) & 1u)
+            looper_compile_hit(target, track, step);  // Restored: its schedule may be stale
+    }
+}
+
+// True while no track of `pattern` has a hit.
+static bool looper_bank_pattern_empty(const looper_bank_pattern_t *pattern) {
+    for (uint16_t step = 0; step < looper_status.total_steps; step++) {
+        if (pattern->step_tracks[step])
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Index of the pattern that plays from `step`, a bar line: the queued one,
+ * or in chain mode the next non-empty pattern once the loop starts over.
+ */
+static uint8_t looper_pattern_at_bar(uint16_t step) {
+    uint8_t index = looper_status.pattern_index;
+    if (looper_status.next_pattern_index != index)
+        return looper_status.next_pattern_index;
+    if (!looper_status.chain || step != 0 || looper_status.state == LOOPER_STATE_RECORDING)
+        return index;
+    for (uint8_t k = 1; k < LOOPER_BANK_PATTERNS; k++) {
+        uint8_t next = (index + k) % LOOPER_BANK_PATTERNS;
+        if (!looper_bank_pattern_empty(&bank[next]))
+            return next;
+    }
+    return index;
+}
+
+// Make `index` the playing pattern: a pointer swap, once its schedule is up to date.
+static void looper_select_pattern(uint8_t index) {
+    looper_compiled_pattern(index);
+    tracks = bank[index].tracks;
+    step_tracks = bank[index].step_tracks;
+    looper_status.pattern_index = index;
+    looper_status.next_pattern_index = index;
+}
+
+/*
+ * Perform the note events of `step` from the compiled schedule. Each hit is
+ * played at the step time plus its compiled offset; hits of the next step
+ * that play early are played now, since they fall before that step's tick,
+ * and noted in `early_played`. An early hit the previous step did not play
+ * (no lookahead then, a command applied since, or a pattern other than the
+ * one guessed) plays at once, on the grid, instead of being lost.
+ * Nothing here depends on the feel settings, only on table lookups.
+ */
+static void looper_perform_step_events(uint64_t step_time_us, uint16_t step) {
+    const looper_bank_pattern_t *playing = &bank[looper_status.pattern_index];
+    uint32_t played = 0;
+    if (early_played.pattern == looper_status.pattern_index && early_played.step == step)
+        played = early_played.tracks;
+    early_played.tracks = 0;
+    uint32_t events = step_tracks[step] & ~played;
+    while (events) {
+        uint8_t i = __builtin_ctz(events);
+        events &= events - 1;
+        looper_play_hit(step_time_us, step_time_us, playing, i, step);
+    }
+
+    if (layout_request.pending)
+        return;  // The next step may be re-gridded
+    uint16_t next_step = (step + 1) % looper_status.total_steps;
+    uint64_t next_time_us = step_time_us + timing_to_us(looper_status.step_period);
+    uint8_t next_index = looper_status.pattern_index;
+    if (next_step % (looper_status.steps_per_beat * LOOPER_BEATS_PER_BAR) == 0)
+        next_index = looper_pattern_at_bar(next_step);  // Early hits of a pattern switch
+    const looper_bank_pattern_t *next = looper_compiled_pattern(next_index);
+    events = next->step_tracks[next_step] & next->schedule.early[next_step];
+    early_played = (looper_early_played_t){next_index, next_step, (uint16_t)events};
+    while (events) {
+        uint8_t i = __builtin_ctz(events);
+        events &= events - 1;
+        looper_play_hit(step_time_us, next_time_us, next, i, next_step);
+    }
+}
+
+// Perform all note events for the current step across all tracks.
+// The status LED mirrors whether the current track plays on this step.
+static void looper_perform_step(uint64_t step_time_us) {
+    uint32_t events = step_tracks[looper_status.current_step];
+    looper_set_status_led((events >> looper_status.current_track) & 1u);
+    looper_perform_step_events(step_time_us, looper_status.current_step);
+}
+
 // Perform note events for the current step while recording.
 // In recording mode, the status LED is always turned on.
-static void looper_perform_step_recording(void) {
+static void looper_perform_step_recording(uint64_t step_time_us) {
     looper_set_status_led(1);
-
-    for (uint8_t i = 0; i < NUM_TRACKS; i++) {
-        bool note_on = tracks[i].pattern[looper_status.current_step];
-        if (note_on)
-            looper_perform_note(tracks[i].channel, tracks[i].note, 0x7f);
-    }
+    looper_perform_step_events(step_time_us, looper_status.current_step);
 }
 
 // Updates the current step index and timestamp based on current loop progress.
 static void looper_next_step(uint64_t now_us) {
     looper_status.timing.last_step_time_us = now_us;
-    looper_status.current_step = (looper_status.current_step + 1) % LOOPER_TOTAL_STEPS;
+    looper_status.current_step = (looper_status.current_step + 1) % looper_status.total_steps;
+}
+
+/*
+ * Returns the step index nearest to `time_us` (a press or an inbound note),
+ * relative to the last tick, and stores its distance from that step in
+ * `offset` (1/LOOPER_OFFSET_UNITS of a step). Integer-only, like the tick path.
+ */
+static uint16_t looper_quantize_step(uint64_t time_us, int8_t *offset) {
+    int64_t delta_us = (int64_t)(time_us - looper_status.timing.last_step_time_us);
+    int64_t ticks = timing_ticks(delta_us, looper_status.step_period, LOOPER_OFFSET_UNITS);
+    int32_t relative_steps = (int32_t)timing_div_round(ticks, LOOPER_OFFSET_UNITS);
+    *offset = (int8_t)(ticks - (int64_t)relative_steps * LOOPER_OFFSET_UNITS);
+
+    uint16_t total_steps = looper_status.total_steps;
+    uint16_t previous_step = (looper_status.current_step + total_steps - 1) % total_steps;
+    int32_t estimated_step = (previous_step + relative_steps) % total_steps;
+    return (uint16_t)((estimated_step + total_steps) % total_steps);
+}
+
+// Level whose playback velocity is nearest to an inbound note's `velocity`.
+static uint8_t looper_velocity_level(uint8_t velocity) {
+    uint8_t level = 0;
+    while (level < LOOPER_LEVEL_ACCENT &&
+           velocity > (level_velocity[level] + level_velocity[level + 1]) / 2)
+        level++;
+    return level;
 }
 
 /*
- * Returns the step index nearest to the stored `button_press_start_us` timestamp.
- * The result is quantized to the nearest step relative to the last tick.
+ * Start a recording pass if none is running, and clear `track_index` the
+ * first time it is recorded into during the pass, so each track gets a
+ * fresh take while the others keep playing.
  */
-static uint8_t looper_quantize_step() {
-    int64_t delta_us =
-        looper_status.timing.button_press_start_us - looper_status.timing.last_step_time_us;
-    // Convert to step offset using rounding (nearest step)
-    int32_t relative_steps =
-        (int32_t)round((double)delta_us / 1000.0 / looper_status.step_duration_ms);
-    uint8_t previous_step =
-        (looper_status.current_step + LOOPER_TOTAL_STEPS - 1) % LOOPER_TOTAL_STEPS;
-    uint8_t estimated_step =
-        (previous_step + relative_steps + LOOPER_TOTAL_STEPS) % LOOPER_TOTAL_STEPS;
-    return estimated_step;
+static void looper_record_take(uint8_t track_index) {
+    if (looper_status.state != LOOPER_STATE_RECORDING) {
+        looper_status.recording_step_count = 0;
+        looper_status.state = LOOPER_STATE_RECORDING;
+        take_tracks = 0;
+    }
+    if (take_tracks & (1u << track_index))
+        return;
+    take_tracks |= 1u << track_index;
+    looper_clear_track(track_index);
+    looper_sync_step_table(track_index);
 }
 
-// Clear all patterns in every track
+// Map how long a click was held to a hit level: quick taps are soft, firm presses accented.
+static uint8_t looper_press_level(uint64_t duration_us) {
+    if (duration_us < LOOPER_LEVEL_SOFT_US)
+        return LOOPER_LEVEL_GHOST;
+    if (duration_us < LOOPER_LEVEL_NORMAL_US)
+        return LOOPER_LEVEL_GHOST + 1;
+    if (duration_us < LOOPER_LEVEL_ACCENT_US)
+        return LOOPER_LEVEL_ACCENT - 1;
+    return LOOPER_LEVEL_ACCENT;
+}
+
+// Clear every track of the playing pattern.
 static void looper_clear_all_tracks() {
-    for (uint8_t i = 0; i < NUM_TRACKS; i++)
-        memset(tracks[i].pattern, 0, sizeof(tracks[i].pattern));
+    for (uint8_t i = 0; i < LOOPER_MAX_TRACKS; i++)
+        looper_clear_track(i);
+    memset(step_tracks, 0, LOOPER_MAX_STEPS * sizeof(step_tracks[0]));
+}
+
+// Rebuild the step table and the schedule of `pattern` from its tracks in use.
+static void looper_rebuild_step_table(looper_bank_pattern_t *pattern) {
+    memset(pattern->step_tracks, 0, sizeof(pattern->step_tracks));
+    for (uint8_t i = 0; i < looper_status.num_tracks; i++) {
+        for (uint16_t step = 0; step < looper_status.total_steps; step++) {
+            if (looper_pattern_get(&pattern->tracks[i].pattern, step))
+                pattern->step_tracks[step] |= 1u << i;
+        }
+    }
+    looper_compile_pattern(pattern);
+}
+
+/*
+ * Re-grids a track from (old_steps, old_spb) to the current layout.
+ * Hits keep their musical position, micro-offset, level and step modes included, rounded to the
+ * nearest new step; when the loop gets longer the old loop is repeated to fill it.
+ */
+static void looper_resample_track(track_t *track, uint16_t old_steps, uint8_t old_spb) {
+    looper_pattern_t old = track->pattern;
+    looper_levels_t old_levels = track->levels;
+    looper_levels_t old_chance = track->chance;
+    looper_levels_t old_ratchet = track->ratchet;
+    int8_t old_offset[LOOPER_MAX_STEPS];
+    memcpy(old_offset, track->offset, sizeof(old_offset));
+    uint8_t new_spb = looper_status.steps_per_beat;
+    uint16_t new_steps = looper_status.total_steps;
+    uint16_t span = (uint32_t)old_steps * new_spb / old_spb;  // old loop in new steps
+
+    looper_pattern_clear(&track->pattern);
+    for (uint16_t s = 0; s < old_steps; s++) {
+        if (!looper_pattern_get(&old, s))
+            continue;
+        // Position in 1/LOOPER_OFFSET_UNITS of a new step
+        int32_t pos = (int32_t)timing_div_round(
+            ((int32_t)s * LOOPER_OFFSET_UNITS + old_offset[s]) * new_spb, old_spb);
+        int32_t step = (int32_t)timing_div_round(pos, LOOPER_OFFSET_UNITS);
+        int8_t offset = (int8_t)(pos - step * LOOPER_OFFSET_UNITS);
+        uint8_t level = looper_level_get(&old_levels, s);
+        uint8_t chance = looper_level_get(&old_chance, s);
+        uint8_t ratchet = looper_level_get(&old_ratchet, s);
+        for (uint16_t t = (uint16_t)((step % span + span) % span); t < new_steps; t += span) {
+            looper_pattern_set(&track->pattern, t);
+            looper_level_set(&track->levels, t, level);
+            looper_level_set(&track->chance, t, chance);
+            looper_level_set(&track->ratchet, t, ratchet);
+            track->offset[t] = offset;
+        }
+    }
+}
+
+/*
+ * Applies a pending layout request. Called at a bar line from the step path,
+ * so the playhead moves to the start of the same bar in the new grid.
+ */
+static void looper_apply_layout(void) {
+    uint16_t old_steps = looper_status.total_steps;
+    uint8_t old_spb = looper_status.steps_per_beat;
+    uint16_t bar = looper_status.current_step / (old_spb * LOOPER_BEATS_PER_BAR);
+
+    looper_status.num_tracks = layout_request.num_tracks;
+    looper_status.bars = layout_request.bars;
+    looper_status.steps_per_beat = layout_request.steps_per_beat;
+    looper_status.total_steps =
+        looper_status.bars * LOOPER_BEATS_PER_BAR * looper_status.steps_per_beat;
+    layout_request.pending = false;
+
+    if (old_steps != looper_status.total_steps || old_spb != looper_status.steps_per_beat) {
+        for (uint8_t p = 0; p < LOOPER_BANK_PATTERNS; p++) {
+            for (uint8_t i = 0; i < LOOPER_MAX_TRACKS; i++)
+                looper_resample_track(&bank[p].tracks[i], old_steps, old_spb);
+        }
+        pattern_history_reset();  // The deltas no longer line up with the grid
+        last_hit.step = UINT16_MAX;
+        early_played.tracks = 0;
+    }
+    if (looper_status.current_track >= looper_status.num_tracks)
+        looper_status.current_track = 0;
+    looper_status.current_step =
+        (bar < looper_status.bars) ? bar * looper_status.steps_per_beat * LOOPER_BEATS_PER_BAR : 0;
+    looper_status.recording_step_count = 0;
+    looper_update_beat_period(looper_status.beat_period);
+    for (uint8_t p = 0; p < LOOPER_BANK_PATTERNS; p++)
+        looper_rebuild_step_table(&bank[p]);
+    looper_mark_dirty();
+}
+
+// Show the step timing histograms, BLE-MIDI counters and boot markers under the looper view.
+static void looper_show_timing_report(void) {
+    static char report[1024];  // Static: built on the input path, kept off the stack
+    size_t len = tick_stats_format(report, sizeof(report));
+    const ble_midi_stats_t *ble = ble_midi_get_stats();
+    snprintf(report + len, sizeof(report) - len,
+             "ble sent %lu  merged %lu  dropped %lu full, %lu stale  offs carried %lu"
+             "  queue max %u\n",
+             (unsigned long)ble->packets_sent, (unsigned long)ble->packets_merged,
+             (unsigned long)ble->dropped_full, (unsigned long)ble->dropped_stale,
+             (unsigned long)ble->offs_carried, ble->max_queue_depth);
+    len = strlen(report);
+    boot_trace_format(report + len, sizeof(report) - len);
+    display_show_report(report);
+}
+
+/*
+ * Show each new wake-to-first-note time under the looper view. The driver
+ * only measures it on the send path; printing waits for the service and
+ * goes through the display ring, so it never blocks a step.
+ */
+static void looper_show_wake_latency(void) {
+    static uint32_t shown_count = 0;
+    uint32_t count = ble_midi_get_wake_count();
+    if (count == shown_count)
+        return;
+    char report[48];
+    snprintf(report, sizeof(report), "[BLE] wake-to-first-note %lu us\n",
+             (unsigned long)ble_midi_get_wake_latency_us());
+    if (display_show_report(report))
+        shown_count = count;  // Otherwise try again once the ring has drained
+}
+
+// Hand an edit to the sequencer, which applies it at the next step boundary.
+static void looper_send_command(uint8_t type, uint8_t arg, uint64_t time_us, uint64_t value) {
+    command_t command = {time_us, value, type, arg};
+    command_queue_push(&command);
+}
+
+// Next swing amount: straight, then light to heavy; 66% is a triplet feel. Wraps to global.
+static uint8_t looper_next_swing(uint8_t swing) {
+    static const uint8_t swing_steps[] = {50, 54, 58, 62, 66, 75};
+    uint8_t i = 0;
+    while (i < sizeof(swing_steps) && swing_steps[i] <= swing)
+        i++;
+    return (i < sizeof(swing_steps)) ? swing_steps[i] : LOOPER_TRACK_SWING_GLOBAL;
+}
+
+/*
+ * Console setting keys, applied by the sequencer: 'l' loop length,
+ * 'r' resolution, '+'/'-' track count, 'g' gate, 'q' quantize strength,
+ * 's' swing, 'S' track swing, 'G' track groove, 'p'/'t' play chance and
+ * ratchet of the last hit, '1'-'4' pattern A-D, 'c' pattern chain,
+ * 'x' external clock, 'm' clock output, 'u' undo, 'U' redo.
+ */
+static void looper_apply_setting(int key) {
+    if (key >= '1' && key < '1' + LOOPER_BANK_PATTERNS) {
+        looper_request_pattern(key - '1');
+        return;
+    }
+    switch (key) {
+        case 'c':
+            looper_status.chain = !looper_status.chain;
+            looper_mark_dirty();
+            return;
+        case 'u':
+            if (pattern_history_undo(looper_apply_delta))
+                looper_mark_dirty();
+            return;
+        case 'U':
+            if (pattern_history_redo(looper_apply_delta))
+                looper_mark_dirty();
+            return;
+        case 'x':
+            looper_status.clock_follow = !looper_status.clock_follow;
+            looper_status.clock_locked = false;
+            return;
+        case 'm':
+            looper_status.clock_output = !looper_status.clock_output;
+            return;
+        case 'g': {
+            // Double the current track's gate, wrapping from two steps to 1/16 step
+            track_t *track = &tracks[looper_status.current_track];
+            track->gate = (track->gate >= 2 * LOOPER_GATE_UNITS) ? 1 : track->gate * 2;
+            looper_mark_dirty();
+            return;
+        }
+        case 'q':
+            // 100% (on the grid) down to 0% (as played) in quarters
+            looper_status.quantize =
+                (looper_status.quantize == 0) ? 100 : looper_status.quantize - 25;
+            looper_update_bank_schedules();
+            looper_mark_dirty();
+            return;
+        case 's': {
+            uint8_t swing = looper_next_swing(looper_status.swing);
+            looper_status.swing = (swing == LOOPER_TRACK_SWING_GLOBAL) ? 50 : swing;
+            looper_update_bank_schedules();
+            looper_mark_dirty();
+            return;
+        }
+        case 'S': {
+            // The current track's own swing, then back to following the global one
+            track_t *track = &tracks[looper_status.current_track];
+            track->swing = (track->swing == LOOPER_TRACK_SWING_GLOBAL)
+                               ? 50
+                               : looper_next_swing(track->swing);
+            looper_compile_track(&bank[looper_status.pattern_index], looper_status.current_track);
+            looper_mark_dirty();
+            return;
+        }
+        case 'G': {
+            track_t *track = &tracks[looper_status.current_track];
+            track->groove = (track->groove + 1) % groove_count();
+            looper_compile_track(&bank[looper_status.pattern_index], looper_status.current_track);
+            looper_mark_dirty();
+            return;
+        }
+        case 'p':
+        case 't': {
+            // Step modes of the last recorded hit: chance 100% down to 25%, or 1 to 4 notes
+            track_t *track = &tracks[last_hit.track];
+            uint16_t step = last_hit.step;
+            if (last_hit.pattern != looper_status.pattern_index ||
+                step >= looper_status.total_steps || !looper_pattern_get(&track->pattern, step))
+                return;  // Not in the playing pattern, or undone since
+            looper_levels_t *modes = (key == 'p') ? &track->chance : &track->ratchet;
+            looper_level_set(modes, step, looper_level_get(modes, step) + 1);  // Wraps in 2 bits
+            looper_mark_dirty();
+            return;
+        }
+        default:
+            break;
+    }
+    uint8_t num_tracks = looper_status.num_tracks;
+    uint8_t bars = looper_status.bars;
+    uint8_t spb = looper_status.steps_per_beat;
+    if (layout_request.pending) {
+        num_tracks = layout_request.num_tracks;
+        bars = layout_request.bars;
+        spb = layout_request.steps_per_beat;
+    }
+    switch (key) {
+        case 'l':
+            bars = (bars >= LOOPER_MAX_BARS) ? 1 : bars * 2;
+            break;
+        case 'r':
+            spb = (spb >= LOOPER_MAX_STEPS_PER_BEAT) ? 2 : spb * 2;
+            break;
+        case '+':
+            num_tracks++;
+            break;
+        case '-':
+            num_tracks--;
+            break;
+        default:
+            return;
+    }
+    looper_request_layout(num_tracks, bars, spb);
+}
+
+/*
+ * Console keys on the input path: 'i' timing report and 'I' report reset
+ * are handled here; the settings go to the sequencer.
+ */
+static void looper_handle_key(int key) {
+    switch (key) {
+        case 'i':
+            looper_show_timing_report();
+            return;
+        case 'I':
+            tick_stats_reset();
+            return;
+        default:
+            looper_send_command(COMMAND_SETTING, (uint8_t)key, 0, 0);
+            return;
+    }
 }
 
 // Routes button events related to tap-tempo mode.
@@ -139,7 +1123,7 @@ static tap_result_t taptempo_handle_button_event(button_event_t event) {
     switch (result) {
         case TAP_PRELIM:
         case TAP_FINAL:
-            looper_update_bpm(taptempo_get_bpm());
+            looper_send_command(COMMAND_SET_TEMPO, 0, 0, taptempo_get_beat_period());
             break;
         case TAP_EXIT: /* leave mode */
             break;
@@ -149,6 +1133,56 @@ static tap_result_t taptempo_handle_button_event(button_event_t event) {
     return result;
 }
 
+/*
+ * Record an inbound Note-On played at `time_us` (rebuilt from its BLE-MIDI
+ * timestamp). It goes to every track in use with that note number, or to
+ * the current track if none has it, through the same quantizer as the
+ * button, so a pad controller can record several tracks in one pass.
+ */
+static void looper_record_midi_note(uint64_t time_us, uint8_t note, uint8_t level) {
+    if (looper_status.state != LOOPER_STATE_PLAYING &&
+        looper_status.state != LOOPER_STATE_RECORDING)
+        return;
+    int8_t offset;
+    uint16_t step = looper_quantize_step(time_us, &offset);
+    bool matched = false;
+    for (uint8_t i = 0; i < looper_status.num_tracks; i++) {
+        if (tracks[i].note != note)
+            continue;
+        looper_record_take(i);
+        looper_set_step(i, step, offset, level);
+        matched = true;
+    }
+    if (!matched) {
+        looper_record_take(looper_status.current_track);
+        looper_set_step(looper_status.current_track, step, offset, level);
+    }
+    looper_mark_dirty();
+}
+
+/*
+ * Inbound BLE-MIDI, on core 0: real-time messages drive the clock follower,
+ * Note-Ons are recorded.
+ */
+static void looper_handle_midi_in(uint64_t time_us, uint8_t status, uint8_t data1,
+                                  uint8_t data2) {
+    if (status >= 0xF8)
+        clock_sync_handle_message(time_us, status);
+    else if ((status & 0xF0) == 0x90 && data2 > 0)
+        looper_send_command(COMMAND_RECORD_NOTE, looper_velocity_level(data2), time_us, data1);
+}
+
+// Fill every pattern of the bank with the track presets. Called once at boot.
+void looper_init(void) {
+    for (uint8_t p = 0; p < LOOPER_BANK_PATTERNS; p++) {
+        memcpy(bank[p].tracks, track_presets, sizeof(track_presets));
+        memset(bank[p].step_tracks, 0, sizeof(bank[p].step_tracks));
+    }
+    looper_select_pattern(0);
+    ble_midi_set_loopback(LOOPER_BENCH);  // The benchmark host times round trips too
+    ble_midi_set_receive_handler(looper_handle_midi_in);
+}
+
 // Return a pointer to the current looper status.
 looper_status_t *looper_status_get(void) {
     return &looper_status;
@@ -156,134 +1190,752 @@ looper_status_t *looper_status_get(void) {
 
 // Retrieve the current step interval in milliseconds.
 uint32_t looper_get_step_interval_ms(void) {
-    return looper_status.step_duration_ms;
+    return (uint32_t)(timing_to_us(looper_status.step_period) / 1000);
 }
 
-// Update the looper BPM and recalculate the step duration.
+/*
+ * Set the tempo from a fixed-point beat length and derive the step period.
+ * Both keep TIMING_FRAC_BITS of sub-µs precision, so e.g. 90 BPM runs
+ * at 166666.67 µs per 16th rather than a truncated 166 ms, and a tapped tempo
+ * is kept as tapped instead of being rounded to whole BPM. The tempo is
+ * clamped so the step period never drops below LOOPER_MIN_STEP_PERIOD_US.
+ */
+static void looper_set_beat_period(timing_fx_t beat_period) {
+    uint8_t spb = looper_status.steps_per_beat;
+    timing_fx_t min_period = timing_from_us((uint64_t)LOOPER_MIN_STEP_PERIOD_US * spb);
+    if (beat_period < min_period)
+        beat_period = min_period;
+    looper_status.beat_period = beat_period;
+    looper_status.step_period = (beat_period + spb / 2) / spb;
+    offset_period = (looper_status.step_period + LOOPER_OFFSET_UNITS / 2) / LOOPER_OFFSET_UNITS;
+    looper_status.bpm = timing_bpm(beat_period);
+}
+
+void looper_update_beat_period(timing_fx_t beat_period) {
+    looper_set_beat_period(beat_period);
+    looper_mark_dirty();
+}
+
+// Update the looper BPM and recalculate the step period.
 void looper_update_bpm(uint32_t bpm) {
-    looper_status.bpm = bpm;
-    looper_status.step_duration_ms = 60000 / (bpm * LOOPER_STEPS_PER_BEAT);
+    looper_update_beat_period(timing_beat_period(bpm));
+}
+
+// True if the layout fits the build-time arena and bars/resolution are powers of two.
+static bool looper_layout_valid(uint8_t num_tracks, uint8_t bars, uint8_t steps_per_beat) {
+    bool bars_ok = bars >= 1 && bars <= LOOPER_MAX_BARS && (bars & (bars - 1)) == 0;
+    bool spb_ok = steps_per_beat >= 1 && steps_per_beat <= LOOPER_MAX_STEPS_PER_BEAT &&
+                  (steps_per_beat & (steps_per_beat - 1)) == 0;
+    return num_tracks >= 1 && num_tracks <= LOOPER_MAX_TRACKS && bars_ok && spb_ok;
+}
+
+/*
+ * Request a new track count, loop length and resolution. Values outside the
+ * build-time arena or not a power of two are rejected. The change is applied
+ * at the next bar line by the step path.
+ */
+bool looper_request_layout(uint8_t num_tracks, uint8_t bars, uint8_t steps_per_beat) {
+    if (!looper_layout_valid(num_tracks, bars, steps_per_beat))
+        return false;
+
+    layout_request.num_tracks = num_tracks;
+    layout_request.bars = bars;
+    layout_request.steps_per_beat = steps_per_beat;
+    layout_request.pending = true;
+    return true;
+}
+
+/*
+ * Queue pattern `index` of the bank. The switch happens at the next bar line
+ * in the step path; until then the playing pattern carries on untouched.
+ * Requesting the playing pattern cancels a queued switch.
+ */
+bool looper_request_pattern(uint8_t index) {
+    if (index >= LOOPER_BANK_PATTERNS)
+        return false;
+    looper_status.next_pattern_index = index;
+    return true;
+}
+
+#if LOOPER_BENCH
+// At each loop start: keep the stage, or load the next one and mark it.
+static void looper_bench_loop_start(uint64_t start_us) {
+    if (bench_loops_left > 0) {
+        bench_loops_left--;
+        return;
+    }
+    uint8_t index = bench_next_stage;
+    const looper_bench_stage_t *stage = &bench_stages[index];
+    bench_next_stage = (index + 1) % (sizeof(bench_stages) / sizeof(bench_stages[0]));
+    bench_loops_left = LOOPER_BENCH_STAGE_LOOPS - 1;
+
+    looper_status.num_tracks = stage->tracks;
+    looper_status.bars = 1;
+    looper_status.steps_per_beat = stage->steps_per_beat;
+    looper_status.total_steps = LOOPER_BEATS_PER_BAR * stage->steps_per_beat;
+    looper_status.current_track = 0;
+    looper_update_bpm(stage->bpm);
+    looper_clear_all_tracks();
+    for (uint8_t i = 0; i < stage->tracks; i++) {
+        for (uint16_t step = 0; step < looper_status.total_steps; step++)
+            looper_set_step(i, step, 0, LOOPER_LEVEL_ACCENT - 1);
+    }
+    pattern_history_reset();  // Generated, not edited
+    looper_perform_note(start_us, MIDI_CHANNEL_16, index, 0x7f);
+    looper_perform_note(start_us, MIDI_CHANNEL_16, index, 0);
+}
+#endif
+
+/*
+ * Clock master output for the step performed at `step_time_us`. Every
+ * Timing Clock tick up to the next step rides in this step's packet, each
+ * with its own timestamp, so 24 PPQN costs no notifications of its own.
+ * Start goes out at a loop start and Stop once output is turned off; no
+ * clock is sent while following an external one.
+ */
+static void looper_send_clock(uint64_t step_time_us, uint16_t step) {
+    bool enabled = looper_status.clock_output && !looper_status.clock_follow;
+    if (!enabled) {
+        if (clock_output_started)
+            looper_perform_realtime(step_time_us, MIDI_STOP);
+        clock_output_started = false;
+        return;
+    }
+    if (!clock_output_started) {
+        if (step != 0)
+            return;
+        looper_perform_realtime(step_time_us, MIDI_START);  // The next tick is the downbeat
+        clock_output_started = true;
+    }
+    uint8_t ticks = CLOCK_SYNC_PPQN / looper_status.steps_per_beat;
+    for (uint8_t k = 0; k < ticks; k++) {
+        timing_fx_t offset = looper_status.step_period * k / ticks;
+        looper_perform_realtime(step_time_us + timing_to_us(offset), MIDI_TIMING_CLOCK);
+    }
+}
+
+// Record a hit of the current track pressed at `press_us`, at hit level `level`.
+static void looper_record_hit(uint64_t press_us, uint8_t level) {
+    uint8_t track_index = looper_status.current_track;
+    looper_record_take(track_index);
+    int8_t offset;
+    uint16_t quantized_step = looper_quantize_step(press_us, &offset);
+    looper_set_step(track_index, quantized_step, offset, level);
+    looper_mark_dirty();
+}
+
+#if LOOPER_DUAL_CORE
+static void looper_take_snapshot(looper_snapshot_t *out);
+#endif
+
+// Apply one edit from the input path. Runs in the step path only.
+static void looper_apply_command(const command_t *command) {
+    switch (command->type) {
+        case COMMAND_RECORD_HIT:
+            looper_record_hit(command->time_us, command->arg);
+            break;
+        case COMMAND_RECORD_NOTE:
+            looper_record_midi_note(command->time_us, (uint8_t)command->value, command->arg);
+            break;
+        case COMMAND_BACKUP:
+            press_mark = pattern_history_mark();
+            break;
+        case COMMAND_UNDO:
+            if (pattern_history_mark() != press_mark) {
+                pattern_history_undo_to(press_mark, looper_apply_delta);
+                looper_mark_dirty();
+            }
+            break;
+        case COMMAND_SWITCH_TRACK:
+            looper_status.state = LOOPER_STATE_TRACK_SWITCH;
+            break;
+        case COMMAND_TAP_TEMPO:
+            looper_status.state = command->arg ? LOOPER_STATE_TAP_TEMPO : LOOPER_STATE_PLAYING;
+            break;
+        case COMMAND_SET_TEMPO:
+            looper_update_beat_period(command->value);
+            break;
+        case COMMAND_CLEAR:
+            looper_status.state = LOOPER_STATE_CLEAR_TRACKS;
+            break;
+        case COMMAND_SETTING:
+            looper_apply_setting(command->arg);
+            break;
+#if LOOPER_DUAL_CORE
+        case COMMAND_SNAPSHOT:
+            looper_take_snapshot(&snapshot);
+            __dmb();  // Publish the copy before the flag
+            snapshot_taken = true;
+            looper_request_service();
+            break;
+#endif
+        default:
+            break;
+    }
+}
+
+/*
+ * Apply every edit queued since the last step, before the step is played.
+ * Hits are quantized here against the same step timeline they were played
+ * on, so a late apply records them where they were played.
+ */
+static void looper_apply_commands(void) {
+    command_t command;
+    pattern_history_begin();  // Edits applied together are undone together
+    while (command_queue_pop(&command))
+        looper_apply_command(&command);
 }
 
 // Processes the looper's main state machine, called by the step timer.
 void looper_process_state(uint64_t start_us) {
+    looper_apply_commands();
     bool ready  = looper_perform_ready();
-    display_update_looper_status(ready, &looper_status, tracks, NUM_TRACKS);
+    uint16_t steps_per_bar = looper_status.steps_per_beat * LOOPER_BEATS_PER_BAR;
 
-    if (!ready)
+    if ((looper_status.current_step % steps_per_bar) == 0) {
+        uint8_t index = looper_pattern_at_bar(looper_status.current_step);
+        if (index != looper_status.pattern_index) {
+            bool requested = (index == looper_status.next_pattern_index);
+            looper_select_pattern(index);
+            if (requested)
+                looper_mark_dirty();  // Chained switches are not worth a flash write
+        }
+    }
+    if (layout_request.pending && (looper_status.current_step % steps_per_bar) == 0) {
+        looper_apply_layout();
+        steps_per_bar = looper_status.steps_per_beat * LOOPER_BEATS_PER_BAR;
+    }
+
+    if (!ready) {
         looper_status.state = LOOPER_STATE_WAITING;
+        looper_drop_timed_note_ons();
+        early_played.tracks = 0;
+        clock_output_started = false;  // A new connection gets a new Start
+#if LOOPER_BENCH
+        bench_next_stage = 0;  // Every connection runs the stages from the start
+        bench_loops_left = 0;
+#endif
+    }
+#if LOOPER_BENCH
+    if (looper_status.state == LOOPER_STATE_PLAYING && looper_status.current_step == 0)
+        looper_bench_loop_start(start_us);
+#endif
+    if (ready)
+        looper_fire_timed_notes(start_us);
+    if (looper_status.clock_follow && looper_status.clock_locked && !follow_running &&
+        (looper_status.state == LOOPER_STATE_PLAYING ||
+         looper_status.state == LOOPER_STATE_RECORDING)) {
+        looper_perform_flush();  // External transport stopped: hold until Start/Continue
+        return;
+    }
+    bool step_played = (looper_status.state != LOOPER_STATE_WAITING);
+    uint16_t step = looper_status.current_step;
     switch (looper_status.state) {
         case LOOPER_STATE_WAITING:
             if (ready) {
                 looper_status.state = LOOPER_STATE_PLAYING;
                 looper_status.current_step = 0;
             }
-            looper_set_status_led((looper_status.current_step % (LOOPER_CLICK_DIV * 4)) == 0);
+            looper_set_status_led((looper_status.current_step % steps_per_bar) == 0);
             looper_next_step(start_us);
             break;
         case LOOPER_STATE_PLAYING:
-            send_click_if_needed();
-            looper_perform_step();
+            send_click_if_needed(start_us);
+            looper_perform_step(start_us);
             looper_next_step(start_us);
             break;
         case LOOPER_STATE_RECORDING:
-            send_click_if_needed();
-            looper_perform_step_recording();
+            send_click_if_needed(start_us);
+            looper_perform_step_recording(start_us);
             looper_next_step(start_us);
 
             looper_status.recording_step_count++;
-            if (looper_status.recording_step_count >= LOOPER_TOTAL_STEPS) {
+            if (looper_status.recording_step_count >= looper_status.total_steps) {
                 looper_set_status_led(0);
                 looper_status.state = LOOPER_STATE_PLAYING;
             }
             break;
         case LOOPER_STATE_TRACK_SWITCH:
-            looper_status.current_track = (looper_status.current_track + 1) % NUM_TRACKS;
-            looper_perform_note(MIDI_CHANNEL_10, HAND_CLAP, 0x7f);
+            looper_status.current_track =
+                (looper_status.current_track + 1) % looper_status.num_tracks;
+            looper_perform_gated_note(start_us, MIDI_CHANNEL_10, HAND_CLAP, 0x7f,
+                                      LOOPER_DEFAULT_GATE);
             looper_next_step(start_us);
             looper_status.state = LOOPER_STATE_PLAYING;
+            looper_mark_dirty();
             break;
         case LOOPER_STATE_TAP_TEMPO:
-            send_click_if_needed();
-            looper_set_status_led((looper_status.current_step % LOOPER_CLICK_DIV) == 0);
+            send_click_if_needed(start_us);
+            looper_set_status_led((looper_status.current_step % looper_status.steps_per_beat) == 0);
             looper_next_step(start_us);
             break;
         case LOOPER_STATE_CLEAR_TRACKS:
             looper_clear_all_tracks();
             looper_status.current_track = 0;
+            looper_mark_dirty();
             looper_next_step(start_us);
             looper_status.state = LOOPER_STATE_PLAYING;
         default:
             break;
     }
+    if (step_played)
+        looper_send_clock(start_us, step);  // After the step notes, whose times come first
+    looper_perform_flush();
 }
 
-// Handles button events and updates the looper state accordingly.
+/*
+ * Handles button events on the input path. Previews play at once; every
+ * change to the patterns or the looper state is sent to the sequencer.
+ */
 void looper_handle_button_event(button_event_t event) {
-    track_t *track = &tracks[looper_status.current_track];
+    const track_t *track = &tracks[looper_status.current_track];
+    uint64_t now_us = time_us_64();
 
     switch (event) {
         case BUTTON_EVENT_DOWN:
-            // Button pressed: start timing and preview sound
-            looper_status.timing.button_press_start_us = time_us_64();
-            looper_perform_note(track->channel, track->note, 0x7f);
+            // Button pressed: start timing from the first edge and preview sound
+            looper_status.timing.button_press_start_us = button_get_press_time_us();
+            looper_preview_note(looper_status.timing.button_press_start_us, track->channel,
+                                track->note, 0x7f);
             // Backup track pattern in case this press becomes a long-press (undo)
-            memcpy(track->hold_pattern, track->pattern, LOOPER_TOTAL_STEPS);
+            looper_send_command(COMMAND_BACKUP, 0, 0, 0);
             break;
         case BUTTON_EVENT_CLICK_RELEASE:
             // Short press release: quantize and record step
-            if (looper_status.state != LOOPER_STATE_RECORDING) {
-                looper_status.recording_step_count = 0;
-                looper_status.state = LOOPER_STATE_RECORDING;
-                memset(track->pattern, 0, LOOPER_TOTAL_STEPS);
-            }
-            uint8_t quantized_step = looper_quantize_step();
-            track->pattern[quantized_step] = true;
+            looper_send_command(COMMAND_RECORD_HIT,
+                                looper_press_level(button_get_press_duration_us()),
+                                looper_status.timing.button_press_start_us, 0);
             break;
         case BUTTON_EVENT_HOLD_RELEASE:
             // Long press release: revert track and switch
-            memcpy(track->pattern, track->hold_pattern, LOOPER_TOTAL_STEPS);
-            looper_status.state = LOOPER_STATE_TRACK_SWITCH;
+            looper_send_command(COMMAND_UNDO, 0, 0, 0);
+            looper_send_command(COMMAND_SWITCH_TRACK, 0, 0, 0);
             break;
         case BUTTON_EVENT_LONG_HOLD_RELEASE:
             // ≥2 s hold: enter Tap-tempo (no track switch)
-            looper_status.state = LOOPER_STATE_TAP_TEMPO;
-            looper_perform_note(MIDI_CHANNEL_10, HAND_CLAP, 0x7f);
+            looper_send_command(COMMAND_TAP_TEMPO, 1, 0, 0);
+            looper_preview_note(now_us, MIDI_CHANNEL_10, HAND_CLAP, 0x7f);
             break;
         case BUTTON_EVENT_VERY_LONG_HOLD_RELEASE:
             // ≥5 s hold: clear track data
-            looper_status.state = LOOPER_STATE_CLEAR_TRACKS;
-            looper_perform_note(MIDI_CHANNEL_10, HAND_CLAP, 0x7f);
+            looper_send_command(COMMAND_CLEAR, 0, 0, 0);
+            looper_preview_note(now_us, MIDI_CHANNEL_10, HAND_CLAP, 0x7f);
             break;
         default:
             break;
     }
 }
 
-// Runs `looper_process_state()` and reschedules the BTstack timer.
+// Returns the due time of the next step, starting the timeline on first use.
+static uint64_t looper_step_deadline_us(void) {
+    if (looper_status.timing.next_step_deadline == 0)
+        looper_status.timing.next_step_deadline = timing_from_us(time_us_64());
+    return timing_to_us(looper_status.timing.next_step_deadline);
+}
+
+/*
+ * With clock follow on, place the next step on the external clock instead of
+ * one step period on. The tempo is taken from the PLL-filtered tick period at
+ * every step. The phase error against the predicted tick of the step is
+ * corrected by a quarter per step, or at once when it exceeds a step. On
+ * Start or Continue the looper jumps to the step at the song position. While
+ * the clock is stopped, the step clock polls once per tick and
+ * looper_process_state() holds playback. Returns false, leaving the deadline
+ * to the internal tempo, while no clock is received.
+ */
+static bool looper_follow_clock(void) {
+    clock_sync_state_t clock;
+    looper_status.clock_locked = clock_sync_get(&clock);
+    if (!looper_status.clock_locked) {
+        follow_running = false;
+        return false;
+    }
+    looper_set_beat_period(clock.tick_period * CLOCK_SYNC_PPQN);
+    timing_fx_t *deadline = &looper_status.timing.next_step_deadline;
+    if (!clock.running) {
+        follow_running = false;
+        *deadline += clock.tick_period;
+        return true;
+    }
+
+    int32_t ticks_per_step = CLOCK_SYNC_PPQN / looper_status.steps_per_beat;
+    if (!follow_running || clock.start_count != follow_start_count) {
+        // (Re)started: the next step boundary after the song position
+        follow_running = true;
+        follow_start_count = clock.start_count;
+        int32_t step = (clock.tick_index < 0) ? 0 : clock.tick_index / ticks_per_step + 1;
+        follow_tick = step * ticks_per_step;
+        looper_status.current_step = step % looper_status.total_steps;
+        *deadline = clock_sync_predict(&clock, follow_tick);
+        return true;
+    }
+    follow_tick += ticks_per_step;
+    *deadline += looper_status.step_period;
+    int64_t error = (int64_t)(clock_sync_predict(&clock, follow_tick) - *deadline);
+    int64_t limit = (int64_t)looper_status.step_period;
+    *deadline += (error > limit || error < -limit) ? error : error / 4;
+    return true;
+}
+
+// Advances the deadline by one step and returns the new due time in µs.
+static uint64_t looper_advance_deadline(void) {
+    bool followed = false;
+    if (looper_status.clock_follow)
+        followed = looper_follow_clock();
+    else
+        follow_running = false;
+    if (!followed)
+        looper_status.timing.next_step_deadline += looper_status.step_period;
+    uint64_t next_us = timing_to_us(looper_status.timing.next_step_deadline);
+    uint64_t now_us = time_us_64();
+    if (next_us <= now_us) {
+        // Missed a whole step: restart the timeline instead of bursting to catch up
+        looper_status.timing.next_step_deadline = timing_from_us(now_us);
+        next_us = now_us;
+    }
+    return next_us;
+}
+
+// BTstack timer delay for `due_us`: LOOPER_TIMER_SPIN_US early, in whole ms.
+static uint32_t looper_timer_delay_ms(uint64_t due_us) {
+    uint64_t now_us = time_us_64();
+    uint64_t wait_us = (due_us > now_us) ? due_us - now_us : 0;
+    return (wait_us > LOOPER_TIMER_SPIN_US) ? (uint32_t)((wait_us - LOOPER_TIMER_SPIN_US) / 1000)
+                                            : 0;
+}
+
+static void looper_handle_timed_note_timer(btstack_timer_source_t *ts);
+
+// Arm the timed-note timer for the next note that cannot ride in a step packet.
+static void looper_schedule_timed_notes(void) {
+    btstack_run_loop_remove_timer(&timed_note_timer);
+    uint64_t due_us = looper_next_timed_note_us();
+    if (due_us == 0)
+        return;
+    btstack_run_loop_set_timer_handler(&timed_note_timer, looper_handle_timed_note_timer);
+    btstack_run_loop_set_timer(&timed_note_timer, looper_timer_delay_ms(due_us));
+    btstack_run_loop_add_timer(&timed_note_timer);
+}
+
+// Sends notes that fall between steps, at their own due time.
+static void looper_handle_timed_note_timer(btstack_timer_source_t *ts) {
+    uint64_t due_us = looper_next_timed_note_us();
+    if (due_us != 0) {
+        busy_wait_until(from_us_since_boot(due_us));
+        looper_fire_timed_notes(due_us);
+        looper_perform_flush();
+    }
+    looper_schedule_timed_notes();
+}
+
+/*
+ * Runs `looper_process_state()` at the absolute step deadline and reschedules
+ * the BTstack timer.
+ *
+ * Deadlines advance by the fixed-point step period on a single timeline, so
+ * handler time and ms timer granularity never accumulate into drift. The ms
+ * timer is armed LOOPER_TIMER_SPIN_US early and the remainder is spun out to
+ * hit the deadline to the µs.
+ *
+ * While waiting for a connection the timer is not re-armed; the BLE driver
+ * restarts it when a central connects. Notes that fall between steps (gate
+ * ends, off-grid hits) are sent from a second timer armed the same way.
+ */
 void looper_handle_tick(btstack_timer_source_t *ts) {
-    uint64_t start_us = time_us_64();
+    uint64_t start_us = looper_step_deadline_us();
+    uint64_t woke_us = time_us_64();
+    busy_wait_until(from_us_since_boot(start_us));
+    uint64_t fired_us = time_us_64();
 
     looper_process_state(start_us);
+    looper_request_service();
+    if (looper_is_idle()) {
+        looper_status.timing.next_step_deadline = 0;  // Restart the timeline on resume
+        return;
+    }
+    tick_stats_record_step(start_us, woke_us, fired_us, time_us_64());
 
-    // Re-arms the timer to fire again after `step_duration_ms`, adjusting for processing time.
-    uint64_t handler_delay_ms = (time_us_64() - start_us) / 1000;
-    uint32_t delay = (handler_delay_ms >= looper_status.step_duration_ms)
-                         ? 1
-                         : looper_status.step_duration_ms - handler_delay_ms;
-    btstack_run_loop_set_timer(ts, delay);
+    uint64_t next_us = looper_advance_deadline();
+    btstack_run_loop_set_timer(ts, looper_timer_delay_ms(next_us));
     btstack_run_loop_add_timer(ts);
+    looper_schedule_timed_notes();
 }
 
-// Poll button events, process them, and update the status LED.
-void looper_handle_input(void) {
+// Process pending console keys and button events, and update the status LED.
+static void looper_handle_input(void) {
+    for (int key; (key = console_poll_key()) != CONSOLE_NO_KEY;)
+        looper_handle_key(key);
+
     button_event_t event = button_poll_event();
+    if (LOOPER_BENCH)
+        event = BUTTON_EVENT_NONE;  // The benchmark pattern must stay as generated
     if (looper_status.state == LOOPER_STATE_TAP_TEMPO) {
         if (taptempo_handle_button_event(event) == TAP_EXIT) {
-            looper_status.state = LOOPER_STATE_PLAYING;
+            looper_send_command(COMMAND_TAP_TEMPO, 0, 0, 0);
         }
     } else {
         looper_handle_button_event(event);
     }
     looper_update_status_led();
 }
+
+// True while no central is connected and the step clock is parked.
+bool looper_is_idle(void) {
+    return looper_status.state == LOOPER_STATE_WAITING;
+}
+
+/*
+ * Time until the step clock next needs the CPU, i.e. how long a flash
+ * operation may keep interrupts (and core 1) locked out without delaying a
+ * step or a timed note. Unbounded while the clock is parked.
+ */
+static uint32_t looper_cpu_window_us(void) {
+    if (looper_is_idle())
+        return UINT32_MAX;
+#if LOOPER_DUAL_CORE
+    int32_t window_us = (int32_t)(core1_wake_us - time_us_32() - LOOPER_TIMER_SPIN_US);
+    return (window_us > 0) ? (uint32_t)window_us : 0;
+#else
+    uint64_t due_us = timing_to_us(looper_status.timing.next_step_deadline);
+    uint64_t note_us = looper_next_timed_note_us();
+    if (note_us != 0 && note_us < due_us)
+        due_us = note_us;
+    uint64_t now_us = time_us_64() + LOOPER_TIMER_SPIN_US;  // The timers fire this early
+    return (due_us > now_us) ? (uint32_t)(due_us - now_us) : 0;
+#endif
+}
+
+// Copy the persisted part of the looper state into `out`.
+static void looper_take_snapshot(looper_snapshot_t *out) {
+    memset(out, 0, sizeof(*out));
+    out->beat_period = looper_status.beat_period;
+    out->num_tracks = looper_status.num_tracks;
+    out->bars = looper_status.bars;
+    out->steps_per_beat = looper_status.steps_per_beat;
+    out->current_track = looper_status.current_track;
+    out->quantize = looper_status.quantize;
+    out->swing = looper_status.swing;
+    out->pattern_index = looper_status.pattern_index;
+    out->chain = looper_status.chain;
+    for (uint8_t p = 0; p < LOOPER_BANK_PATTERNS; p++) {
+        for (uint8_t i = 0; i < LOOPER_MAX_TRACKS; i++) {
+            const track_t *track = &bank[p].tracks[i];
+            looper_track_snapshot_t *saved = &out->tracks[p][i];
+            saved->gate = track->gate;
+            saved->swing = track->swing;
+            saved->groove = track->groove;
+            saved->pattern = track->pattern;
+            saved->levels = track->levels;
+            saved->chance = track->chance;
+            saved->ratchet = track->ratchet;
+            memcpy(saved->offset, track->offset, sizeof(track->offset));
+        }
+    }
+}
+
+/*
+ * Restore the last saved patterns, layout and tempo from flash. Called once
+ * at boot, before the step clock starts; without a valid snapshot the
+ * defaults stay.
+ */
+void looper_restore(void) {
+    if (LOOPER_BENCH)
+        return;  // The benchmark always starts from its own pattern
+    uint64_t start_us = time_us_64();
+    flash_store_init();
+    if (!flash_store_load(&snapshot, sizeof(snapshot), LOOPER_SNAPSHOT_VERSION))
+        return;
+    if (!looper_layout_valid(snapshot.num_tracks, snapshot.bars, snapshot.steps_per_beat) ||
+        snapshot.current_track >= snapshot.num_tracks || snapshot.quantize > 100 ||
+        snapshot.swing < 50 || snapshot.swing > 75 || snapshot.beat_period == 0 ||
+        snapshot.pattern_index >= LOOPER_BANK_PATTERNS)
+        return;
+
+    looper_status.num_tracks = snapshot.num_tracks;
+    looper_status.bars = snapshot.bars;
+    looper_status.steps_per_beat = snapshot.steps_per_beat;
+    looper_status.total_steps =
+        looper_status.bars * LOOPER_BEATS_PER_BAR * looper_status.steps_per_beat;
+    looper_status.current_track = snapshot.current_track;
+    looper_status.quantize = snapshot.quantize;
+    looper_status.swing = snapshot.swing;
+    looper_status.chain = snapshot.chain;
+    looper_update_beat_period(snapshot.beat_period);
+    for (uint8_t p = 0; p < LOOPER_BANK_PATTERNS; p++) {
+        for (uint8_t i = 0; i < LOOPER_MAX_TRACKS; i++) {
+            track_t *track = &bank[p].tracks[i];
+            const looper_track_snapshot_t *saved = &snapshot.tracks[p][i];
+            track->gate = saved->gate;
+            track->swing = (saved->swing >= 50 && saved->swing <= 75) ? saved->swing
+                                                                     : LOOPER_TRACK_SWING_GLOBAL;
+            track->groove = (saved->groove < groove_count()) ? saved->groove : 0;
+            track->pattern = saved->pattern;
+            track->levels = saved->levels;
+            track->chance = saved->chance;
+            track->ratchet = saved->ratchet;
+            memcpy(track->offset, saved->offset, sizeof(track->offset));
+        }
+        looper_rebuild_step_table(&bank[p]);
+    }
+    looper_select_pattern(snapshot.pattern_index);
+    snapshot_dirty = false;
+    printf("[LOOPER] Restored %u bpm, %u tracks in %u us\n", (unsigned)looper_status.bpm,
+           looper_status.num_tracks, (unsigned)(time_us_64() - start_us));
+}
+
+/*
+ * Save dirty state once edits have settled, and advance any flash write by
+ * at most one operation that fits before the next step. Called from the main
+ * loop; nothing is saved mid-recording. In dual-core mode core 1 takes the
+ * snapshot at its next step, and the save starts on the pass after that.
+ */
+static void looper_update_storage(void) {
+    if (LOOPER_BENCH)
+        return;  // Stage changes are not worth flash wear
+#if LOOPER_DUAL_CORE
+    if (snapshot_taken) {
+        snapshot_taken = snapshot_requested = false;
+        __dmb();  // Read the copy after the flag
+        if (looper_status.state == LOOPER_STATE_RECORDING ||
+            !flash_store_save(&snapshot, sizeof(snapshot), LOOPER_SNAPSHOT_VERSION))
+            snapshot_dirty = true;  // Recording began meanwhile, or a save is still pending
+    }
+#endif
+    if (snapshot_dirty && !flash_store_busy() &&
+        looper_status.state != LOOPER_STATE_RECORDING &&
+        time_us_32() - snapshot_changed_us >= LOOPER_SAVE_DELAY_US) {
+        snapshot_dirty = false;  // Edits from here on dirty it again
+#if LOOPER_DUAL_CORE
+        command_t command = {0, 0, COMMAND_SNAPSHOT, 0};
+        if (snapshot_requested || !command_queue_push(&command))
+            snapshot_dirty = true;  // Still waiting for core 1, or no room: try again later
+        else
+            snapshot_requested = true;
+#else
+        looper_take_snapshot(&snapshot);
+        if (!flash_store_save(&snapshot, sizeof(snapshot), LOOPER_SNAPSHOT_VERSION))
+            snapshot_dirty = true;
+#endif
+    }
+    flash_store_task(looper_cpu_window_us());
+}
+
+// Redraw the console view once per step, outside the timing-critical path.
+static void looper_update_display(void) {
+    uint16_t step = looper_status.current_step;
+    if (step == displayed_step)
+        return;
+    displayed_step = step;
+    display_update_looper_status(looper_perform_ready(), &looper_status, tracks,
+                                 looper_status.num_tracks);
+}
+
+/*
+ * Time until the service next has to run without being woken, or UINT32_MAX:
+ * the button's next poll, the idle blink's next edge, console output still
+ * queued, a flash write in progress, or the end of the save delay.
+ */
+static uint32_t looper_service_delay_us(bool output_pending) {
+    uint32_t delay_us = button_poll_delay_us();
+    if (looper_is_idle()) {
+        if (delay_us < LOOPER_IDLE_POLL_US)
+            delay_us = LOOPER_IDLE_POLL_US;  // BOOTSEL is sampled slowly while waiting
+        uint32_t phase_ms = (uint32_t)(time_us_64() / 1000 % LOOPER_IDLE_BLINK_MS);
+        uint32_t blink_ms = (phase_ms < LOOPER_IDLE_BLINK_ON_MS)
+                                ? LOOPER_IDLE_BLINK_ON_MS - phase_ms
+                                : LOOPER_IDLE_BLINK_MS - phase_ms;
+        if (blink_ms * 1000 < delay_us)
+            delay_us = blink_ms * 1000;
+    }
+    if ((output_pending || flash_store_busy()) && LOOPER_SERVICE_BUSY_US < delay_us)
+        delay_us = LOOPER_SERVICE_BUSY_US;
+    if (snapshot_dirty && looper_status.state != LOOPER_STATE_RECORDING) {
+        uint32_t elapsed_us = time_us_32() - snapshot_changed_us;
+        uint32_t save_us =
+            (elapsed_us < LOOPER_SAVE_DELAY_US) ? LOOPER_SAVE_DELAY_US - elapsed_us : 0;
+        if (save_us < delay_us)
+            delay_us = save_us;
+    }
+    return delay_us;
+}
+
+static void looper_handle_service_timer(btstack_timer_source_t *ts) {
+    (void)ts;
+    looper_request_service();
+}
+
+/*
+ * One service pass in BTstack context. The LED is only written when it
+ * changes, so the CYW43 bus is left to the radio the rest of the time.
+ */
+static void looper_run_service(btstack_data_source_t *ds,
+                               btstack_data_source_callback_type_t callback_type) {
+    (void)ds;
+    (void)callback_type;
+    looper_handle_input();
+    looper_update_display();
+    looper_show_wake_latency();
+    bool output_pending = display_flush();
+    looper_update_storage();
+
+    btstack_run_loop_remove_timer(&service_timer);
+    uint32_t delay_us = looper_service_delay_us(output_pending);
+    if (delay_us == UINT32_MAX)
+        return;
+    btstack_run_loop_set_timer(&service_timer, (delay_us + 999) / 1000);
+    btstack_run_loop_add_timer(&service_timer);
+}
+
+// Register the service with the BTstack run loop; call after ble_midi_init().
+void looper_start_service(void) {
+    btstack_run_loop_set_data_source_handler(&service_source, looper_run_service);
+    btstack_run_loop_enable_data_source_callbacks(&service_source, DATA_SOURCE_CALLBACK_POLL);
+    btstack_run_loop_add_data_source(&service_source);
+    btstack_run_loop_set_timer_handler(&service_timer, looper_handle_service_timer);
+    button_set_edge_callback(looper_request_service);
+    console_set_key_callback(looper_request_service);
+    looper_request_service();
+}
+
+#if LOOPER_DUAL_CORE
+/*
+ * Core 1 entry point: owns the step clock and the pattern engine.
+ * Sleeps until LOOPER_TIMER_SPIN_US before each deadline, spins out the rest,
+ * and never touches BTstack or stdio; notes leave through the note queue.
+ * Notes that fall between steps get a wake-up of their own.
+ */
+static void looper_core1_main(void) {
+    flash_safe_execute_core_init();  // Let core 0 park this core during flash writes
+    while (true) {
+        uint64_t start_us = looper_step_deadline_us();
+        uint64_t note_us = looper_next_timed_note_us();
+        uint64_t wake_us = note_us ? note_us : start_us;
+        core1_wake_us = (uint32_t)wake_us;  // For core 0's flash writes
+        if (wake_us > time_us_64() + LOOPER_TIMER_SPIN_US)
+            sleep_until(from_us_since_boot(wake_us - LOOPER_TIMER_SPIN_US));
+        uint64_t woke_us = time_us_64();
+        busy_wait_until(from_us_since_boot(wake_us));
+        uint64_t fired_us = time_us_64();
+        if (note_us) {
+            looper_fire_timed_notes(note_us);
+            looper_perform_flush();
+            continue;
+        }
+
+        looper_process_state(start_us);
+        if (looper_is_idle()) {
+            looper_status.timing.next_step_deadline = 0;
+            sleep_us(LOOPER_IDLE_POLL_US);
+            continue;
+        }
+        tick_stats_record_step(start_us, woke_us, fired_us, time_us_64());
+        looper_advance_deadline();
+    }
+}
+
+// Start the sequencer on core 1 with its output drained on core 0.
+void looper_launch_core1(void) {
+    note_queue_init(looper_drain_output);
+    multicore_launch_core1(looper_core1_main);
+}
+#endif
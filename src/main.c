@@ -10,26 +10,52 @@
 #include "pico/cyw43_arch.h"
 #include "pico/stdlib.h"
 
+#include "boot_trace.h"
 #include "looper.h"
 #include "drivers/ble_midi.h"
+#include "drivers/button.h"
 
 /*
  * Entry point for the Pico MIDI Looper application.
  *
- * Looper is driven by two input sources:
+ * Everything runs from the BTstack run loop:
  *  - Timer ticks (looper_handle_tick) for sequencer state progression
- *  - Button events (looper_handle_input) for user-driven updates
+ *  - The looper service for button, console, LED, display and storage,
+ *    woken by input IRQs and steps rather than polled
+ *
+ * With LOOPER_DUAL_CORE the step clock runs on core 1 instead of a BTstack timer.
+ * While no central is connected the step clock is parked and the CPU sleeps
+ * between idle blinks.
+ *
+ * The radio is powered up before the saved session is restored: BTstack runs
+ * the HCI init sequence in the background while flash is read, and the step
+ * clock starts only once the restored tempo is known.
  */
 int main(void) {
     stdio_init_all();
+    boot_trace_mark(BOOT_MARK_STDIO);
     cyw43_arch_init();
+    boot_trace_mark(BOOT_MARK_CYW43);
+    button_init();
+    looper_init();
     looper_update_bpm(LOOPER_DEFAULT_BPM);
-    ble_midi_init(looper_handle_tick, looper_get_step_interval_ms());
+#if LOOPER_DUAL_CORE
+    ble_midi_init(NULL);
+#else
+    ble_midi_init(looper_handle_tick);
+#endif
+    boot_trace_mark(BOOT_MARK_RADIO);
+    looper_restore();
+    boot_trace_mark(BOOT_MARK_RESTORE);
+#if LOOPER_DUAL_CORE
+    looper_launch_core1();
+#else
+    ble_midi_start_step_timer(looper_get_step_interval_ms());
+#endif
+    looper_start_service();
 
     printf("[MAIN] Pico MIDI Looper start\n");
-    while (true) {
-        looper_handle_input();
-        sleep_us(500);
-    }
+    boot_trace_mark(BOOT_MARK_RUN_LOOP);
+    btstack_run_loop_execute();
     return 0;
 }
@@ -0,0 +1,67 @@
+/*
+ * note_queue.c
+ *
+ * Lock-free single-producer/single-consumer queue that carries finished note
+ * events from the sequencer on core 1 to the BLE stack on core 0.
+ * The producer never blocks: a full queue drops the event. The consumer runs
+ * as an async_context worker, so it executes in the same context as BTstack.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "hardware/sync.h"
+#include "pico/cyw43_arch.h"
+
+#include "note_queue.h"
+
+#define NOTE_QUEUE_MASK (NOTE_QUEUE_SIZE - 1)
+
+static note_event_t events[NOTE_QUEUE_SIZE];
+static volatile uint32_t head = 0;  // written by the producer only
+static volatile uint32_t tail = 0;  // written by the consumer only
+
+static void (*consumer_cb)(void) = NULL;
+static async_when_pending_worker_t consumer_worker;
+
+static void note_queue_do_work(async_context_t *context, async_when_pending_worker_t *worker) {
+    (void)context;
+    (void)worker;
+    if (consumer_cb != NULL)
+        consumer_cb();
+}
+
+// Registers `consumer` to drain the queue; must be called on core 0.
+void note_queue_init(void (*consumer)(void)) {
+    consumer_cb = consumer;
+    consumer_worker.do_work = note_queue_do_work;
+    async_context_add_when_pending_worker(cyw43_arch_async_context(), &consumer_worker);
+}
+
+// Producer side. Returns false and drops the event if the queue is full.
+bool note_queue_push(const note_event_t *event) {
+    uint32_t h = head;
+    if (h - tail >= NOTE_QUEUE_SIZE)
+        return false;
+    events[h & NOTE_QUEUE_MASK] = *event;
+    __dmb();  // publish the payload before the index
+    head = h + 1;
+    return true;
+}
+
+// Consumer side. Returns false when the queue is empty.
+bool note_queue_pop(note_event_t *event) {
+    uint32_t t = tail;
+    if (t == head)
+        return false;
+    __dmb();  // read the payload after observing the index
+    *event = events[t & NOTE_QUEUE_MASK];
+    __dmb();
+    tail = t + 1;
+    return true;
+}
+
+// Wakes the consumer on core 0; safe to call from the other core.
+void note_queue_notify(void) {
+    async_context_set_work_pending(cyw43_arch_async_context(), &consumer_worker);
+}
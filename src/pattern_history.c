@@ -0,0 +1,152 @@
+/*
+ * pattern_history.c
+ *
+ * Multi-level undo/redo of the bit-packed track patterns. Each edit is kept
+ * as XOR deltas of the 32-bit pattern words it changed, in a fixed ring of
+ * PATTERN_HISTORY_SIZE deltas (6 bytes each). Recording a hit costs one
+ * delta and a take's clear one per non-empty word, so the ring holds dozens
+ * of undo steps. XOR is its own inverse: undo and redo apply the same deltas,
+ * and their cost depends only on the size of the step, not on the history.
+ *
+ * An undo step is everything recorded between two pattern_history_begin()
+ * calls. When the ring is full the oldest steps are dropped, whole. The
+ * history is driven from the step path only and needs no locking.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "pattern_history.h"
+
+#define HISTORY_MASK (PATTERN_HISTORY_SIZE - 1)
+#define WHERE_STEP_START 0x8000u  // First delta of an undo step
+
+/*
+ * Ring positions count up forever and are masked on access:
+ * first <= cursor <= end, end - first <= PATTERN_HISTORY_SIZE. Deltas before
+ * `cursor` are applied (undoable), the ones after it were undone (redoable).
+ */
+static uint32_t delta_bits[PATTERN_HISTORY_SIZE];
+static uint16_t delta_where[PATTERN_HISTORY_SIZE];  // Step start, pattern, track, word
+static uint32_t first = 0;
+static uint32_t cursor = 0;
+static uint32_t end = 0;
+static uint32_t step_start = 0;  // First delta of the step being recorded
+static bool step_open = false;   // Deltas recorded now extend the step at `step_start`
+static bool step_lost = false;   // The current step outgrew the ring and is not kept
+static uint8_t undo_steps = 0;
+static uint8_t redo_steps = 0;
+
+static uint16_t history_where(uint8_t pattern, uint8_t track, uint8_t word) {
+    return (uint16_t)((pattern & 0x3F) << 9 | (track & 0x1F) << 4 | (word & 0x0F));
+}
+
+// XOR one delta back into the patterns, through the caller.
+static void history_apply(uint32_t position, pattern_history_apply_cb_t apply) {
+    uint16_t where = delta_where[position & HISTORY_MASK];
+    apply((where >> 9) & 0x3F, (where >> 4) & 0x1F, where & 0x0F,
+          delta_bits[position & HISTORY_MASK]);
+}
+
+static bool history_starts_step(uint32_t position) {
+    return delta_where[position & HISTORY_MASK] & WHERE_STEP_START;
+}
+
+/*
+ * Forget every step, e.g. after the patterns were re-gridded or reloaded.
+ * Positions keep counting, so an older mark cannot match a newer step.
+ */
+void pattern_history_reset(void) {
+    first = cursor = step_start = end;
+    step_open = false;
+    undo_steps = redo_steps = 0;
+}
+
+// Close the current undo step; the next delta recorded starts a new one.
+void pattern_history_begin(void) {
+    step_open = false;
+    step_lost = false;
+}
+
+/*
+ * Record that `bits` of word `word` of a track's pattern are about to flip.
+ * A second change of the same word within a step is merged into its delta.
+ * Starting a step drops the redo history.
+ */
+void pattern_history_record(uint8_t pattern, uint8_t track, uint8_t word, uint32_t bits) {
+    if (bits == 0 || step_lost)
+        return;
+    uint16_t where = history_where(pattern, track, word);
+    if (step_open) {
+        for (uint32_t p = step_start; p != end; p++) {
+            if ((delta_where[p & HISTORY_MASK] & ~WHERE_STEP_START) == where) {
+                delta_bits[p & HISTORY_MASK] ^= bits;
+                return;
+            }
+        }
+    } else {
+        end = cursor;
+        redo_steps = 0;
+        step_start = end;
+        step_open = true;
+        where |= WHERE_STEP_START;
+        undo_steps++;
+    }
+    if (end - first == PATTERN_HISTORY_SIZE) {
+        if (first == step_start) {
+            // The step alone outgrew the ring: it cannot be undone, and neither can older ones
+            pattern_history_reset();
+            step_lost = true;
+            return;
+        }
+        do {
+            first++;  // Drop the oldest step, whole
+        } while (first != step_start && !history_starts_step(first));
+        undo_steps--;
+    }
+    delta_bits[end & HISTORY_MASK] = bits;
+    delta_where[end & HISTORY_MASK] = where;
+    end++;
+    cursor = end;
+}
+
+// Revert the newest applied step. Returns false when there is none.
+bool pattern_history_undo(pattern_history_apply_cb_t apply) {
+    if (cursor == first)
+        return false;
+    step_open = false;
+    do {
+        cursor--;
+        history_apply(cursor, apply);
+    } while (!history_starts_step(cursor));
+    undo_steps--;
+    redo_steps++;
+    return true;
+}
+
+// Re-apply the step undone last. Returns false when there is none.
+bool pattern_history_redo(pattern_history_apply_cb_t apply) {
+    if (cursor == end)
+        return false;
+    step_open = false;
+    do {
+        history_apply(cursor, apply);
+        cursor++;
+    } while (cursor != end && !history_starts_step(cursor));
+    undo_steps++;
+    redo_steps--;
+    return true;
+}
+
+// Position after the newest applied step, for a later pattern_history_undo_to().
+uint32_t pattern_history_mark(void) { return cursor; }
+
+// Undo every step applied since `mark`, or as many of them as are still kept.
+void pattern_history_undo_to(uint32_t mark, pattern_history_apply_cb_t apply) {
+    while ((int32_t)(cursor - mark) > 0 && pattern_history_undo(apply))
+        ;
+}
+
+uint8_t pattern_history_undo_steps(void) { return undo_steps; }
+
+uint8_t pattern_history_redo_steps(void) { return redo_steps; }
@@ -16,11 +16,13 @@
 #include "pico/time.h"
 
 #include "tap_tempo.h"
+#include "timing.h"
 
 // Configuration constants
 enum {
     TAP_MIN_BPM = 40,  // clamp lower bound
     TAP_MAX_BPM = 240,
+    TAP_DEFAULT_BPM = 120,  // reported before the first two taps
     TAP_MAX_TAPS = 4,
     TIMEOUT_US = 1000 * 1000,  // 1 s idle-timeout
 };
@@ -36,25 +38,20 @@ typedef struct {
 } tap_ctx_t;
 
 static tap_ctx_t ctx = {0};
-static uint16_t latest_bpm = 120;
+static timing_fx_t latest_beat_period = 0;
 
-// convert intervals to BPM and clamp to range
-static uint16_t calc_bpm(uint64_t first_us, uint64_t last_us, uint8_t intervals) {
+// convert intervals to a beat period, kept in fixed point, and clamp to range
+static timing_fx_t calc_beat_period(uint64_t first_us, uint64_t last_us, uint8_t intervals) {
     uint64_t delta_us = last_us - first_us;
-    if (delta_us == 0)
-        return TAP_MIN_BPM;
-
-    // Convert µs interval to BPM using integer math
-    uint32_t delta_ms = (uint32_t)((delta_us + 500) / 1000);
-    uint32_t bpm = (60000U * intervals + delta_ms / 2) / delta_ms;
+    timing_fx_t period = timing_beat_period_from_span(delta_us, intervals);
 
     // clamp to TAP_MIN_BPM .. TAP_MAX_BPM
-    if (bpm < TAP_MIN_BPM)
-        bpm = TAP_MIN_BPM;
-    if (bpm > TAP_MAX_BPM)
-        bpm = TAP_MAX_BPM;
+    if (period > timing_beat_period(TAP_MIN_BPM))
+        period = timing_beat_period(TAP_MIN_BPM);
+    if (period < timing_beat_period(TAP_MAX_BPM))
+        period = timing_beat_period(TAP_MAX_BPM);
 
-    return (uint16_t)bpm;
+    return period;
 }
 
 // Public API: main FSM event handler
@@ -87,7 +84,8 @@ tap_result_t taptempo_handle_event(button_event_t ev) {
                     ctx.stamp[ctx.count++] = now;
 
                 if (ctx.count >= 2) {
-                    latest_bpm = calc_bpm(ctx.stamp[0], ctx.stamp[ctx.count - 1], ctx.count - 1);
+                    latest_beat_period =
+                        calc_beat_period(ctx.stamp[0], ctx.stamp[ctx.count - 1], ctx.count - 1);
                 }
                 /* 2 taps → PRELIM, 3 taps → FINAL, 4 taps → FINAL+reset */
                 if (ctx.count == 2) {
@@ -107,5 +105,8 @@ tap_result_t taptempo_handle_event(button_event_t ev) {
     }
 }
 
-uint16_t taptempo_get_bpm(void) { return latest_bpm; }
+timing_fx_t taptempo_get_beat_period(void) {
+    return latest_beat_period ? latest_beat_period : timing_beat_period(TAP_DEFAULT_BPM);
+}
+uint16_t taptempo_get_bpm(void) { return (uint16_t)timing_bpm(taptempo_get_beat_period()); }
 bool taptempo_active(void) { return ctx.state == TT_COLLECT; }
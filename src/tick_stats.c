@@ -0,0 +1,113 @@
+/*
+ * tick_stats.c
+ *
+ * On-device latency and jitter instrumentation of the step path. Every step
+ * records how late it fired against its absolute deadline, how early the
+ * timer woke before spinning, and how long the handler ran; every flush
+ * records whether the packet went out at once and the BLE-MIDI queue depth.
+ * Samples go into fixed-size histograms, so recording is a few integer
+ * operations with no allocation and can stay enabled in every build.
+ *
+ * In dual-core mode steps are recorded on core 1 and flushes on core 0 into
+ * separate fields; a report read while a sample lands may be off by one.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "tick_stats.h"
+
+static tick_stats_t stats = {0};
+
+// Bucket of a µs sample: 0, then one bucket per power of two.
+static uint8_t time_bucket(uint32_t us) {
+    uint8_t bucket = (us == 0) ? 0 : 32 - __builtin_clz(us);
+    return (bucket < TICK_STATS_BUCKETS) ? bucket : TICK_STATS_BUCKETS - 1;
+}
+
+static void histogram_add(tick_histogram_t *histogram, uint8_t bucket, uint32_t sample) {
+    histogram->count[bucket]++;
+    if (sample > histogram->max)
+        histogram->max = sample;
+}
+
+static void histogram_add_us(tick_histogram_t *histogram, uint64_t us) {
+    uint32_t sample = (us > UINT32_MAX) ? UINT32_MAX : (uint32_t)us;
+    histogram_add(histogram, time_bucket(sample), sample);
+}
+
+/*
+ * Record one performed step: its deadline, when the timer woke, when the
+ * spin-wait released it and when the handler finished.
+ */
+void tick_stats_record_step(uint64_t scheduled_us, uint64_t woke_us, uint64_t fired_us,
+                            uint64_t done_us) {
+    stats.steps++;
+    histogram_add_us(&stats.lateness, fired_us - scheduled_us);
+    histogram_add_us(&stats.wake_margin, (woke_us < scheduled_us) ? scheduled_us - woke_us : 0);
+    histogram_add_us(&stats.duration, done_us - fired_us);
+}
+
+// Record one flush to BLE-MIDI and the packets it left queued.
+void tick_stats_record_flush(uint16_t queue_depth) {
+    stats.flushes++;
+    if (queue_depth > 0)
+        stats.flushes_deferred++;
+    uint8_t bucket = (queue_depth < TICK_STATS_BUCKETS) ? queue_depth : TICK_STATS_BUCKETS - 1;
+    histogram_add(&stats.queue_depth, bucket, queue_depth);
+}
+
+// Record a note event the sequencer could not hand to the BLE core.
+void tick_stats_record_dropped_event(void) { stats.events_dropped++; }
+
+const tick_stats_t *tick_stats_get(void) { return &stats; }
+
+void tick_stats_reset(void) { memset(&stats, 0, sizeof(stats)); }
+
+// Append one histogram line, listing only non-empty buckets.
+static size_t format_histogram(char *buffer, size_t size, const char *label,
+                               const tick_histogram_t *histogram, bool time) {
+    size_t len = snprintf(buffer, size, "%-12s max %-6lu", label, (unsigned long)histogram->max);
+    for (uint8_t i = 0; i < TICK_STATS_BUCKETS && len < size; i++) {
+        if (histogram->count[i] == 0)
+            continue;
+        unsigned long bound = time ? (1ul << i) : i;  // Times print their exclusive bound
+        const char *prefix = time ? "<" : "";
+        if (i == TICK_STATS_BUCKETS - 1) {
+            bound = time ? bound / 2 : bound;
+            prefix = ">=";
+        }
+        len += snprintf(buffer + len, size - len, " %s%lu:%lu", prefix, bound,
+                        (unsigned long)histogram->count[i]);
+    }
+    if (len < size)
+        len += snprintf(buffer + len, size - len, "\n");
+    return len;
+}
+
+/*
+ * Render the histograms as text, one line each, e.g.
+ * "lateness us max 3      <1:980 <2:15 <4:5", a count per bucket bound.
+ * Returns the length written, truncated to fit `size`.
+ */
+size_t tick_stats_format(char *buffer, size_t size) {
+    size_t len = snprintf(buffer, size,
+                          "steps %lu  flushes %lu (%lu deferred)  events dropped %lu\n",
+                          (unsigned long)stats.steps, (unsigned long)stats.flushes,
+                          (unsigned long)stats.flushes_deferred,
+                          (unsigned long)stats.events_dropped);
+    if (len < size)
+        len += format_histogram(buffer + len, size - len, "lateness us", &stats.lateness, true);
+    if (len < size)
+        len += format_histogram(buffer + len, size - len, "wake us", &stats.wake_margin, true);
+    if (len < size)
+        len += format_histogram(buffer + len, size - len, "handler us", &stats.duration, true);
+    if (len < size)
+        len += format_histogram(buffer + len, size - len, "queue depth", &stats.queue_depth,
+                                false);
+    return (len < size) ? len : size - 1;
+}
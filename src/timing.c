@@ -0,0 +1,45 @@
+/*
+ * timing.c
+ *
+ * Fixed-point tempo and timing math shared by the sequencer and tap tempo.
+ * Integer-only: the RP2040 has no FPU, and soft-float division and round()
+ * would cost thousands of cycles on the tick and quantize paths.
+ *
+ * Copyright 2025, Hiroyuki OYAMA
+ *
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include "timing.h"
+
+#define TIMING_US_PER_MINUTE 60000000ULL
+
+// Signed integer division rounded to nearest, ties away from zero; `d` > 0.
+int64_t timing_div_round(int64_t n, int64_t d) {
+    return (n >= 0 ? n + d / 2 : n - d / 2) / d;
+}
+
+// Length of one beat at `bpm`.
+timing_fx_t timing_beat_period(uint32_t bpm) {
+    return ((TIMING_US_PER_MINUTE << TIMING_FRAC_BITS) + bpm / 2) / bpm;
+}
+
+// Length of one beat when `beats` beats span `span_us` (e.g. between taps).
+timing_fx_t timing_beat_period_from_span(uint64_t span_us, uint8_t beats) {
+    return (timing_from_us(span_us) + beats / 2) / beats;
+}
+
+// Tempo of `beat_period`, rounded to the nearest BPM.
+uint32_t timing_bpm(timing_fx_t beat_period) {
+    return (uint32_t)(((TIMING_US_PER_MINUTE << TIMING_FRAC_BITS) + beat_period / 2) /
+                      beat_period);
+}
+
+// `delta_us` measured in 1/`units` of `period`, rounded to nearest.
+int64_t timing_ticks(int64_t delta_us, timing_fx_t period, uint32_t units) {
+    return timing_div_round(delta_us * ((int64_t)units << TIMING_FRAC_BITS), (int64_t)period);
+}
+
+// Length of `ticks` 1/`units` of `period` in µs, truncated toward zero.
+int64_t timing_ticks_us(int64_t ticks, timing_fx_t period, uint32_t units) {
+    return ticks * (int64_t)period / ((int64_t)units << TIMING_FRAC_BITS);
+}
@@ -0,0 +1,206 @@
+#!/usr/bin/env python3
+#
+# bench_latency.py
+#
+# Host side of the BLE-MIDI latency benchmark. Flash the
+# pico-midi-looper-ble-bench firmware, then run this script: it connects as a
+# BLE-MIDI central, records when every notification arrives, and reports per
+# benchmark stage (tempo, notes per step):
+#
+#   - latency: round-trip time of loopback probes / 2, plus how much later
+#     than the fastest note of the stage each note arrived
+#   - jitter: spread of the arrival delay against the device's own timestamps
+#   - coalescing: MIDI messages per notification
+#   - drops: expected pattern notes that never arrived
+#
+# Requires Python 3.9+ and bleak (pip install bleak).
+#
+# Copyright 2025, Hiroyuki OYAMA
+#
+# SPDX-License-Identifier: BSD-3-Clause
+
+import argparse
+import asyncio
+import statistics
+import sys
+import time
+
+from bleak import BleakClient, BleakScanner
+
+MIDI_CHARACTERISTIC = "7772e5db-3868-4112-a1a9-f2669d106bf3"
+
+# Must match bench_stages[] and LOOPER_BENCH_STAGE_LOOPS in src/looper.c.
+STAGES = [  # (bpm, tracks, steps per beat)
+    (90, 1, 4), (120, 1, 4), (120, 4, 4), (120, 16, 4),
+    (180, 4, 4), (240, 8, 4), (300, 16, 4), (120, 4, 8),
+]
+STAGE_LOOPS = 8
+BEATS_PER_BAR = 4
+MARKER_CHANNEL = 15  # MIDI channel 16
+PROBE_STATUS = 0xB0 | MARKER_CHANNEL  # Control change, echoed by the firmware
+PROBE_INTERVAL_S = 0.25
+
+
+def now_ms():
+    return time.perf_counter_ns() / 1e6
+
+
+def parse_packet(data):
+    """Yields (timestamp_ms_13bit, status, data1, data2) from a BLE-MIDI packet."""
+    if len(data) < 3 or not data[0] & 0x80:
+        return
+    high = data[0] & 0x3F
+    last_low = None
+    status = None
+    i = 1
+    while i < len(data):
+        if data[i] & 0x80:
+            low = data[i] & 0x7F
+            if last_low is not None and low < last_low:
+                high = (high + 1) & 0x3F  # Low part wrapped within the packet
+            last_low = low
+            i += 1
+            if i < len(data) and data[i] & 0x80:
+                status = data[i]
+                i += 1
+        if status is None or last_low is None or i + 1 >= len(data):
+            return
+        yield (high << 7) | last_low, status, data[i], data[i + 1]
+        i += 2
+
+
+class Stage:
+    def __init__(self, index):
+        self.index = index
+        self.bpm, self.tracks, self.steps_per_beat = STAGES[index]
+        self.notes = []  # (arrival_ms, device_ms)
+        self.packets = 0
+        self.messages = 0
+
+    def expected_notes(self):
+        return STAGE_LOOPS * BEATS_PER_BAR * self.steps_per_beat * self.tracks
+
+
+class Bench:
+    def __init__(self):
+        self.stages = {}
+        self.current = None
+        self.done = False
+        self.device_ms = None  # Unwrapped device time of the last message
+        self.probes = {}
+        self.rtts = []
+
+    def unwrap(self, ts13):
+        if self.device_ms is None:
+            self.device_ms = ts13
+            return ts13
+        delta = (ts13 - self.device_ms) % 8192
+        if delta > 4096:
+            delta -= 8192  # Slightly out of order, not a wrap
+        self.device_ms += delta
+        return self.device_ms
+
+    def on_notify(self, _sender, data):
+        arrival = now_ms()
+        messages = list(parse_packet(bytes(data)))
+        if self.current is not None:
+            self.current.packets += 1
+            self.current.messages += len(messages)
+        for ts13, status, data1, data2 in messages:
+            if status == PROBE_STATUS:
+                sent = self.probes.pop(data1 | (data2 << 7), None)
+                if sent is not None:
+                    self.rtts.append(arrival - sent)
+                continue
+            device = self.unwrap(ts13)
+            channel = status & 0x0F
+            if status & 0xF0 != 0x90 or data2 == 0:
+                continue
+            if channel == MARKER_CHANNEL:
+                self.start_stage(data1)
+            elif self.current is not None:
+                self.current.notes.append((arrival, device))
+
+    def start_stage(self, index):
+        if index >= len(STAGES):
+            return
+        if self.current is not None:
+            self.stages[self.current.index] = self.current
+        if len(self.stages) == len(STAGES):
+            self.done = True
+            self.current = None
+            return
+        self.current = Stage(index)
+        print(f"stage {index}: {self.current.bpm} bpm, {self.current.tracks} notes/step",
+              file=sys.stderr)
+
+
+def percentile(values, fraction):
+    ordered = sorted(values)
+    return ordered[min(len(ordered) - 1, int(fraction * len(ordered)))]
+
+
+def report(bench):
+    one_way = min(bench.rtts) / 2 if bench.rtts else 0.0
+    if bench.rtts:
+        print(f"loopback RTT ms: min {min(bench.rtts):.2f}  "
+              f"p50 {percentile(bench.rtts, 0.5):.2f}  p99 {percentile(bench.rtts, 0.99):.2f}")
+    else:
+        print("loopback RTT: no probe came back; latency below is relative to the fastest note")
+    print(f"{'bpm':>4} {'notes':>5} {'res':>4} {'sent':>5} {'recv':>5} {'drops':>5} "
+          f"{'msg/pkt':>7} {'lat p50':>7} {'lat p99':>7} {'jitter':>6}")
+    for index in range(len(STAGES)):
+        stage = bench.stages.get(index)
+        if stage is None:
+            continue
+        delays = [arrival - device for arrival, device in stage.notes]
+        if not delays:
+            continue
+        floor = min(delays)
+        extra = [d - floor for d in delays]
+        expected = stage.expected_notes()
+        drops = max(0, expected - len(stage.notes))
+        ratio = stage.messages / stage.packets if stage.packets else 0.0
+        jitter = statistics.pstdev(extra)
+        print(f"{stage.bpm:>4} {stage.tracks:>5} 1/{stage.steps_per_beat * 4:<2} "
+              f"{expected:>5} {len(stage.notes):>5} {drops:>5} {ratio:>7.2f} "
+              f"{one_way + percentile(extra, 0.5):>7.2f} {one_way + percentile(extra, 0.99):>7.2f} "
+              f"{jitter:>6.2f}")
+
+
+async def probe(client, bench):
+    sequence = 0
+    while not bench.done:
+        ms = int(now_ms()) & 0x1FFF
+        seq = sequence & 0x3FFF
+        packet = bytes([0x80 | (ms >> 7), 0x80 | (ms & 0x7F), PROBE_STATUS, seq & 0x7F, seq >> 7])
+        bench.probes[seq] = now_ms()
+        await client.write_gatt_char(MIDI_CHARACTERISTIC, packet, response=False)
+        sequence += 1
+        await asyncio.sleep(PROBE_INTERVAL_S)
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__)
+    parser.add_argument("--name", default="Pico", help="advertised name prefix")
+    parser.add_argument("--timeout", type=float, default=300, help="give up after seconds")
+    args = parser.parse_args()
+
+    device = await BleakScanner.find_device_by_filter(
+        lambda d, _ad: (d.name or "").startswith(args.name), timeout=20)
+    if device is None:
+        sys.exit(f"no device named {args.name}* found")
+    bench = Bench()
+    async with BleakClient(device) as client:
+        await client.start_notify(MIDI_CHARACTERISTIC, bench.on_notify)
+        prober = asyncio.create_task(probe(client, bench))
+        deadline = time.monotonic() + args.timeout
+        while not bench.done and time.monotonic() < deadline:
+            await asyncio.sleep(0.1)
+        bench.done = True
+        await prober
+    report(bench)
+
+
+if __name__ == "__main__":
+    asyncio.run(main())